@@ -0,0 +1,9 @@
+// bench.h
+#pragma once
+#include <map>
+#include <string>
+
+// Runs the named loopback benchmark with "--name=value" style `flags`.
+// Returns a process exit code.
+int runBenchmark(const std::string& name,
+                 const std::map<std::string, std::string>& flags);
@@ -3,11 +3,11 @@
 #include <zstd.h>
 #include <iostream>
 
-bool compressChunk(const std::vector<char>& in, std::vector<char>& out) {
+bool compressChunk(const std::vector<char>& in, std::vector<char>& out, int level) {
   size_t maxCSize = ZSTD_compressBound(in.size());
   out.resize(maxCSize);
   size_t cSize = ZSTD_compress(out.data(), maxCSize,
-                               in.data(), in.size(), 3);
+                               in.data(), in.size(), level);
   if (ZSTD_isError(cSize)) {
     std::cerr << "Zstd error: " << ZSTD_getErrorName(cSize) << "\n";
     return false;
@@ -20,11 +20,21 @@ bool decompressChunk(const std::vector<char>& in,
                      std::vector<char>& out,
                      size_t origSize) {
   out.resize(origSize);
-  size_t dSize = ZSTD_decompress(out.data(), origSize,
+  return decompressChunkInto(in, out.data(), origSize);
+}
+
+bool decompressChunkInto(const std::vector<char>& in,
+                         char* dst,
+                         size_t origSize) {
+  size_t dSize = ZSTD_decompress(dst, origSize,
                                  in.data(), in.size());
   if (ZSTD_isError(dSize)) {
     std::cerr << "Zstd error: " << ZSTD_getErrorName(dSize) << "\n";
     return false;
   }
+  if (dSize != origSize) {
+    std::cerr << "Zstd error: expected " << origSize << " bytes, got " << dSize << "\n";
+    return false;
+  }
   return true;
 }
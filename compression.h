@@ -1,12 +1,19 @@
 // Compression.h
 #pragma once
 #include <vector>
+#include <cstddef>
 
-// Compresses `in` → `out`, returns true on success
+// Compresses `in` → `out` at zstd `level`, returns true on success
 bool compressChunk(const std::vector<char>& in,
-                   std::vector<char>& out);
+                   std::vector<char>& out,
+                   int level = 3);
 
 // Decompresses `in` → `out`, knowing the original size
 bool decompressChunk(const std::vector<char>& in,
                      std::vector<char>& out,
-                     size_t origSize);
\ No newline at end of file
+                     size_t origSize);
+
+// Decompresses `in` straight into `origSize` bytes at `dst`
+bool decompressChunkInto(const std::vector<char>& in,
+                         char* dst,
+                         size_t origSize);
\ No newline at end of file
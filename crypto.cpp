@@ -1,16 +1,40 @@
 // crypto.cpp
 // Implements zero-knowledge X25519 key exchange using libsodium (raw scalar multiplication)
 
+#include "crypto.h"
+#include "trust.h"         // Trust::loadIdentity, sign, verify, admit
+
 #include <sodium.h>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Signed by each end's identity key: both ephemeral keys, the signer's
+// first, so a signature can't be replayed into another exchange.
+static std::string identityTranscript(const unsigned char* signerPub, const unsigned char* otherPub) {
+    return std::string("QDIDENT1") +
+           std::string(reinterpret_cast<const char*>(signerPub), crypto_scalarmult_BYTES) +
+           std::string(reinterpret_cast<const char*>(otherPub), crypto_scalarmult_BYTES);
+}
 
-// Performs a raw X25519 ECDH handshake over the given connected socket fd.
+// Address of the other end of `fd`, for the trust prompt and store.
+static std::string peerAddress(int fd) {
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    char ip[INET_ADDRSTRLEN] = "?";
+    if (getpeername(fd, (sockaddr*)&addr, &len) == 0) inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    return ip;
+}
+
+// Performs a raw X25519 ECDH handshake over the given connected socket fd,
+// then authenticates the peer's identity key.
 // On success, sessionKey is filled with 32 bytes of shared secret.
 // Returns true on success, false on any error.
-bool doKeyExchange(int fd, std::vector<unsigned char>& sessionKey) {
+bool doKeyExchange(int fd, std::vector<unsigned char>& sessionKey, bool confirm) {
     // Initialize libsodium
     if (sodium_init() < 0) {
         std::cerr << "libsodium initialization failed" << std::endl;
@@ -55,8 +79,38 @@ bool doKeyExchange(int fd, std::vector<unsigned char>& sessionKey) {
                        nullptr, 0);
     uint16_t code = (uint16_t(hash[0]) << 8) | uint16_t(hash[1]);
     code %= 10000;  // reduce to 0-9999
-    std::cout << "Verify code: " << code << std::endl;
-    std::string input; std::getline(std::cin, input);
 
-    return true;
+    // 6. Exchange [identity key][signature]; benchmarks sign with a
+    //    throwaway key rather than create one for the user.
+    unsigned char mine[Trust::PUBLIC_KEY_BYTES + Trust::SIGNATURE_BYTES];
+    std::string transcript = identityTranscript(my_pub, peer_pub);
+    if (confirm) {
+        if (!Trust::loadIdentity(mine) || !Trust::sign(transcript, mine + Trust::PUBLIC_KEY_BYTES)) {
+            std::cerr << "No identity key to sign with" << std::endl;
+            return false;
+        }
+    } else {
+        unsigned char sk[crypto_sign_SECRETKEYBYTES];
+        crypto_sign_keypair(mine, sk);
+        crypto_sign_detached(mine + Trust::PUBLIC_KEY_BYTES, nullptr,
+                             reinterpret_cast<const unsigned char*>(transcript.data()), transcript.size(), sk);
+    }
+    if (send(fd, mine, sizeof mine, 0) != (ssize_t)sizeof mine) {
+        perror("send identity");
+        return false;
+    }
+    unsigned char theirs[sizeof mine];
+    if (recv(fd, theirs, sizeof theirs, MSG_WAITALL) != (ssize_t)sizeof theirs) {
+        perror("recv peer identity");
+        return false;
+    }
+    if (!Trust::verify(identityTranscript(peer_pub, my_pub), theirs + Trust::PUBLIC_KEY_BYTES, theirs)) {
+        std::cerr << "Peer's identity signature is invalid" << std::endl;
+        return false;
+    }
+
+    // 7. Known peers go straight through; a new one shows the verify
+    //    code and is admitted as Trust::policy() says.
+    if (!confirm) return true;
+    return Trust::admit(Trust::fingerprint(theirs), peerAddress(fd), code);
 }
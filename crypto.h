@@ -1,7 +1,11 @@
 #pragma once
 #include <vector>
 
-// Performs an X25519 ECDH handshake over a connected socket (fd).
+// Performs an X25519 ECDH handshake over a connected socket (fd), in
+// which both ends also sign the exchange with their identity keys.
 // On success, sessionKey is filled with 32 bytes of shared secret.
-// Returns true on success, false on error.
-bool doKeyExchange(int fd, std::vector<unsigned char>& sessionKey);
\ No newline at end of file
+// Unless `confirm` is false (in-process benchmarks), the peer's identity
+// must be in the trust store or be admitted by Trust::admit, which shows
+// the verify code and may ask the user.
+// Returns true on success, false on error or if the peer isn't trusted.
+bool doKeyExchange(int fd, std::vector<unsigned char>& sessionKey, bool confirm = true);
\ No newline at end of file
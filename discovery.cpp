@@ -0,0 +1,772 @@
+// discovery.cpp
+// LAN discovery: beacons, queries and the listener that records them.
+
+#include "discovery.h"
+#include "progress.h"      // Progress::activeCount
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <string_view>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cmath>
+#include <functional>
+#ifndef _WIN32
+  #include <sys/select.h>
+  #include <sys/socket.h>
+  #include <sys/statvfs.h>
+  #include <ifaddrs.h>
+  #include <net/if.h>
+#endif
+
+namespace Discovery {
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const char  MAGIC[4]    = { 'Q', 'D', 'P', '1' };
+const char* TEXT_BEACON = "QUICKDROP_DISCOVERY:";
+
+const int    MAX_PROBED           = 16;
+const double PROBE_MAX_MB_PER_SEC = 10000;   // what a train too tight to time counts as
+const double CORE_MB_PER_SEC      = 400;     // rough zstd + ChaCha20 receive rate per core
+
+// What this process advertises while it is listening.
+std::mutex  g_advertMutex;
+int         g_advertPort = 0;   // 0 = not listening
+std::string g_advertAlias;
+std::string g_advertPin;
+std::string g_advertDir;
+uint64_t    g_advertInstance  = 0;
+uint16_t    g_advertProbePort = 0;
+uint64_t    g_advertChanges   = 0;   // bumped by setAdvertised()
+
+// How often a broadcaster with nothing to do looks at its stop flag.
+const auto STOP_CHECK_INTERVAL = std::chrono::milliseconds(250);
+
+void put16(char* p, uint16_t v) { p[0] = char(v >> 8); p[1] = char(v); }
+uint16_t get16(const char* p) { return uint16_t(uint8_t(p[0]) << 8 | uint8_t(p[1])); }
+void put32(char* p, uint32_t v) { put16(p, uint16_t(v >> 16)); put16(p + 2, uint16_t(v)); }
+uint32_t get32(const char* p) { return uint32_t(get16(p)) << 16 | get16(p + 2); }
+
+void put64be(char* p, uint64_t v) {
+    for (int i = 7; i >= 0; --i) { p[i] = char(v); v >>= 8; }
+}
+uint64_t get64be(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = v << 8 | uint8_t(p[i]);
+    return v;
+}
+
+sockaddr_in broadcastAddr(int port) {
+    sockaddr_in b{};
+    b.sin_family      = AF_INET;
+    b.sin_port        = htons(port);
+    b.sin_addr.s_addr = INADDR_BROADCAST;
+    return b;
+}
+
+struct Interface {
+    in_addr addr;
+    in_addr broadcast;   // 0 if it has none
+};
+
+// IPv4 interfaces that are up; empty where they can't be listed.
+std::vector<Interface> localInterfaces() {
+    std::vector<Interface> out;
+#ifndef _WIN32
+    ifaddrs* list = nullptr;
+    if (getifaddrs(&list) != 0) return out;
+    for (ifaddrs* i = list; i; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET || !(i->ifa_flags & IFF_UP)) continue;
+        Interface itf{};
+        itf.addr = ((sockaddr_in*)i->ifa_addr)->sin_addr;
+        if ((i->ifa_flags & IFF_BROADCAST) && i->ifa_broadaddr) {
+            itf.broadcast = ((sockaddr_in*)i->ifa_broadaddr)->sin_addr;
+        }
+        out.push_back(itf);
+    }
+    freeifaddrs(list);
+#endif
+    return out;
+}
+
+// Sends `msg` to the discovery port on every interface, as described at
+// DISCOVERY_GROUP; a plain broadcast if none could be listed.
+void sendEverywhere(int s, const char* msg, size_t len) {
+    auto itfs = localInterfaces();
+    if (itfs.empty()) {
+        sockaddr_in b = broadcastAddr(DISCOVERY_PORT);
+        sendto(s, msg, len, 0, (sockaddr*)&b, sizeof(b));
+        return;
+    }
+    sockaddr_in group = broadcastAddr(DISCOVERY_PORT);
+    inet_pton(AF_INET, DISCOVERY_GROUP, &group.sin_addr);
+    std::vector<uint32_t> subnets;   // secondary addresses share a broadcast
+    for (auto& i : itfs) {
+        if (i.broadcast.s_addr != 0) {
+            if (std::find(subnets.begin(), subnets.end(), i.broadcast.s_addr) != subnets.end()) continue;
+            subnets.push_back(i.broadcast.s_addr);
+            sockaddr_in to = broadcastAddr(DISCOVERY_PORT);
+            to.sin_addr = i.broadcast;
+            sendto(s, msg, len, 0, (sockaddr*)&to, sizeof(to));
+        } else {
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (char*)&i.addr, sizeof(i.addr));
+            sendto(s, msg, len, 0, (sockaddr*)&group, sizeof(group));
+        }
+    }
+}
+
+// Joins DISCOVERY_GROUP on every interface; repeat to pick up new ones.
+void joinGroup(int s) {
+    ip_mreq m{};
+    inet_pton(AF_INET, DISCOVERY_GROUP, &m.imr_multiaddr);
+    auto itfs = localInterfaces();
+    if (itfs.empty()) itfs.push_back(Interface{});   // INADDR_ANY: the default route's
+    for (auto& i : itfs) {
+        m.imr_interface = i.addr;
+        // EADDRINUSE: already a member there.
+        setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&m, sizeof(m));
+    }
+}
+
+// Seconds to send `mb` MB to a peer with capabilities `c` over a path
+// probed as `p`. Its link is shared with the transfers it already has,
+// and each transfer needs a core to decrypt and decompress.
+double estimateSeconds(const Capabilities& c, const ProbeResult& p, double mb) {
+    double share = p.mbPerSec / (c.active + 1);
+    if (c.cores) share = std::min(share, CORE_MB_PER_SEC * std::min(1.0, double(c.cores) / (c.active + 1)));
+    return 2 * p.rttMs / 1000 + mb / share;
+}
+
+// Waits up to `us` microseconds for `s` to become readable.
+bool waitReadable(int s, long long us) {
+    if (us < 0) us = 0;
+    timeval tv{ long(us / 1000000), long(us % 1000000) };
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(s, &rfds);
+    return select(s + 1, &rfds, nullptr, nullptr, &tv) > 0;
+}
+
+// Asks the kernel to stamp each datagram `s` receives with its arrival
+// time, so probe trains are timed as they came in rather than as this
+// thread got round to them.
+void enableArrivalStamps(int s) {
+    int on = 1;
+#if defined(SO_TIMESTAMPNS)
+    setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, (char*)&on, sizeof(on));
+#elif defined(SO_TIMESTAMP) && !defined(_WIN32)
+    setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, (char*)&on, sizeof(on));
+#else
+    (void)s; (void)on;
+#endif
+}
+
+// Receives a datagram on `s` into `buf`, and its arrival in microseconds:
+// the kernel's stamp (wall clock) where enableArrivalStamps() got one,
+// else the time now. Only differences between stamps mean anything.
+ssize_t recvStamped(int s, char* buf, size_t len, sockaddr_in& from, uint64_t& us) {
+    us = 0;
+#ifdef _WIN32
+    socklen_t flen = sizeof(from);
+    ssize_t n = recvfrom(s, buf, int(len), 0, (sockaddr*)&from, &flen);
+#else
+    iovec iov{ buf, len };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+    msghdr msg{};
+    msg.msg_name       = &from;
+    msg.msg_namelen    = sizeof(from);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(s, &msg, 0);
+    for (cmsghdr* c = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr; c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET) continue;
+#if defined(SCM_TIMESTAMPNS)
+        if (c->cmsg_type != SCM_TIMESTAMPNS) continue;
+        timespec ts;
+        memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+        us = uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+#elif defined(SCM_TIMESTAMP)
+        if (c->cmsg_type != SCM_TIMESTAMP) continue;
+        timeval tv;
+        memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+        us = uint64_t(tv.tv_sec) * 1000000 + uint64_t(tv.tv_usec);
+#endif
+    }
+#endif
+    if (us == 0) {
+        us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+            clock_type::now().time_since_epoch()).count());
+    }
+    return n;
+}
+
+// Whether this process should answer `q`: it is listening, is the one
+// asked for, and isn't already known to the asker.
+bool shouldAnswer(const QueryView& q) {
+    std::lock_guard<std::mutex> lk(g_advertMutex);
+    if (g_advertPort == 0) return false;
+    if (q.aliasLen > 0 && std::string_view(q.alias, q.aliasLen) != g_advertAlias) return false;
+    for (size_t i = 0; i < q.knownCount; ++i) {
+        if (get64be(reinterpret_cast<const char*>(q.known) + 8 * i) == g_advertInstance) return false;
+    }
+    return true;
+}
+
+// Our beacon with the current load, or 0 bytes if not listening.
+size_t encodeAdvert(char* out) {
+    std::lock_guard<std::mutex> lk(g_advertMutex);
+    if (g_advertPort == 0) return 0;
+    Capabilities caps = localCapabilities(g_advertDir);
+    caps.probePort = g_advertProbePort;
+    return encodeBeacon(out, uint16_t(g_advertPort), g_advertInstance, g_advertAlias, g_advertPin, caps);
+}
+
+void sendAdvert(int s, const sockaddr_in& to) {
+    char msg[MAX_DATAGRAM];
+    size_t len = encodeAdvert(msg);
+    if (len) sendto(s, msg, len, 0, (const sockaddr*)&to, sizeof(to));
+}
+
+// Echoes a probe with the time it arrived, `arrivedUs`.
+void answerProbe(int s, const char* buf, size_t n, const sockaddr_in& from, uint64_t arrivedUs) {
+    if (n < 12 || memcmp(buf, MAGIC, 4) != 0 || buf[4] != 'P') return;
+    char reply[20];
+    memcpy(reply, MAGIC, 4);
+    reply[4] = 'R';
+    reply[5] = 0;
+    memcpy(reply + 6, buf + 6, 6);   // seq, token
+    put64be(reply + 12, arrivedUs);
+    sendto(s, reply, sizeof(reply), 0, (const sockaddr*)&from, sizeof(from));
+}
+
+// Records a beacon (or answer) datagram from `from`; false if it wasn't one.
+bool record(PeerRegistry& registry, const char* buf, size_t n, const sockaddr_in& from,
+            BeaconView& b) {
+    if (!parseBeacon(buf, n, b) && !parseTextBeacon(buf, n, b)) return false;
+    char ip[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip))) return false;
+    registry.seen(Sighting{ ip, b.port, std::string_view(b.alias, b.aliasLen),
+                            std::string_view(b.pin, b.pinLen), b.instance, b.caps });
+    return true;
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------------
+// Wire format
+
+size_t encodeBeacon(char* out, uint16_t port, uint64_t instance,
+                    const std::string& alias, const std::string& pin, const Capabilities& caps) {
+    size_t aliasLen = std::min<size_t>(alias.size(), 255);
+    size_t pinLen   = std::min<size_t>(pin.size(), 255);
+    memcpy(out, MAGIC, 4);
+    out[4] = 'B';
+    out[5] = 0;
+    put16(out + 6, port);
+    put64be(out + 8, instance);
+    size_t o = 16;
+    out[o++] = char(aliasLen);
+    memcpy(out + o, alias.data(), aliasLen);
+    o += aliasLen;
+    out[o++] = char(pinLen);
+    memcpy(out + o, pin.data(), pinLen);
+    o += pinLen;
+    out[o++] = char(caps.protocol);
+    out[o++] = char(caps.codecs);
+    put16(out + o, caps.cores);      o += 2;
+    put16(out + o, caps.active);     o += 2;
+    put32(out + o, caps.freeMB);     o += 4;
+    put16(out + o, caps.probePort);  o += 2;
+    return o;
+}
+
+size_t encodeQuery(char* out, uint8_t flags, const std::string& alias,
+                   const std::vector<uint64_t>& known) {
+    size_t aliasLen = std::min<size_t>(alias.size(), 255);
+    memcpy(out, MAGIC, 4);
+    out[4] = 'Q';
+    out[5] = char(flags);
+    size_t o = 6;
+    out[o++] = char(aliasLen);
+    memcpy(out + o, alias.data(), aliasLen);
+    o += aliasLen;
+    size_t count = std::min({ known.size(), MAX_KNOWN, (MAX_DATAGRAM - o - 1) / 8, size_t(255) });
+    out[o++] = char(count);
+    for (size_t i = 0; i < count; ++i, o += 8) put64be(out + o, known[i]);
+    return o;
+}
+
+bool parseBeacon(const char* buf, size_t n, BeaconView& out) {
+    if (n < 18 || memcmp(buf, MAGIC, 4) != 0 || buf[4] != 'B') return false;
+    out.port     = get16(buf + 6);
+    out.instance = get64be(buf + 8);
+    size_t o = 16;
+    out.aliasLen = uint8_t(buf[o++]);
+    out.alias    = buf + o;
+    o += out.aliasLen;
+    if (o >= n) return false;
+    out.pinLen = uint8_t(buf[o++]);
+    out.pin    = buf + o;
+    o += out.pinLen;
+    if (o > n || out.port == 0) return false;
+    out.caps = Capabilities();
+    if (n - o >= 12) {   // absent from older binary beacons
+        const char* c = buf + o;
+        out.caps.protocol  = uint8_t(c[0]);
+        out.caps.codecs    = uint8_t(c[1]);
+        out.caps.cores     = get16(c + 2);
+        out.caps.active    = get16(c + 4);
+        out.caps.freeMB    = get32(c + 6);
+        out.caps.probePort = get16(c + 10);
+    }
+    return true;
+}
+
+bool parseQuery(const char* buf, size_t n, QueryView& out) {
+    if (n < 8 || memcmp(buf, MAGIC, 4) != 0 || buf[4] != 'Q') return false;
+    out.flags    = uint8_t(buf[5]);
+    size_t o = 6;
+    out.aliasLen = uint8_t(buf[o++]);
+    out.alias    = buf + o;
+    o += out.aliasLen;
+    if (o >= n) return false;
+    out.knownCount = uint8_t(buf[o++]);
+    out.known      = reinterpret_cast<const uint8_t*>(buf + o);
+    return o + out.knownCount * 8 <= n;
+}
+
+bool parseTextBeacon(const char* buf, size_t n, BeaconView& out) {
+    size_t plen = strlen(TEXT_BEACON);
+    if (n <= plen || memcmp(buf, TEXT_BEACON, plen) != 0) return false;
+    const char* end   = buf + n;
+    const char* p     = buf + plen;
+    const char* c1    = static_cast<const char*>(memchr(p, ':', end - p));
+    if (!c1) return false;
+    const char* c2    = static_cast<const char*>(memchr(c1 + 1, ':', end - c1 - 1));
+    if (!c2) return false;
+    unsigned port = 0;
+    for (const char* d = p; d < c1; ++d) {
+        if (*d < '0' || *d > '9' || port > 65535) return false;
+        port = port * 10 + (*d - '0');
+    }
+    if (port == 0 || port > 65535) return false;
+    out.port     = uint16_t(port);
+    out.instance = 0;
+    out.alias    = c1 + 1;
+    out.aliasLen = c2 - c1 - 1;
+    out.pin      = c2 + 1;
+    out.pinLen   = end - c2 - 1;
+    out.caps     = Capabilities();
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Beacons
+
+BeaconSchedule::BeaconSchedule(uint64_t seed) : rng_(static_cast<std::mt19937::result_type>(seed)) {}
+
+std::chrono::milliseconds BeaconSchedule::first() {
+    std::uniform_int_distribution<int> delay(0, BEACON_MIN_INTERVAL_MS * BEACON_JITTER_PERCENT / 100);
+    return std::chrono::milliseconds(delay(rng_));
+}
+
+std::chrono::milliseconds BeaconSchedule::next() {
+    int base = intervalMs_;
+    intervalMs_ = std::min(intervalMs_ * 2, BEACON_MAX_INTERVAL_MS);
+    std::uniform_int_distribution<int> jitter(-BEACON_JITTER_PERCENT, BEACON_JITTER_PERCENT);
+    return std::chrono::milliseconds(base + base * jitter(rng_) / 100);
+}
+
+int createUDPSocket(bool reuse, bool broadcast) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) return -1;
+    int opt = 1;
+    if (reuse)     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse)     setsockopt(s, SOL_SOCKET, SO_REUSEPORT,  (char*)&opt, sizeof(opt));
+#endif
+    if (broadcast) setsockopt(s, SOL_SOCKET, SO_BROADCAST,   (char*)&opt, sizeof(opt));
+    return s;
+}
+
+int bindDiscoverySocket(int port) {
+    int s = createUDPSocket(true, false);
+    if (s < 0) return -1;
+    sockaddr_in bindAddr{};
+    bindAddr.sin_family      = AF_INET;
+    bindAddr.sin_port        = htons(port);
+    bindAddr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(s, (sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
+        CLOSE_SOCKET(s);
+        return -1;
+    }
+    joinGroup(s);
+    return s;
+}
+
+Capabilities localCapabilities(const std::string& dir) {
+    Capabilities c;
+    c.protocol = PROTOCOL_VERSION;
+    c.codecs   = CAP_ZSTD | CAP_CHACHA20_POLY1305;
+    c.cores    = uint16_t(std::min(std::thread::hardware_concurrency(), 65535u));
+    c.active   = uint16_t(std::min(Progress::activeCount(), 65535));
+#ifndef _WIN32
+    struct statvfs vfs;
+    if (statvfs(dir.empty() ? "." : dir.c_str(), &vfs) == 0) {
+        uint64_t mb = uint64_t(vfs.f_bavail) * vfs.f_frsize >> 20;
+        c.freeMB = uint32_t(std::max<uint64_t>(1, std::min<uint64_t>(mb, UINT32_MAX)));   // 0 = unknown
+    }
+#endif
+    return c;
+}
+
+void setAdvertised(const std::string& alias, const std::string& pin) {
+    std::lock_guard<std::mutex> lk(g_advertMutex);
+    if (alias == g_advertAlias && pin == g_advertPin) return;
+    g_advertAlias = alias;
+    g_advertPin   = pin;
+    ++g_advertChanges;
+}
+
+void broadcastAvailability(int port, const std::string& alias, const std::string& pin,
+                           const std::string& dir, const std::atomic<bool>* stop) {
+    // Beacons go out from `s`, which also takes probes on its own port:
+    // the discovery port may be shared by several listeners on this host.
+    int s = createUDPSocket(false, true);
+    sockaddr_in any{};
+    any.sin_family      = AF_INET;
+    any.sin_addr.s_addr = INADDR_ANY;
+    socklen_t alen = sizeof(any);
+    if (bind(s, (sockaddr*)&any, sizeof(any)) < 0 || getsockname(s, (sockaddr*)&any, &alen) < 0) {
+        perror("discovery beacon socket");
+    }
+    enableArrivalStamps(s);
+    std::random_device rd;
+    uint64_t instance = (uint64_t(rd()) << 32 | rd()) | 1;   // never 0, which means "unknown"
+    uint64_t changes;
+    {
+        std::lock_guard<std::mutex> lk(g_advertMutex);
+        changes           = g_advertChanges;
+        g_advertPort      = port;
+        g_advertAlias     = alias;
+        g_advertPin       = pin;
+        g_advertDir       = dir;
+        g_advertInstance  = instance;
+        g_advertProbePort = ntohs(any.sin_port);
+    }
+    // Queries arrive on the discovery port; wait for them between beacons.
+    int q = bindDiscoverySocket();
+    if (q < 0) perror("discovery query socket");
+
+    BeaconSchedule schedule(instance);
+    std::mt19937 rng(static_cast<std::mt19937::result_type>(instance >> 32));
+    std::uniform_int_distribution<int> answerDelay(0, QUERY_ANSWER_JITTER_MS);
+    struct Pending {
+        clock_type::time_point due;
+        sockaddr_in to;
+    };
+    std::vector<Pending> pending;   // answers to broadcast queries, spread out
+    auto nextBeacon = clock_type::now() + schedule.first();
+    while (!stop || !stop->load()) {
+        auto now = clock_type::now();
+        {
+            // A new alias or PIN goes out now, and as often as a fresh start's.
+            std::lock_guard<std::mutex> lk(g_advertMutex);
+            if (g_advertChanges != changes) {
+                changes = g_advertChanges;
+                schedule.reset();
+                nextBeacon = now;
+            }
+        }
+        if (now >= nextBeacon) {
+            char msg[MAX_DATAGRAM];
+            size_t len = encodeAdvert(msg);
+            sendEverywhere(s, msg, len);
+            if (q >= 0) joinGroup(q);
+            nextBeacon = now + schedule.next();
+        }
+        auto wake = std::min(nextBeacon, now + STOP_CHECK_INTERVAL);
+        for (auto it = pending.begin(); it != pending.end(); ) {
+            if (it->due <= now) {
+                sendAdvert(q, it->to);
+                it = pending.erase(it);
+            } else {
+                wake = std::min(wake, it->due);
+                ++it;
+            }
+        }
+        auto waitUs = std::chrono::duration_cast<std::chrono::microseconds>(wake - now).count();
+        timeval tv{ long(waitUs / 1000000), long(waitUs % 1000000) };
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(s, &rfds);
+        if (q >= 0) FD_SET(q, &rfds);
+        if (select(std::max(s, q) + 1, &rfds, nullptr, nullptr, &tv) <= 0) continue;
+
+        char buf[MAX_DATAGRAM];
+        sockaddr_in from{};
+        socklen_t flen = sizeof(from);
+        if (FD_ISSET(s, &rfds)) {
+            uint64_t arrivedUs;
+            ssize_t n = recvStamped(s, buf, sizeof(buf), from, arrivedUs);
+            if (n > 0) answerProbe(s, buf, n, from, arrivedUs);
+        }
+        if (q < 0 || !FD_ISSET(q, &rfds)) continue;
+        flen = sizeof(from);
+        ssize_t n = recvfrom(q, buf, sizeof(buf), 0, (sockaddr*)&from, &flen);
+        QueryView qv;
+        if (n <= 0 || !parseQuery(buf, n, qv) || !shouldAnswer(qv)) continue;
+        // Everyone hears a broadcast query to all; don't all answer at once.
+        if ((qv.flags & QUERY_BROADCAST) && qv.aliasLen == 0) {
+            pending.push_back({ clock_type::now() + std::chrono::milliseconds(answerDelay(rng)), from });
+        } else {
+            sendAdvert(q, from);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lk(g_advertMutex);
+        g_advertPort = 0;   // not listening: nothing more to advertise or answer
+    }
+    if (q >= 0) CLOSE_SOCKET(q);
+    CLOSE_SOCKET(s);
+}
+
+// ----------------------------------------------------------------------------
+// Listening and querying
+
+void listen(PeerRegistry& registry, int port, const std::atomic<bool>* stop) {
+    // Bind once, reuse address/port
+    int s = bindDiscoverySocket(port);
+    if (s < 0) {
+        perror("discovery listen");
+        return;
+    }
+
+    // Wake at least once a second so silent peers still expire.
+    timeval tv{ 1, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    auto lastExpiry = clock_type::now();
+    int ticks = 0;
+    auto expireIfDue = [&]{
+        auto now = clock_type::now();
+        if (now - lastExpiry < std::chrono::seconds(1)) return;
+        lastExpiry = now;
+        registry.expire();
+        if (++ticks % 10 == 0) joinGroup(s);   // interfaces come and go
+    };
+
+    while (!stop || !stop->load()) {
+        char buf[MAX_DATAGRAM];
+        sockaddr_in from{};
+        socklen_t len = sizeof(from);
+        ssize_t n = recvfrom(s, buf, sizeof(buf), 0, (sockaddr*)&from, &len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            expireIfDue();
+            continue;
+        }
+        if (n <= 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        QueryView qv;
+        BeaconView bv;
+        if (parseQuery(buf, n, qv)) {
+            // A query sent straight to this host may land on this socket
+            // rather than the beacon thread's. Broadcast copies reach that
+            // one too and are answered there.
+            if (!(qv.flags & QUERY_BROADCAST) && shouldAnswer(qv)) sendAdvert(s, from);
+        } else {
+            record(registry, buf, n, from, bv);
+        }
+        expireIfDue();
+    }
+    CLOSE_SOCKET(s);
+}
+
+bool query(PeerRegistry& registry, const std::vector<Receiver>& cached, const QueryOptions& opts) {
+    int s = createUDPSocket(false, true);
+    if (s < 0) { perror("discovery query"); return false; }
+
+    std::vector<sockaddr_in> unicast;
+    for (auto& c : cached) {
+        sockaddr_in a = broadcastAddr(DISCOVERY_PORT);
+        if (inet_pton(AF_INET, c.ip.c_str(), &a.sin_addr) == 1) unicast.push_back(a);
+    }
+    const int resendMs[] = { 0, 200, 600, 1400 };
+    const size_t rounds = sizeof(resendMs) / sizeof(resendMs[0]);
+    size_t sent = 0;
+    auto start    = clock_type::now();
+    auto deadline = start + opts.timeout;
+    bool found = false;
+    while (true) {
+        auto now = clock_type::now();
+        if (now >= deadline) break;
+        if (sent < rounds && now >= start + std::chrono::milliseconds(resendMs[sent])) {
+            // Listeners already heard (newest first) needn't answer again.
+            std::vector<uint64_t> known;
+            auto snap = registry.snapshot();
+            for (auto it = snap->peers.rbegin(); it != snap->peers.rend(); ++it) {
+                if (it->instance) known.push_back(it->instance);
+            }
+            char msg[MAX_DATAGRAM];
+            size_t len = encodeQuery(msg, QUERY_BROADCAST, opts.alias, known);
+            sendEverywhere(s, msg, len);
+            len = encodeQuery(msg, 0, opts.alias, known);
+            for (auto& t : unicast) sendto(s, msg, len, 0, (sockaddr*)&t, sizeof(t));
+            ++sent;
+        }
+        auto until = deadline;
+        if (sent < rounds) until = std::min(until, start + std::chrono::milliseconds(resendMs[sent]));
+        if (!waitReadable(s, std::chrono::duration_cast<std::chrono::microseconds>(until - now).count())) continue;
+
+        char buf[MAX_DATAGRAM];
+        sockaddr_in from{};
+        socklen_t len = sizeof(from);
+        ssize_t n = recvfrom(s, buf, sizeof(buf), 0, (sockaddr*)&from, &len);
+        BeaconView b;
+        if (n <= 0 || !record(registry, buf, n, from, b)) continue;
+        if (opts.alias.empty() || std::string_view(b.alias, b.aliasLen) == opts.alias) {
+            found = true;
+            deadline = std::min(deadline, clock_type::now() + opts.settle);
+        }
+    }
+    CLOSE_SOCKET(s);
+    return found;
+}
+
+// ----------------------------------------------------------------------------
+// Choosing a receiver
+
+ProbeResult probe(const Receiver& r, int trainLength) {
+    ProbeResult out;
+    sockaddr_in to{};
+    to.sin_family = AF_INET;
+    to.sin_port   = htons(r.caps.probePort);
+    if (r.caps.probePort == 0 || inet_pton(AF_INET, r.ip.c_str(), &to.sin_addr) != 1) return out;
+    int s = createUDPSocket();
+    if (s < 0) return out;
+
+    std::random_device rd;
+    uint32_t token = rd();
+    char pkt[PROBE_SIZE] = {};
+    memcpy(pkt, MAGIC, 4);
+    pkt[4] = 'P';
+    put32(pkt + 8, token);
+
+    // Reads replies to this probe until `until` or onReply returns true.
+    auto collect = [&](clock_type::time_point until, const std::function<bool(uint16_t, uint64_t)>& onReply) {
+        while (true) {
+            auto now = clock_type::now();
+            if (now >= until) return;
+            if (!waitReadable(s, std::chrono::duration_cast<std::chrono::microseconds>(until - now).count())) return;
+            char buf[64];
+            ssize_t n = recv(s, buf, sizeof(buf), 0);
+            if (n < 20 || memcmp(buf, MAGIC, 4) != 0 || buf[4] != 'R' || get32(buf + 8) != token) continue;
+            if (onReply(get16(buf + 6), get64be(buf + 12))) return;
+        }
+    };
+
+    for (int attempt = 0; attempt < 3 && !out.answered; ++attempt) {
+        put16(pkt + 6, 0);
+        auto sentAt = clock_type::now();
+        sendto(s, pkt, 12, 0, (sockaddr*)&to, sizeof(to));
+        collect(sentAt + std::chrono::milliseconds(200), [&](uint16_t seq, uint64_t) {
+            if (seq != 0) return false;
+            out.answered = true;
+            out.rttMs = std::chrono::duration<double, std::milli>(clock_type::now() - sentAt).count();
+            return true;
+        });
+    }
+    if (!out.answered) {
+        CLOSE_SOCKET(s);
+        return out;
+    }
+
+    std::vector<uint64_t> at(trainLength + 1, 0);   // arrival per seq, receiver's clock
+    for (int i = 1; i <= trainLength; ++i) {
+        put16(pkt + 6, uint16_t(i));
+        sendto(s, pkt, PROBE_SIZE, 0, (sockaddr*)&to, sizeof(to));
+    }
+    int got = 0;
+    auto wait = std::chrono::microseconds(long(out.rttMs * 2000)) + std::chrono::milliseconds(50);
+    collect(clock_type::now() + wait, [&](uint16_t seq, uint64_t us) {
+        if (seq >= 1 && seq <= trainLength && !at[seq]) { at[seq] = us; ++got; }
+        return got == trainLength;
+    });
+    CLOSE_SOCKET(s);
+
+    int first = 0, last = 0;
+    for (int i = 1; i <= trainLength; ++i) {
+        if (!at[i]) continue;
+        if (!first) first = i;
+        last = i;
+    }
+    out.mbPerSec = PROBE_MAX_MB_PER_SEC;
+    if (first && last > first && at[last] > at[first]) {
+        double bytesPerUs = double(last - first) * PROBE_SIZE / double(at[last] - at[first]);
+        out.mbPerSec = std::min(out.mbPerSec, bytesPerUs * 1e6 / (1024.0 * 1024.0));
+    }
+    return out;
+}
+
+std::vector<Ranked> rank(const std::vector<Receiver>& peers, uint64_t bytes) {
+    const uint8_t needed = CAP_ZSTD | CAP_CHACHA20_POLY1305;
+    std::vector<Ranked> out;
+    for (auto& p : peers) {
+        const Capabilities& c = p.caps;
+        if (c.protocol != 0 && (c.protocol != PROTOCOL_VERSION || (c.codecs & needed) != needed)) continue;
+        if (c.freeMB != 0 && (uint64_t(c.freeMB) << 20) < bytes) continue;
+        Ranked r;
+        r.peer    = p;
+        r.seconds = HUGE_VAL;
+        out.push_back(r);
+    }
+
+    // One probe per address, as many as MAX_PROBED allows.
+    struct Job {
+        size_t      peer;
+        std::string ip;
+        ProbeResult result;
+    };
+    std::vector<Job> jobs;
+    for (size_t i = 0; i < out.size(); ++i) {
+        const Receiver& p = out[i].peer;
+        for (auto& ip : p.addrs.empty() ? std::vector<std::string>{ p.ip } : p.addrs) {
+            if (jobs.size() < size_t(MAX_PROBED)) jobs.push_back(Job{ i, ip, ProbeResult() });
+        }
+    }
+    std::vector<std::thread> probes;
+    for (auto& j : jobs) {
+        probes.emplace_back([&out, &j]{
+            Receiver at = out[j.peer].peer;
+            at.ip = j.ip;
+            j.result = probe(at);
+        });
+    }
+    for (auto& t : probes) t.join();
+
+    double mb = bytes / (1024.0 * 1024.0);
+    for (auto& j : jobs) {
+        if (!j.result.answered) continue;
+        Ranked& r = out[j.peer];
+        double secs = estimateSeconds(r.peer.caps, j.result, mb);
+        if (secs >= r.seconds) continue;
+        r.seconds = secs;
+        r.probe   = j.result;
+        r.peer.ip = j.ip;
+    }
+    std::stable_sort(out.begin(), out.end(), [](const Ranked& a, const Ranked& b) {
+        return a.seconds < b.seconds;
+    });
+    return out;
+}
+
+} // namespace Discovery
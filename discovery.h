@@ -0,0 +1,155 @@
+// discovery.h
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <cstddef>
+#include "peers.h"         // PeerRegistry, Receiver
+#include "transfer.h"      // socket headers, CLOSE_SOCKET
+
+namespace Discovery {
+
+static const int DISCOVERY_PORT = 9001;
+// Beacons and queries go out on every IPv4 interface that is up: as a
+// directed broadcast where it has a broadcast address, else (loopback,
+// point-to-point links) to this group, which discovery sockets join on
+// every interface. Each copy leaves from that interface's address, which
+// is how a peer learns all of ours.
+static const char* const DISCOVERY_GROUP = "239.255.81.1";
+
+// Beacons start fast so a new listener is noticed at once, then back off
+// exponentially; peers expire after PEER_TTL_SECONDS, several of the
+// longest intervals.
+static const int BEACON_MIN_INTERVAL_MS = 1000;
+static const int BEACON_MAX_INTERVAL_MS = 8000;
+static const int BEACON_JITTER_PERCENT  = 25;
+// Answers to a broadcast query are spread over this window so hundreds
+// of listeners don't reply in the same instant.
+static const int QUERY_ANSWER_JITTER_MS = 40;
+
+// Wire format (network byte order), one datagram each:
+//   beacon / answer: "QDP1" 'B' flags port:u16 instance:u64 aliasLen:u8 alias pinLen:u8 pin
+//                    [protocol:u8 codecs:u8 cores:u16 active:u16 freeMB:u32 probePort:u16]
+//   query:           "QDP1" 'Q' flags aliasLen:u8 alias knownCount:u8 known instance:u64...
+//   probe:           "QDP1" 'P' flags seq:u16 token:u32 [padding]
+//   probe reply:     "QDP1" 'R' flags seq:u16 token:u32 receivedUs:u64
+// A query with an alias is for that listener only. Listeners whose
+// instance id is in the known list stay quiet: the asker has them.
+// Probes go to the beacon's probePort and are answered one for one.
+static const size_t MAX_DATAGRAM  = 1472;
+static const size_t MAX_KNOWN     = 160;
+static const uint8_t QUERY_BROADCAST = 1;   // flags: the broadcast copy of a query
+static const size_t PROBE_SIZE    = 1200;   // train packets, under any LAN MTU
+
+// A beacon as parsed, pointing into the datagram; nothing is copied.
+struct BeaconView {
+    uint16_t    port;
+    uint64_t    instance;
+    const char* alias;
+    size_t      aliasLen;
+    const char* pin;
+    size_t      pinLen;
+    Capabilities caps;
+};
+
+struct QueryView {
+    uint8_t        flags;
+    const char*    alias;      // wanted listener, aliasLen 0 = any
+    size_t         aliasLen;
+    const uint8_t* known;      // knownCount big-endian instance ids
+    size_t         knownCount;
+};
+
+size_t encodeBeacon(char* out, uint16_t port, uint64_t instance,
+                    const std::string& alias, const std::string& pin,
+                    const Capabilities& caps = Capabilities());
+size_t encodeQuery(char* out, uint8_t flags, const std::string& alias,
+                   const std::vector<uint64_t>& known);
+bool parseBeacon(const char* buf, size_t n, BeaconView& out);
+bool parseQuery(const char* buf, size_t n, QueryView& out);
+// Pre-binary "QUICKDROP_DISCOVERY:port:alias:pin" beacons from older peers.
+bool parseTextBeacon(const char* buf, size_t n, BeaconView& out);
+
+// Jittered exponential backoff between BEACON_MIN and BEACON_MAX.
+class BeaconSchedule {
+public:
+    explicit BeaconSchedule(uint64_t seed);
+    // Delay before the first beacon, up to the jitter share of the
+    // shortest interval, so hosts started together don't beacon together.
+    std::chrono::milliseconds first();
+    // Delay until the following beacon.
+    std::chrono::milliseconds next();
+    void reset() { intervalMs_ = BEACON_MIN_INTERVAL_MS; }
+private:
+    int          intervalMs_ = BEACON_MIN_INTERVAL_MS;
+    std::mt19937 rng_;
+};
+
+int createUDPSocket(bool reuse = false, bool broadcast = false);
+// A socket on `port`, shared with other processes on the host, in
+// DISCOVERY_GROUP on every interface.
+int bindDiscoverySocket(int port = DISCOVERY_PORT);
+
+// What this process would advertise, receiving into `dir`.
+Capabilities localCapabilities(const std::string& dir);
+
+// Announces a listener on `port`, receiving into `dir`, until *stop is
+// set (checked about four times a second) or the process exits: beacons
+// on the schedule above, answers to queries and probes.
+void broadcastAvailability(int port, const std::string& alias, const std::string& pin,
+                           const std::string& dir, const std::atomic<bool>* stop = nullptr);
+// Changes the alias and PIN being announced. The schedule starts over
+// from its shortest interval so peers hear of it soon.
+void setAdvertised(const std::string& alias, const std::string& pin);
+
+// Feeds beacons heard on `port` into `registry` and expires silent peers,
+// until *stop is set (checked about once a second).
+void listen(PeerRegistry& registry, int port = DISCOVERY_PORT,
+            const std::atomic<bool>* stop = nullptr);
+
+struct QueryOptions {
+    std::string alias;                          // only this listener should answer; "" = any
+    std::chrono::milliseconds timeout{3000};    // give up after this long
+    std::chrono::milliseconds settle{0};        // after an answer, wait this long for more
+};
+
+// Asks listeners to announce themselves now instead of at their next
+// beacon. The query is broadcast and also sent directly to `cached`
+// addresses (a warm start, and networks that drop broadcasts), repeated
+// a few times in case of loss; each repeat lists the listeners heard so
+// far so only the rest answer. Answers go into `registry`. Returns once
+// the wanted listener (or any, without an alias) has answered and
+// `settle` has passed quietly, or at the timeout; true if one answered.
+bool query(PeerRegistry& registry, const std::vector<Receiver>& cached, const QueryOptions& opts);
+
+struct ProbeResult {
+    bool   answered  = false;
+    double rttMs     = 0;
+    double mbPerSec  = 0;   // bottleneck estimate from the train's spacing
+};
+
+// Measures round trip time with a ping, then bandwidth from how far
+// apart a back-to-back train of `trainLength` PROBE_SIZE packets arrived
+// (timed by the receiver, so the clocks needn't agree). Takes a couple
+// of round trips; not answered if the peer advertises no probe port.
+ProbeResult probe(const Receiver& r, int trainLength = 16);
+
+struct Ranked {
+    Receiver    peer;      // ip is the address to use
+    ProbeResult probe;     // of that address
+    double      seconds;   // estimated time to send the file to it
+};
+
+// Probes every address of `peers` in parallel and orders the peers by
+// estimated time to receive `bytes` at their best address: the probed
+// bandwidth, shared with the transfers each already has and limited by
+// its cores, plus the handshake round trips. Peers that can't take the
+// file (another protocol version, missing codecs, not enough free
+// space) are left out. At most 16 addresses are probed; peers with none
+// answering go last in their original order.
+std::vector<Ranked> rank(const std::vector<Receiver>& peers, uint64_t bytes);
+
+} // namespace Discovery
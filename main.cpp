@@ -1,12 +1,15 @@
 // main.cpp
 // Compile with:
 //   g++ -std=c++17 main.cpp compression.cpp crypto.cpp encryption.cpp \
+//       transfer.cpp reader.cpp writer.cpp bench.cpp watch.cpp upload.cpp progress.cpp peers.cpp discovery.cpp \
+//       multipath.cpp session.cpp resume.cpp trust.cpp \
 //       -lcrow -lsodium -lzstd -pthread \
 //       -I/opt/homebrew/include -L/opt/homebrew/lib \
 //       -o QuickDrop
 
 #include "crow_all.h"
 #include <iostream>
+#include <iomanip>
 #include <vector>
 #include <thread>
 #include <chrono>
@@ -14,328 +17,269 @@
 #include <atomic>
 #include <string>
 #include <cstdint>
-#include <sys/stat.h>
-#include <iomanip>
 #include <fstream>
 #include <random>
 #include <mutex>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+#include <csignal>
+#include <sys/stat.h>
 
-#ifdef _WIN32
-  #include <winsock2.h>
-  #pragma comment(lib, "Ws2_32.lib")
-  using socklen_t = int;
-  #define CLOSE_SOCKET closesocket
-#else
-  #include <sys/socket.h>
-  #include <arpa/inet.h>
-  #include <unistd.h>
-  #include <netinet/in.h>
-  #define CLOSE_SOCKET close
-#endif
-
-#include "compression.h"   // compressChunk, decompressChunk
+#include "transfer.h"      // FileTransfer::*, CHUNK_SIZE, PORT_DEFAULT
 #include "crypto.h"        // doKeyExchange
-#include "encryption.h"    // encryptChunk, decryptChunk
-
-// Configuration constants
-static const int    CHUNK_SIZE        = 64 * 1024;  // 64 KB
-static const int    PORT_DEFAULT      = 9000;
-static const int    DISCOVERY_PORT    = 9001;
-static const char*  DISCOVERY_MESSAGE = "QUICKDROP_DISCOVERY";
+#include "bench.h"         // runBenchmark
+#include "watch.h"         // runWatch
+#include "upload.h"        // runUploadServer, uploadClientScript
+#include "progress.h"      // Progress::subscribe
+#include "peers.h"         // Discovery::PeerRegistry
+#include "discovery.h"     // Discovery::listen, query, broadcastAvailability
+#include "multipath.h"     // Multipath::sendFile, claim
+#include "session.h"       // sessionPool, sendPooled
+#include "resume.h"        // Resume::accept, remember, dial, connect
+#include "trust.h"         // Trust::setPolicy, addTrusted
 
 // Global to hold the PIN for current listener session
 static std::string currentListenPin;
 
-namespace FileTransfer {
-
-bool initSockets() {
-#ifdef _WIN32
-    WSADATA wsa;
-    return WSAStartup(MAKEWORD(2,2), &wsa) == 0;
-#else
-    return true;
-#endif
-}
-
-void cleanupSockets() {
-#ifdef _WIN32
-    WSACleanup();
-#endif
+// ----------------------------------------------------------------------------
+// Persistent discovery listener defines (so we don't re-bind each /discover):
+static Discovery::PeerRegistry g_peers;
+
+// Web UI view of g_peers. The /discover body is serialized at most once
+// per registry version; changes are queued as deltas for the /peers
+// WebSocket, each tagged with the version it produced.
+struct PeersJson {
+    uint64_t    version;
+    std::string body;
+};
+static std::shared_ptr<const PeersJson> g_peersJson;
+static std::mutex                       g_peersJsonMutex;
+static std::vector<std::string>         g_peerDeltas;   // not pushed yet
+static std::mutex                       g_peerDeltasMutex;
+
+// Web UI clients following the peer list.
+static std::set<crow::websocket::connection*> g_peerClients;
+static std::mutex                             g_peerClientsMutex;
+
+// Web UI clients watching transfer progress.
+static std::set<crow::websocket::connection*> g_progressClients;
+static std::mutex                             g_progressMutex;
+
+static std::string peerJson(const Discovery::Receiver& r) {
+    crow::json::wvalue v;
+    v["alias"] = r.alias;
+    v["ip"]    = r.ip;
+    v["port"]  = r.port;
+    v["pin"]   = r.pin;
+    v["active"] = r.caps.active;
+    v["cores"]  = r.caps.cores;
+    v["freeMB"] = r.caps.freeMB;
+    for (size_t i = 0; i < r.addrs.size(); ++i) v["addrs"][i] = r.addrs[i];
+    return v.dump();
 }
 
-int createListener(int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) { perror("socket"); exit(1); }
-    sockaddr_in addr{};
-    addr.sin_family      = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port        = htons(port);
-    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1); }
-    if (listen(fd, 1) < 0) { perror("listen"); exit(1); }
-    return fd;
+// The address of the listener at ip:port that probes fastest, for one
+// heard on several networks; `ip` itself otherwise.
+static std::string fastestAddress(const std::string& ip, int port, const std::string& file) {
+    auto snap = g_peers.snapshot();
+    for (auto& r : snap->peers) {
+        if (r.port != port || r.addrs.size() < 2 ||
+            std::find(r.addrs.begin(), r.addrs.end(), ip) == r.addrs.end()) continue;
+        struct stat st{};
+        auto ranked = Discovery::rank({ r }, stat(file.c_str(), &st) == 0 ? uint64_t(st.st_size) : 0);
+        if (!ranked.empty() && ranked[0].probe.answered) return ranked[0].peer.ip;
+    }
+    return ip;
 }
 
-// Helper function to parse host:port and return just the host
-std::string parseHost(const std::string &hostPort) {
-    size_t colonPos = hostPort.find(':');
-    if (colonPos != std::string::npos) {
-        return hostPort.substr(0, colonPos);
+static std::shared_ptr<const PeersJson> peersJson() {
+    auto snap = g_peers.snapshot();
+    std::lock_guard<std::mutex> lk(g_peersJsonMutex);
+    if (!g_peersJson || g_peersJson->version != snap->version) {
+        auto fresh = std::make_shared<PeersJson>();
+        fresh->version = snap->version;
+        fresh->body = "[";
+        for (size_t i = 0; i < snap->peers.size(); ++i) {
+            if (i) fresh->body += ",";
+            fresh->body += peerJson(snap->peers[i]);
+        }
+        fresh->body += "]";
+        g_peersJson = fresh;
     }
-    return hostPort;
+    return g_peersJson;
 }
 
-int createConnection(const std::string &host, int port) {
-    std::string cleanHost = parseHost(host);
-    std::cout << "[DEBUG] Connecting to " << cleanHost << ":" << port << std::endl;
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) { perror("socket"); return -1; }
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port   = htons(port);
-    if (inet_pton(AF_INET, cleanHost.c_str(), &addr.sin_addr) <= 0) {
-        perror("inet_pton"); CLOSE_SOCKET(fd); return -1;
-    }
-    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("connect"); CLOSE_SOCKET(fd); return -1;
-    }
-    std::cout << "[DEBUG] Connected successfully" << std::endl;
-    return fd;
+static void queuePeerDelta(Discovery::PeerRegistry::Change change, const Discovery::Receiver& r,
+                           uint64_t version) {
+    std::string delta = "{\"version\":" + std::to_string(version) + ",\"op\":\""
+                      + Discovery::changeName(change) + "\",\"peer\":" + peerJson(r) + "}";
+    std::lock_guard<std::mutex> lk(g_peerDeltasMutex);
+    g_peerDeltas.push_back(std::move(delta));
 }
 
-void sendFile(int fd, const std::string &path, const std::vector<unsigned char>& sessionKey) {
-    std::cout << "[DEBUG] Sending file: " << path << std::endl;
-    struct stat st;
-    if (stat(path.c_str(), &st) != 0) { perror("stat"); return; }
-    size_t totalSize = st.st_size;
-    FILE* f = fopen(path.c_str(), "rb");
-    if (!f) { perror("fopen sendFile"); return; }
-
-    std::vector<char> buffer(CHUNK_SIZE);
-    size_t bytesRead;
-    uint64_t chunkCounter = 0;
-    size_t bytesProcessed = 0;
-    auto startTime = std::chrono::steady_clock::now();
-
-    while ((bytesRead = fread(buffer.data(), 1, CHUNK_SIZE, f)) > 0) {
-        bytesProcessed += bytesRead;
-        auto now     = std::chrono::steady_clock::now();
-        double elapsed = std::chrono::duration<double>(now - startTime).count();
-        double mbps    = (bytesProcessed / (1024.0 * 1024.0)) / (elapsed > 0 ? elapsed : 1.0);
-        int pct       = int((double)bytesProcessed / totalSize * 100);
-
-        std::cout << "\rProgress: " << pct << "% ("
-                  << std::fixed << std::setprecision(1)
-                  << mbps << " MB/s)"
-                  << std::flush;
-
-        // Compress
-        std::vector<char> raw(buffer.begin(), buffer.begin() + bytesRead), comp;
-        if (!compressChunk(raw, comp)) { fclose(f); return; }
-
-        // Encrypt
-        std::vector<unsigned char> cipher;
-        if (!encryptChunk(comp, cipher, sessionKey, chunkCounter++)) {
-            std::cerr << "\nEncryption failed" << std::endl;
-            fclose(f);
-            return;
+// Pushes queued deltas to /peers subscribers, coalesced into one message
+// per interval however many beacons changed the list in between.
+static void peerFeedLoop() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::lock_guard<std::mutex> clk(g_peerClientsMutex);
+        std::vector<std::string> deltas;
+        {
+            std::lock_guard<std::mutex> lk(g_peerDeltasMutex);
+            deltas.swap(g_peerDeltas);
         }
-
-        uint32_t orig = htonl(static_cast<uint32_t>(bytesRead));
-        uint32_t cps  = htonl(static_cast<uint32_t>(cipher.size()));
-        send(fd, reinterpret_cast<char*>(&orig), sizeof(orig), 0);
-        send(fd, reinterpret_cast<char*>(&cps), sizeof(cps), 0);
-
-        size_t sent = 0;
-        while (sent < cipher.size()) {
-            ssize_t s = send(fd, reinterpret_cast<char*>(cipher.data()) + sent,
-                             cipher.size() - sent, 0);
-            if (s <= 0) { perror("send data"); fclose(f); return; }
-            sent += s;
+        if (deltas.empty()) continue;
+        std::string msg = "{\"type\":\"delta\",\"changes\":[";
+        for (size_t i = 0; i < deltas.size(); ++i) {
+            if (i) msg += ",";
+            msg += deltas[i];
         }
+        msg += "]}";
+        for (auto* conn : g_peerClients) conn->send_text(msg);
     }
-
-    fclose(f);
-
-    auto totalElapsed = std::chrono::duration<double>(
-        std::chrono::steady_clock::now() - startTime).count();
-    double finalMbps = (bytesProcessed / (1024.0 * 1024.0)) /
-                       (totalElapsed > 0 ? totalElapsed : 1.0);
-    std::cout << "\rProgress: 100% ("
-              << std::fixed << std::setprecision(1)
-              << finalMbps << " MB/s)\n";
-    std::cout << "[DEBUG] Finished sending file" << std::endl;
 }
 
-void receiveFile(int fd, const std::string &outPath, const std::vector<unsigned char>& sessionKey) {
-    std::cout << "[DEBUG] Receiving to: " << outPath << std::endl;
-    FILE* f = fopen(outPath.c_str(), "wb");
-    if (!f) { perror("fopen receiveFile"); return; }
-
-    size_t bytesReceived = 0;
-    auto startTime = std::chrono::steady_clock::now();
-    uint64_t chunkCounter = 0;
-
-    while (true) {
-        uint32_t orig_n, cps_n;
-        if (recv(fd, reinterpret_cast<char*>(&orig_n), sizeof(orig_n), 0) <= 0) break;
-        if (recv(fd, reinterpret_cast<char*>(&cps_n), sizeof(cps_n), 0) <= 0) break;
-
-        size_t orig = ntohl(orig_n), cps = ntohl(cps_n);
-        std::vector<unsigned char> cipher(cps);
-        size_t recvd = 0;
-        while (recvd < cps) {
-            ssize_t r = recv(fd, reinterpret_cast<char*>(cipher.data()) + recvd, cps - recvd, 0);
-            if (r <= 0) { perror("recv data"); fclose(f); return; }
-            recvd += r;
-        }
-
-        std::vector<char> comp, decomp;
-        if (!decryptChunk(cipher, comp, sessionKey, chunkCounter++)) {
-            std::cerr << "Decryption/auth failed" << std::endl;
-            fclose(f);
-            return;
-        }
-        if (!decompressChunk(comp, decomp, orig)) {
-            std::cerr << "Decompression failed" << std::endl;
-            fclose(f);
-            return;
+// ----------------------------------------------------------------------------
+// Command-line flags
+
+// Pulls "--name" / "--name=value" flags out of argv, compacting the
+// positional arguments in place so the argc checks in main() still hold.
+static std::map<std::string, std::string> extractFlags(int& argc, char* argv[]) {
+    std::map<std::string, std::string> flags;
+    int out = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a.size() > 2 && a.compare(0, 2, "--") == 0) {
+            size_t eq = a.find('=');
+            flags[a.substr(2, eq == std::string::npos ? std::string::npos : eq - 2)] =
+                (eq == std::string::npos) ? "" : a.substr(eq + 1);
+        } else {
+            argv[out++] = argv[i];
         }
-
-        fwrite(decomp.data(), 1, decomp.size(), f);
-        bytesReceived += decomp.size();
-
-        auto now = std::chrono::steady_clock::now();
-        double elapsed = std::chrono::duration<double>(now - startTime).count();
-        double mbps = (bytesReceived / (1024.0 * 1024.0)) / (elapsed > 0 ? elapsed : 1.0);
-
-        std::cout << "\rReceiving: "
-                  << std::fixed << std::setprecision(1)
-                  << mbps << " MB/s"
-                  << std::flush;
     }
-
-    fclose(f);
-    std::cout << "\n[DEBUG] Finished receiving file" << std::endl;
+    argc = out;
+    return flags;
 }
 
-} // namespace FileTransfer
-
-namespace Discovery {
-
-int createUDPSocket(bool reuse=false, bool broadcast=false) {
-    int s = socket(AF_INET, SOCK_DGRAM, 0);
-    if (s < 0) return -1;
-    int opt = 1;
-    if (reuse)     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-#ifdef SO_REUSEPORT
-    if (reuse)     setsockopt(s, SOL_SOCKET, SO_REUSEPORT,  (char*)&opt, sizeof(opt));
-#endif
-    if (broadcast) setsockopt(s, SOL_SOCKET, SO_BROADCAST,   (char*)&opt, sizeof(opt));
-    return s;
+static int flagInt(const std::map<std::string, std::string>& flags,
+                   const std::string& name, int def) {
+    auto it = flags.find(name);
+    return (it == flags.end() || it->second.empty()) ? def : std::stoi(it->second);
 }
 
-void broadcastAvailability(int port, const std::string &alias) {
-    int s = createUDPSocket(false, true);
-    sockaddr_in b{};
-    b.sin_family      = AF_INET;
-    b.sin_port        = htons(DISCOVERY_PORT);
-    b.sin_addr.s_addr = INADDR_BROADCAST;
-    std::string msg = std::string(DISCOVERY_MESSAGE)
-                    + ":" + std::to_string(port)
-                    + ":" + alias
-                    + ":" + currentListenPin;
-    while (true) {
-        sendto(s, msg.c_str(), msg.size(), 0, (sockaddr*)&b, sizeof(b));
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+static FileTransfer::SendOptions sendOptionsFromFlags(const std::map<std::string, std::string>& flags) {
+    FileTransfer::SendOptions opts;
+    opts.lowLatency       = flags.count("latency") > 0;
+    opts.flushDeadlineUs  = flagInt(flags, "flush-us", opts.flushDeadlineUs);
+    opts.flushBytes       = flagInt(flags, "flush-bytes", opts.flushBytes);
+    // Latency mode trades ratio for speed unless a level is given.
+    opts.compressionLevel = flagInt(flags, "level", opts.lowLatency ? 1 : opts.compressionLevel);
+    if (flags.count("read") && !parseReadBackend(flags.at("read"), opts.readBackend)) {
+        std::cerr << "Unknown read backend '" << flags.at("read") << "', using auto" << std::endl;
     }
-    CLOSE_SOCKET(s);
+    return opts;
 }
 
-struct Receiver {
-    std::string ip;
-    int port;
-    std::string alias;
-    std::string pin;
-};
+static Multipath::Options multipathOptionsFromFlags(const std::map<std::string, std::string>& flags) {
+    Multipath::Options opts;
+    opts.hedge       = flags.count("no-hedge") == 0;
+    opts.parityGroup = flagInt(flags, "parity", opts.parityGroup);
+    return opts;
+}
 
-} // namespace Discovery
+static FileTransfer::ReceiveOptions receiveOptionsFromFlags(const std::map<std::string, std::string>& flags) {
+    FileTransfer::ReceiveOptions opts;
+    opts.flushEachChunk = flags.count("latency") > 0;
+    opts.busyPollUs     = flagInt(flags, "busy-poll", opts.busyPollUs);
+    opts.directWrites   = flags.count("direct-write") > 0;
+    opts.mmapWrites     = flags.count("mmap-write") > 0;
+    opts.skipIdentical  = flags.count("skip-identical") > 0;
+    if (flags.count("durability") && !parseDurability(flags.at("durability"), opts.durability)) {
+        std::cerr << "Unknown durability '" << flags.at("durability") << "', using end" << std::endl;
+    }
+    opts.syncEveryBytes = uint64_t(flagInt(flags, "sync-mb", 64)) << 20;
+    return opts;
+}
 
 // ----------------------------------------------------------------------------
-// Persistent discovery listener defines (so we don't re-bind each /discover):
-static std::vector<Discovery::Receiver> g_peers;
-static std::mutex                       g_peersMutex;
-
-static void discoveryListener() {
-    int s = Discovery::createUDPSocket(true, false);
-    if (s < 0) {
-        perror("discoveryListener socket");
-        return;
-    }
-    // Bind once, reuse address/port
-    sockaddr_in bindAddr{};
-    bindAddr.sin_family      = AF_INET;
-    bindAddr.sin_port        = htons(DISCOVERY_PORT);
-    bindAddr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(s, (sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
-        perror("discoveryListener bind");
-        CLOSE_SOCKET(s);
-        return;
-    }
 
-    while (true) {
-        char buf[512];
-        sockaddr_in from{};
-        socklen_t len = sizeof(from);
-        ssize_t n = recvfrom(s, buf, sizeof(buf)-1, 0, (sockaddr*)&from, &len);
-        if (n <= 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-        buf[n] = '\0';
-        std::string msg(buf);
-        if (msg.rfind(DISCOVERY_MESSAGE, 0) != 0) continue;
-
-        // parse "QUICKDROP_DISCOVERY:port:alias:pin"
-        size_t p1 = msg.find(':'),
-               p2 = msg.find(':', p1+1),
-               p3 = msg.find(':', p2+1);
-        if (p1 == std::string::npos ||
-            p2 == std::string::npos ||
-            p3 == std::string::npos) continue;
-
-        Discovery::Receiver r;
-        r.ip    = inet_ntoa(from.sin_addr);
-        r.port  = std::stoi(msg.substr(p1+1, p2-p1-1));
-        r.alias = msg.substr(p2+1, p3-p2-1);
-        r.pin   = msg.substr(p3+1);
-
-        std::lock_guard<std::mutex> lk(g_peersMutex);
-        bool exists = false;
-        for (auto &e : g_peers) {
-            if (e.ip == r.ip &&
-                e.port == r.port &&
-                e.alias == r.alias &&
-                e.pin == r.pin) {
-                exists = true;
-                break;
-            }
-        }
-        if (!exists) {
-            g_peers.push_back(r);
+// Sends one file to ip:port. With a cached ticket the resume hello and
+// the file's first frames go out together, in the SYN where TCP Fast Open
+// is on, without waiting for the receiver; if it refuses the ticket what
+// was sent is dropped, and the file goes again after a full key exchange.
+// Stdin can't be sent twice, so it waits for the answer first.
+static bool sendOne(const std::string& ip, int port, const std::string& path,
+                    const FileTransfer::SendOptions& opts) {
+    signal(SIGPIPE, SIG_IGN);   // a refused ticket closes the connection under us
+    std::vector<unsigned char> key;
+    if (path != "-") {
+        int sock = Resume::dial(ip, port, key);
+        if (sock >= 0) {
+            bool sent = FileTransfer::sendFile(sock, path, key, opts);
+            bool ok   = Resume::accepted(sock, ip, port, key);
+            CLOSE_SOCKET(sock);
+            if (ok) return sent;
         }
     }
-
-    CLOSE_SOCKET(s);
+    int sock = Resume::connect(ip, port, key);
+    if (sock < 0) return false;
+    bool ok = FileTransfer::sendFile(sock, path, key, opts);
+    CLOSE_SOCKET(sock);
+    return ok;
 }
 
-// ----------------------------------------------------------------------------
+// Sorts out a freshly accepted connection, on its own thread: whatever
+// opens it (join, resume hello, key exchange) may take seconds to arrive,
+// and the accept loop must not wait for it. A multipath join goes to its
+// session. Anything else is resumed or keyed; then `key` is set and true
+// is returned. Otherwise `conn` has been handed off or closed.
+static bool keyConnection(int conn, std::vector<unsigned char>& key) {
+    if (Multipath::claim(conn)) return false;
+    // A sender we already verified may resume with a ticket.
+    auto hello = Resume::accept(conn, key);
+    if (hello == Resume::Hello::Refused) {
+        CLOSE_SOCKET(conn);
+        return false;
+    }
+    if (hello == Resume::Hello::None) {
+        if (!doKeyExchange(conn, key)) {
+            std::cerr << "Key exchange failed" << std::endl;
+            CLOSE_SOCKET(conn);
+            return false;
+        }
+        Resume::remember(key);
+    }
+    return true;
+}
 
 int main(int argc, char* argv[]) {
     FileTransfer::initSockets();
+    auto flags = extractFlags(argc, argv);
     std::string cmd = (argc > 1 ? argv[1] : "");
 
+    // How a peer not in the trust store is admitted (--trust=prompt|tofu|pinned).
+    // The web UI's threads must never wait on stdin, so it can't prompt; and
+    // as it listens unattended, it only admits peers pinned with `trust`.
+    Trust::Policy trust = cmd == "web" ? Trust::Policy::Pinned : Trust::Policy::Prompt;
+    if (flags.count("trust") && !Trust::parsePolicy(flags.at("trust"), trust)) {
+        std::cerr << "Unknown trust policy '" << flags.at("trust") << "'" << std::endl;
+        return 1;
+    }
+    if (cmd == "web" && trust == Trust::Policy::Prompt) {
+        std::cerr << "The web UI can't prompt; use --trust=pinned or --trust=tofu" << std::endl;
+        return 1;
+    }
+    Trust::setPolicy(trust);
+
     // Web UI mode
     if (cmd == "web") {
+        unsigned char pub[Trust::PUBLIC_KEY_BYTES];
+        if (!Trust::loadIdentity(pub)) return 1;
+        std::cout << "This machine is " << Trust::fingerprint(pub) << ", new peers: "
+                  << Trust::policyName(trust) << std::endl;
+
         // generate a new 4-digit PIN for this listener session
         {
             std::mt19937 rng(std::random_device{}());
@@ -343,14 +287,20 @@ int main(int argc, char* argv[]) {
             currentListenPin = std::to_string(dist(rng));
         }
 
-        // start persistent discovery listener
-        std::thread(discoveryListener).detach();
+        // start persistent discovery listener; changes feed the /peers stream
+        g_peers.onChange(queuePeerDelta);
+        std::thread([]{ Discovery::listen(g_peers); }).detach();
+
+        // streaming uploads and downloads bypass Crow, which buffers whole
+        // bodies and copies static files through userspace
+        mkdir(RECEIVED_DIR, 0755);
+        std::thread(runUploadServer, UPLOAD_PORT_DEFAULT, currentListenPin, std::string(RECEIVED_DIR)).detach();
 
         crow::SimpleApp app;
 
         // Serve landing page + JS/CSS
         CROW_ROUTE(app, "/")([](){
-            return crow::response(200, R"(
+            std::string page = R"(
 <!DOCTYPE html>
 <html>
 <head>
@@ -364,6 +314,7 @@ int main(int argc, char* argv[]) {
         input, select { padding: 8px; margin: 5px 0; background: #2c2c2c; border: none; border-radius: 3px; color: #eee; }
         #peers { margin: 10px 0; }
         .peer { padding: 5px; margin: 2px 0; background: #2c2c2c; border-radius: 3px; }
+        progress { width: 100%; }
     </style>
 </head>
 <body>
@@ -386,6 +337,18 @@ int main(int argc, char* argv[]) {
             <button onclick=sendFile()>Send File</button>
         </div>
 
+        <div class="section">
+            <h3>Transfers</h3>
+            <div id="transfers"></div>
+        </div>
+
+        <div class="section">
+            <h3>Received Files</h3>
+            <input type=text id=receivedPin placeholder=Session PIN>
+            <button onclick=refreshReceived()>Refresh</button>
+            <div id="received"></div>
+        </div>
+
         <div class="section">
             <h3>Listen for Files</h3>
             <p>Session PIN: <strong id=sessionPin>__</strong></p>
@@ -394,20 +357,63 @@ int main(int argc, char* argv[]) {
         </div>
     </div>
 
+    <script src="/upload.js"></script>
     <script>
-        function discoverPeers() {
-            fetch('/discover')
-            .then(resp => resp.json())
-            .then(peers => {
+        // Peer list: a snapshot, then join/update/leave deltas pushed over
+        // a WebSocket, so nothing polls /discover. Each change carries the
+        // list version it produced; a gap means changes were missed, and
+        // reconnecting brings a fresh snapshot.
+        const WS_BASE = (location.protocol === 'https:' ? 'wss://' : 'ws://') + location.host;
+        const peers = new Map();
+        let peersVersion = -1, peersRenderQueued = false;
+
+        function renderPeers() {
+            if (peersRenderQueued) return;
+            peersRenderQueued = true;
+            requestAnimationFrame(() => {
+                peersRenderQueued = false;
                 const div = document.getElementById('peers');
                 div.innerHTML = '';
-                for (let i = 0; i < peers.length; i++) {
-                    const peer = peers[i];
+                for (const peer of peers.values()) {
                     const e = document.createElement('div');
                     e.className = 'peer';
                     e.textContent = peer.alias + ' (' + peer.ip + ':' + peer.port + ') PIN: ' + peer.pin;
                     div.appendChild(e);
                 }
+            });
+        }
+
+        function watchPeers() {
+            const ws = new WebSocket(WS_BASE + '/peers');
+            ws.onmessage = ev => {
+                const m = JSON.parse(ev.data);
+                if (m.type === 'snapshot') {
+                    peers.clear();
+                    for (const p of m.peers) peers.set(p.ip + ':' + p.port, p);
+                    peersVersion = m.version;
+                } else {
+                    for (const c of m.changes) {
+                        if (c.version <= peersVersion) continue;   // already in the snapshot
+                        if (c.version !== peersVersion + 1) { ws.close(); return; }
+                        const key = c.peer.ip + ':' + c.peer.port;
+                        if (c.op === 'leave') peers.delete(key);
+                        else peers.set(key, c.peer);
+                        peersVersion = c.version;
+                    }
+                }
+                renderPeers();
+            };
+            ws.onclose = () => setTimeout(watchPeers, 1000);
+        }
+        watchPeers();
+
+        function discoverPeers() {
+            fetch('/discover')
+            .then(resp => resp.json())
+            .then(list => {
+                peers.clear();
+                for (const p of list) peers.set(p.ip + ':' + p.port, p);
+                renderPeers();
             })
             .catch(err => {
                 console.error(err);
@@ -426,22 +432,71 @@ int main(int argc, char* argv[]) {
             if (!name)               { alert('Enter a filename');  return; }
             if (!pin)                { alert('Enter receiver PIN'); return; }
 
-            const fd = new FormData();
-            fd.append('file',     fileIn.files[0]);
-            fd.append('filename', name);
-            fd.append('pin',      pin);
-            fd.append('ip',       ip);
-            fd.append('port',     port);
+            uploadResumable(fileIn.files[0], { pin: pin, ip: ip, port: port, name: name })
+            .then(() => alert('File sent!'))
+            .catch(err => {
+                console.error(err);
+                alert(err.message === '403' ? 'Invalid PIN' : 'Send failed');
+            });
+        }
 
-            fetch('/send', { method: 'POST', body: fd })
-            .then(r => {
-                if (r.status === 202)       alert('File sent!');
-                else if (r.status === 403)  alert('Invalid PIN');
-                else                         alert('Send error');
+        // Live progress: the server pushes every transfer's counters a few
+        // times a second; reconnect if the socket drops.
+        function watchProgress() {
+            const ws = new WebSocket(WS_BASE + '/progress');
+            ws.onmessage = ev => {
+                const div = document.getElementById('transfers');
+                div.innerHTML = '';
+                for (const t of JSON.parse(ev.data)) {
+                    const e = document.createElement('div');
+                    e.className = 'peer';
+                    const mb = (t.bytes / 1048576).toFixed(1);
+                    let text = (t.direction === 'send' ? '\u2191 ' : '\u2193 ') + t.name + ': ' + mb + ' MB';
+                    if (t.total) text += ' of ' + (t.total / 1048576).toFixed(1) + ' MB';
+                    text += ', ' + t.mbps.toFixed(1) + ' MB/s, ' + t.stage;
+                    if (t.stages.syncing !== undefined && t.stages.done !== undefined) {
+                        text += ' (sync ' + (t.stages.done - t.stages.syncing).toFixed(2) + 's)';
+                    }
+                    e.textContent = text;
+                    if (t.total) {
+                        const bar = document.createElement('progress');
+                        bar.max = t.total;
+                        bar.value = t.bytes;
+                        e.appendChild(bar);
+                    }
+                    div.appendChild(e);
+                }
+            };
+            ws.onclose = () => setTimeout(watchProgress, 2000);
+        }
+        watchProgress();
+
+        function refreshReceived() {
+            const pin = document.getElementById('receivedPin').value.trim();
+            if (!pin) { alert('Enter the session PIN'); return; }
+            fetch('/received?pin=' + encodeURIComponent(pin))
+            .then(resp => {
+                if (!resp.ok) throw new Error(String(resp.status));
+                return resp.json();
+            })
+            .then(files => {
+                const div = document.getElementById('received');
+                div.innerHTML = '';
+                for (const f of files) {
+                    const a = document.createElement('a');
+                    a.href = location.protocol + '//' + location.hostname + encodeURI(f.url)
+                           + '?pin=' + encodeURIComponent(pin);
+                    a.download = f.name.split('/').pop();
+                    a.textContent = f.name + ' (' + f.size + ' bytes)';
+                    const e = document.createElement('div');
+                    e.className = 'peer';
+                    e.appendChild(a);
+                    div.appendChild(e);
+                }
             })
             .catch(err => {
                 console.error(err);
-                alert('Send failed');
+                if (err.message === '403') alert('Invalid PIN');
             });
         }
 
@@ -457,6 +512,7 @@ int main(int argc, char* argv[]) {
             })
             .then(j => {
                 document.getElementById('sessionPin').textContent = j.pin;
+                document.getElementById('receivedPin').value = j.pin;
                 alert('Listening, PIN: ' + j.pin);
             })
             .catch(err => {
@@ -467,41 +523,129 @@ int main(int argc, char* argv[]) {
     </script>
 </body>
 </html>
-            )");
+            )";
+            return crow::response(200, page);
+        });
+
+        // uploadResumable(), the client of the upload server's resumable
+        // uploads; web/index.html loads it too
+        CROW_ROUTE(app, "/upload.js")([](){
+            crow::response res(200, uploadClientScript(UPLOAD_PORT_DEFAULT));
+            res.set_header("Content-Type", "application/javascript");
+            return res;
         });
 
-        // Discover—returns the in-memory vector, no re-binding
-        CROW_ROUTE(app, "/discover")([](){
-            std::lock_guard<std::mutex> lk(g_peersMutex);
-            crow::json::wvalue out;
-            for (size_t i = 0; i < g_peers.size(); ++i) {
-                out[i]["alias"] = g_peers[i].alias;
-                out[i]["ip"]    = g_peers[i].ip;
-                out[i]["port"]  = g_peers[i].port;
-                out[i]["pin"]   = g_peers[i].pin;
+        // Discover—the cached snapshot of the in-memory list, no re-binding;
+        // its version is the ETag
+        CROW_ROUTE(app, "/discover")([](const crow::request& req){
+            auto peers = peersJson();
+            std::string etag = "\"" + std::to_string(peers->version) + "\"";
+            crow::response res;
+            res.set_header("ETag", etag);
+            if (req.get_header_value("If-None-Match") == etag) {
+                res.code = 304;
+                return res;
+            }
+            res.code = 200;
+            res.set_header("Content-Type", "application/json");
+            res.body = peers->body;
+            return res;
+        });
+
+        // Peers—the same list as a stream: a snapshot on connect, then
+        // {"type":"delta","changes":[{"version","op","peer"}...]} batches.
+        // Clients skip changes their snapshot already holds; a gap in the
+        // versions means they missed some and should reconnect.
+        CROW_WEBSOCKET_ROUTE(app, "/peers")
+            .onopen([](crow::websocket::connection& conn){
+                std::lock_guard<std::mutex> clk(g_peerClientsMutex);
+                auto peers = peersJson();
+                g_peerClients.insert(&conn);
+                conn.send_text("{\"type\":\"snapshot\",\"version\":" + std::to_string(peers->version)
+                               + ",\"peers\":" + peers->body + "}");
+            })
+            .onclose([](crow::websocket::connection& conn, const std::string&, uint16_t){
+                std::lock_guard<std::mutex> clk(g_peerClientsMutex);
+                g_peerClients.erase(&conn);
+            });
+        std::thread(peerFeedLoop).detach();
+
+        // Sessions kept for further /send requests and uploads are closed
+        // once nobody has used them for a while.
+        std::thread([]{
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(5));
+                sessionPool().expire();
+            }
+        }).detach();
+
+        // Received—files the web listener has written, with download links
+        // served by the side server (Range/ETag, sendfile). Needs the PIN,
+        // which the links leave for the client to add.
+        CROW_ROUTE(app, "/received")([](const crow::request& req){
+            const char* pin = req.url_params.get("pin");
+            if (!pin || pin != currentListenPin) return crow::response(403, "Invalid PIN");
+            auto files = listReceivedFiles(RECEIVED_DIR);
+            crow::json::wvalue out = crow::json::wvalue::list();
+            for (size_t i = 0; i < files.size(); ++i) {
+                out[i]["name"]  = files[i].name;
+                out[i]["size"]  = files[i].size;
+                out[i]["mtime"] = files[i].mtime;
+                out[i]["url"]   = ":" + std::to_string(UPLOAD_PORT_DEFAULT) + "/files/" + files[i].name;
             }
             return crow::response(200, out);
         });
 
-        // Listen—starts the broadcast & file-receive loop
+        // Progress—live transfers, pushed at the publisher's fixed rate
+        // rather than per chunk (see progress.h)
+        CROW_WEBSOCKET_ROUTE(app, "/progress")
+            .onopen([](crow::websocket::connection& conn){
+                std::lock_guard<std::mutex> lk(g_progressMutex);
+                g_progressClients.insert(&conn);
+                conn.send_text(Progress::snapshotJson());
+            })
+            .onclose([](crow::websocket::connection& conn, const std::string&, uint16_t){
+                std::lock_guard<std::mutex> lk(g_progressMutex);
+                g_progressClients.erase(&conn);
+            });
+        Progress::subscribe([](const std::string& json){
+            std::lock_guard<std::mutex> lk(g_progressMutex);
+            for (auto* conn : g_progressClients) conn->send_text(json);
+        });
+
+        // Listen—starts the broadcast & file-receive loop; once running,
+        // a further call only changes the alias announced
         CROW_ROUTE(app, "/listen")([&](const crow::request& req){
-            auto alias = req.url_params.get("alias") ? req.url_params.get("alias") : "QuickDropPeer";
+            static std::atomic<bool> listening{false};
+            std::string alias = req.url_params.get("alias") ? req.url_params.get("alias") : "QuickDropPeer";
+            crow::json::wvalue res;
+            res["pin"] = currentListenPin;
+            if (listening.exchange(true)) {
+                Discovery::setAdvertised(alias, currentListenPin);
+                return crow::response(200, res);
+            }
             std::thread([alias](){
-                std::thread(Discovery::broadcastAvailability, PORT_DEFAULT, alias).detach();
+                std::atomic<bool> stopBeacons{false};
+                std::thread bc(Discovery::broadcastAvailability, PORT_DEFAULT, alias, currentListenPin,
+                               std::string(RECEIVED_DIR), &stopBeacons);
                 int lst = FileTransfer::createListener(PORT_DEFAULT);
                 while (true) {
                     sockaddr_in peer{}; socklen_t len = sizeof(peer);
                     int conn = accept(lst, (sockaddr*)&peer, &len);
                     if (conn < 0) break;
-                    std::vector<unsigned char> key;
-                    if (doKeyExchange(conn, key)) {
-                        FileTransfer::receiveFile(conn, "received.bin", key);
-                    }
-                    CLOSE_SOCKET(conn);
+                    // In the background, so a multipath sender's joins get accepted.
+                    std::thread([conn](){
+                        std::vector<unsigned char> key;
+                        if (!keyConnection(conn, key)) return;
+                        FileTransfer::receiveFile(conn, std::string(RECEIVED_DIR) + "/received.bin", key);
+                        CLOSE_SOCKET(conn);
+                    }).detach();
                 }
+                CLOSE_SOCKET(lst);
+                stopBeacons = true;
+                bc.join();
+                listening = false;
             }).detach();
-            crow::json::wvalue res;
-            res["pin"] = currentListenPin;
             return crow::response(200, res);
         });
 
@@ -529,13 +673,12 @@ int main(int argc, char* argv[]) {
             if (!ip_p.body.empty()) ip   = ip_p.body;
             if (!pt_p.body.empty()) port = std::stoi(pt_p.body);
 
-            std::thread([tmp, ip, port](){
-                int sock = FileTransfer::createConnection(ip, port);
-                std::vector<unsigned char> key;
-                if (doKeyExchange(sock, key)) {
-                    FileTransfer::sendFile(sock, tmp, key);
-                }
-                CLOSE_SOCKET(sock);
+            // On a pooled session: only the first file to a receiver
+            // probes for its fastest address, connects and waits for the
+            // verify code.
+            std::thread([tmp, ip, port, filename](){
+                sendPooled(ip, port, tmp, filename, FileTransfer::SendOptions(),
+                           [&]{ return fastestAddress(ip, port, tmp); });
             }).detach();
 
             return crow::response(202);
@@ -552,92 +695,275 @@ int main(int argc, char* argv[]) {
     if (cmd == "listen") {
         std::string alias   = (argc > 2 ? argv[2] : "QuickDropPeer");
         std::string outFile = (argc > 3 ? argv[3] : "received.bin");
-        std::thread bc(Discovery::broadcastAvailability, PORT_DEFAULT, alias);
-        bc.detach();
-        int lst = FileTransfer::createListener(PORT_DEFAULT);
+        // Receiving to stdout: keep the data stream clean by moving all
+        // status output to stderr, and stop after one transfer so the
+        // downstream reader sees EOF.
+        bool toStdout = (outFile == "-");
+        if (toStdout) std::cout.rdbuf(std::cerr.rdbuf());
+        int port = flags.count("port") ? std::stoi(flags.at("port")) : PORT_DEFAULT;
+        size_t slash = outFile.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : outFile.substr(0, slash + 1);
+        std::atomic<bool> stopBeacons{false};
+        std::thread bc(Discovery::broadcastAvailability, port, alias, currentListenPin, dir, &stopBeacons);
+        int lst = FileTransfer::createListener(port);
         std::cout << "QuickDrop listening as '" << alias
-                  << "' on port " << PORT_DEFAULT << ". Ctrl-C to quit." << std::endl;
+                  << "' on port " << port << ". Ctrl-C to quit." << std::endl;
+        auto opts = receiveOptionsFromFlags(flags);
+        std::atomic<bool> stdoutTaken{false}, finished{false};
         while (true) {
             sockaddr_in peer{}; socklen_t len = sizeof(peer);
             int conn = accept(lst, (sockaddr*)&peer, &len);
-            if (conn < 0) { perror("accept"); break; }
-            std::vector<unsigned char> sessionKey;
-            if (!doKeyExchange(conn, sessionKey)) {
-                std::cerr << "Key exchange failed" << std::endl;
-                CLOSE_SOCKET(conn);
-                continue;
+            if (conn < 0) {
+                if (!finished) perror("accept");
+                break;
             }
-            FileTransfer::receiveFile(conn, outFile, sessionKey);
-            CLOSE_SOCKET(conn);
+            // Key and receive in the background so further senders can
+            // connect; Trust::admit still asks its questions one at a time.
+            std::thread([conn, lst, outFile, opts, toStdout, &stdoutTaken, &finished](){
+                std::vector<unsigned char> sessionKey;
+                if (!keyConnection(conn, sessionKey)) return;
+                if (toStdout && stdoutTaken.exchange(true)) {
+                    std::cerr << "Already receiving to stdout; refused another sender" << std::endl;
+                    CLOSE_SOCKET(conn);
+                    return;
+                }
+                FileTransfer::receiveFile(conn, outFile, sessionKey, opts);
+                CLOSE_SOCKET(conn);
+                if (toStdout) {   // one transfer only: wake the accept loop to quit
+                    finished = true;
+                    shutdown(lst, SHUT_RDWR);
+                }
+            }).detach();
         }
         CLOSE_SOCKET(lst);
+        stopBeacons = true;
+        bc.join();
         FileTransfer::cleanupSockets();
         return 0;
     }
     else if (cmd == "discover") {
-        // Start discovery listener temporarily
-        std::thread(discoveryListener).detach();
-        std::this_thread::sleep_for(std::chrono::seconds(3));
-        
-        std::lock_guard<std::mutex> lk(g_peersMutex);
-        if (g_peers.empty()) {
+        // Ask listeners to answer now, and hear plain beacons meanwhile
+        // from ones too old to answer; stop once answers go quiet.
+        std::string cachePath = Discovery::peerCachePath();
+        std::thread([]{ Discovery::listen(g_peers); }).detach();
+        Discovery::QueryOptions q;
+        q.settle = std::chrono::milliseconds(300);
+        Discovery::query(g_peers, Discovery::loadPeerCache(cachePath), q);
+
+        auto peers = g_peers.snapshot()->peers;
+        Discovery::savePeerCache(cachePath, peers);
+        if (peers.empty()) {
             std::cout << "No receivers found." << std::endl;
         } else {
-            for (size_t i = 0; i < g_peers.size(); ++i) {
+            for (size_t i = 0; i < peers.size(); ++i) {
                 std::cout << "  " << (i+1) << ": "
-                          << g_peers[i].alias << " ("
-                          << g_peers[i].ip << ":"
-                          << g_peers[i].port << ") PIN: "
-                          << g_peers[i].pin << "\n";
+                          << peers[i].alias << " ("
+                          << peers[i].ip << ":"
+                          << peers[i].port << ") PIN: "
+                          << peers[i].pin << "\n";
             }
         }
     }
     else if (cmd == "send" && argc == 3) {
         std::string filepath = argv[2];
-        
-        // Start discovery listener temporarily
-        std::thread(discoveryListener).detach();
-        std::this_thread::sleep_for(std::chrono::seconds(3));
-        
-        std::lock_guard<std::mutex> lk(g_peersMutex);
-        if (g_peers.empty()) {
+        // Read and compress the start of the file while looking for the
+        // receiver and keying the connection.
+        auto opts = sendOptionsFromFlags(flags);
+        if (!flags.count("multipath")) opts.readAhead = FileTransfer::startReadAhead(filepath, opts);
+
+        // Query for the receiver (--peer=ALIAS, else every receiver that
+        // answers), straight at cached addresses as well as by broadcast.
+        auto started = std::chrono::steady_clock::now();
+        std::string cachePath = Discovery::peerCachePath();
+        std::thread([]{ Discovery::listen(g_peers); }).detach();
+        Discovery::QueryOptions q;
+        q.alias = flags.count("peer") ? flags.at("peer") : "";
+        if (q.alias.empty()) q.settle = std::chrono::milliseconds(300);
+        Discovery::query(g_peers, Discovery::loadPeerCache(cachePath), q);
+
+        auto peers = g_peers.snapshot()->peers;
+        Discovery::savePeerCache(cachePath, peers);
+        std::vector<Discovery::Receiver> candidates;
+        for (auto& r : peers) {
+            if (q.alias.empty() || r.alias == q.alias) candidates.push_back(r);
+        }
+        // Of several, the one that should finish first, at its fastest
+        // address: probed bandwidth and round trip, shared with the
+        // transfers it already has.
+        if (candidates.size() > 1 || (candidates.size() == 1 && candidates[0].addrs.size() > 1)) {
+            struct stat st{};
+            uint64_t size = stat(filepath.c_str(), &st) == 0 ? uint64_t(st.st_size) : 0;
+            auto ranked = Discovery::rank(candidates, size);
+            candidates.clear();
+            for (auto& r : ranked) {
+                std::cout << std::fixed << std::setprecision(2)
+                          << "[DEBUG] " << r.peer.alias << " (" << r.peer.ip << ":" << r.peer.port
+                          << ", " << r.peer.addrs.size() << " addresses): ";
+                if (r.probe.answered) {
+                    std::cout << r.probe.rttMs << " ms, " << r.probe.mbPerSec << " MB/s, "
+                              << r.peer.caps.active << " active, est. " << r.seconds << " s" << std::endl;
+                } else {
+                    std::cout << "not probed" << std::endl;
+                }
+                candidates.push_back(r.peer);
+            }
+        }
+        if (candidates.empty()) {
             std::cerr << "No receivers to send to." << std::endl;
             return 1;
         }
-        auto target = g_peers[0];
-        int sock = FileTransfer::createConnection(target.ip, target.port);
-        if (sock < 0) return 1;
-        std::vector<unsigned char> sessionKey;
-        if (!doKeyExchange(sock, sessionKey)) {
+        auto target = candidates.front();
+        std::cout << "[DEBUG] Found " << target.alias << " at " << target.ip << ":" << target.port
+                  << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - started).count() << " ms" << std::endl;
+        if (flags.count("multipath")) {
+            // A path from each local interface that reaches one of its
+            // addresses, the ranked fastest first.
+            std::vector<std::string> remotes{ target.ip };
+            for (auto& a : target.addrs) {
+                if (a != target.ip) remotes.push_back(a);
+            }
+            auto routes = Multipath::routesTo(remotes);
+            int sock = Multipath::connectRoute(routes.front(), target.port);
+            if (sock < 0) return 1;
+            std::vector<unsigned char> sessionKey;
+            bool ok = doKeyExchange(sock, sessionKey) &&
+                      Multipath::sendFile(sock, sessionKey, routes, target.port, filepath,
+                                          sendOptionsFromFlags(flags), multipathOptionsFromFlags(flags));
             CLOSE_SOCKET(sock);
-            return 1;
+            return ok ? 0 : 1;
         }
-        FileTransfer::sendFile(sock, filepath, sessionKey);
-        CLOSE_SOCKET(sock);
+        return sendOne(target.ip, target.port, filepath, opts) ? 0 : 1;
     }
-    else if (cmd == "send-to" && argc == 4) {
-        std::string filepath = argv[2];
-        std::string target   = argv[3];
+    else if (cmd == "send-to" && argc >= 4) {
+        std::vector<std::string> files(argv + 2, argv + argc - 1);
+        std::string filepath = files.front();
+        std::string target   = argv[argc - 1];
         size_t pos = target.find(':');
         std::string ip   = target.substr(0, pos);
         int port         = (pos != std::string::npos) ? std::stoi(target.substr(pos+1)) : PORT_DEFAULT;
-        int sock = FileTransfer::createConnection(ip, port);
-        if (sock < 0) return 1;
-        std::vector<unsigned char> sessionKey;
-        if (!doKeyExchange(sock, sessionKey)) {
+        if (files.size() > 1) {
+            // Several files share one session, each a named file under
+            // its base name; acks are collected at the end, so the files
+            // follow each other without a round trip in between.
+            if (flags.count("multipath")) {
+                std::cerr << "--multipath sends a single file" << std::endl;
+                return 1;
+            }
+            auto opts = sendOptionsFromFlags(flags);
+            opts.readAhead = FileTransfer::startReadAhead(files.front(), opts);
+            auto session = sessionPool().acquire(ip, port);
+            if (!session) return 1;
+            bool ok = true;
+            for (auto& f : files) {
+                size_t slash = f.rfind('/');
+                ok = session->send(f, slash == std::string::npos ? f : f.substr(slash + 1), opts);
+                opts.readAhead = nullptr;
+                if (!ok) break;
+            }
+            ok = ok && session->finish();
+            std::cout << "[DEBUG] " << session->files << " of " << files.size()
+                      << " files sent on one session" << std::endl;
+            sessionPool().release(std::move(session), ok);
+            return ok ? 0 : 1;
+        }
+        if (flags.count("multipath")) {
+            // --multipath=LOCAL1,LOCAL2,...: a path from each local address.
+            std::vector<Multipath::Route> routes;
+            std::string list = flags.at("multipath");
+            for (size_t start = 0; start <= list.size(); ) {
+                size_t comma = list.find(',', start);
+                std::string local = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                if (!local.empty()) routes.push_back(Multipath::Route{ local, ip });
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+            if (routes.empty()) routes.push_back(Multipath::Route{ "", ip });
+            int sock = Multipath::connectRoute(routes.front(), port);
+            if (sock < 0) return 1;
+            std::vector<unsigned char> sessionKey;
+            bool ok = doKeyExchange(sock, sessionKey) &&
+                      Multipath::sendFile(sock, sessionKey, routes, port, filepath,
+                                          sendOptionsFromFlags(flags), multipathOptionsFromFlags(flags));
             CLOSE_SOCKET(sock);
+            return ok ? 0 : 1;
+        }
+        // The start of the file is read and compressed while connecting.
+        auto opts = sendOptionsFromFlags(flags);
+        opts.readAhead = FileTransfer::startReadAhead(filepath, opts);
+        return sendOne(ip, port, filepath, opts) ? 0 : 1;
+    }
+    else if (cmd == "watch" && argc == 4) {
+        std::string dir    = argv[2];
+        std::string target = argv[3];
+        size_t pos = target.find(':');
+        std::string ip   = target.substr(0, pos);
+        int port         = (pos != std::string::npos) ? std::stoi(target.substr(pos+1)) : PORT_DEFAULT;
+        return runWatch(dir, ip, port, flagInt(flags, "debounce-ms", 200), sendOptionsFromFlags(flags));
+    }
+    else if (cmd == "id") {
+        unsigned char pub[Trust::PUBLIC_KEY_BYTES];
+        if (!Trust::loadIdentity(pub)) return 1;
+        std::cout << Trust::fingerprint(pub) << std::endl;
+    }
+    else if (cmd == "trust" && (argc == 3 || argc == 4)) {
+        // Pins a peer ahead of time, from the fingerprint `QuickDrop id`
+        // prints on it, so unattended runs can use --trust=pinned.
+        std::string fp = argv[2];
+        bool hex = fp.size() == 32 && fp.find_first_not_of("0123456789abcdef") == std::string::npos;
+        if (!hex) {
+            std::cerr << "Expected a fingerprint as printed by `QuickDrop id`" << std::endl;
             return 1;
         }
-        FileTransfer::sendFile(sock, filepath, sessionKey);
-        CLOSE_SOCKET(sock);
+        return Trust::addTrusted(fp, argc == 4 ? argv[3] : "added by hand") ? 0 : 1;
+    }
+    else if (cmd == "bench" && argc == 3) {
+        return runBenchmark(argv[2], flags);
     }
     else {
         std::cout << "Usage:\n"
                   << "  QuickDrop web                       # launch browser UI\n"
-                  << "  QuickDrop listen [alias] [outFile]  # listen (CLI)\n"
+                  << "  QuickDrop listen [alias] [outFile]  # listen (CLI), outFile '-' = stdout\n"
                   << "  QuickDrop discover                  # discover (CLI)\n"
-                  << "  QuickDrop send <file>               # send (CLI)\n"
-                  << "  QuickDrop send-to <file> <ip:port>  # send-to (CLI)\n";
+                  << "  QuickDrop id                        # print this machine's identity fingerprint\n"
+                  << "  QuickDrop trust <fingerprint> [label] # trust a peer without asking on first contact\n"
+                  << "  QuickDrop send <file> [--peer=ALIAS] # send to the fastest (or named) receiver\n"
+                  << "  QuickDrop send-to <file> <ip:port>  # send-to (CLI), file '-' = stdin\n"
+                  << "  QuickDrop send-to <file>... <ip:port> # several files over one session\n"
+                  << "  QuickDrop watch <dir> <ip:port>     # keep <dir> synced to a listener\n"
+                  << "  QuickDrop bench latency             # loopback latency percentiles\n"
+                  << "  QuickDrop bench read [--file=F]     # read backends, cold vs warm cache\n"
+                  << "  QuickDrop bench durability          # receive throughput per durability mode\n"
+                  << "  QuickDrop bench write [--mb=N]      # buffered vs mapped receive path\n"
+                  << "  QuickDrop bench download            # concurrent HTTP range downloads\n"
+                  << "  QuickDrop bench progress            # per-chunk progress cost, with and without subscribers\n"
+                  << "  QuickDrop bench peers               # beacon handling and snapshot reads at scale\n"
+                  << "  QuickDrop bench beacons [--peers=N] # beacon parse cost and a simulated beacon storm\n"
+                  << "  QuickDrop bench multipath           # loopback paths, one throttled mid-transfer\n"
+                  << "  QuickDrop bench stragglers          # multipath completion percentiles with a path cut per trial\n"
+                  << "  QuickDrop bench sessions [--files=N] # many small files: connection per file vs pooled session\n"
+                  << "  QuickDrop bench firstbyte [--rtt-ms=N] # time to first byte: key exchange vs resumed session\n"
+                  << "  QuickDrop bench readahead [--mb=N] # send time with and without reading ahead of the key exchange\n"
+                  << "Flags:\n"
+                  << "  --latency          flush partial chunks on a deadline (send) / per chunk (listen)\n"
+                  << "  --flush-us=N       latency mode flush deadline in microseconds (default 1000)\n"
+                  << "  --flush-bytes=N    latency mode flush size (default 16384)\n"
+                  << "  --level=N          zstd compression level (default 3, 1 with --latency)\n"
+                  << "  --busy-poll=N      SO_BUSY_POLL microseconds on the receive socket\n"
+                  << "  --read=MODE        read backend: auto|pread|mmap|direct (default auto)\n"
+                  << "  --direct-write     listen: write aligned batches with O_DIRECT\n"
+                  << "  --mmap-write       listen: decompress into a mapping of the output file\n"
+                  << "  --skip-identical   listen: update existing files in place, leaving unchanged blocks\n"
+                  << "  --durability=MODE  listen: none|end|periodic fsync (default end)\n"
+                  << "  --sync-mb=N        listen: periodic fsync interval in MB (default 64)\n"
+                  << "  --debounce-ms=N    watch: quiet time before a batch is sent (default 200)\n"
+                  << "  --peer=ALIAS       send: wait for this receiver rather than picking the fastest\n"
+                  << "  --port=N           listen: TCP port (default 9000)\n"
+                  << "  --multipath        send: a connection per local interface reaching the receiver\n"
+                  << "  --multipath=A,B    send-to: a connection from each of these local addresses\n"
+                  << "  --parity=K         multipath: an XOR parity chunk per K chunks (default off)\n"
+                  << "  --no-hedge         multipath: don't resend chunks stuck behind a slow path\n"
+                  << "  --trust=MODE       new peers: prompt|tofu|pinned (default prompt, pinned for web)\n";
     }
 
     FileTransfer::cleanupSockets();
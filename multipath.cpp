@@ -0,0 +1,779 @@
+// multipath.cpp
+// One file over several connections: path scheduling and hedged resends
+// on the sender, reassembly by offset and parity recovery on the receiver.
+
+#include "multipath.h"
+#include "compression.h"   // compressChunk, decompressChunk
+#include "encryption.h"    // encryptChunk, decryptChunk
+#include "reader.h"        // openChunkReader
+
+#include <sodium.h>
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+  #include <sys/ioctl.h>
+  #include <ifaddrs.h>
+  #include <net/if.h>
+#endif
+#ifdef __linux__
+  #include <linux/sockios.h>   // SIOCOUTQ
+#endif
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+namespace Multipath {
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const size_t   TOKEN_BYTES      = 16;
+const size_t   BEGIN_BYTES      = TOKEN_BYTES + 17;   // token, size, allocated, parity group
+const int      JOIN_TIMEOUT_SEC = 5;
+const uint64_t MIN_QUEUE_BYTES  = 256 << 10;   // every path may queue this much regardless
+const int      RATE_POLL_MS     = 20;
+const int      RATE_SAMPLE_MS   = 100;
+const uint64_t REORDER_BYTES    = 32ull << 20; // held back for in-order writes before seeking
+
+void put64(char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = char((v >> (56 - 8*i)) & 0xFF);
+}
+
+uint64_t get64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | uint8_t(p[i]);
+    return v;
+}
+
+// Peers may go away mid-send here, so no SIGPIPE.
+bool sendAll(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t s = send(fd, p, len, MSG_NOSIGNAL);
+        if (s <= 0) return false;
+        p += s; len -= s;
+    }
+    return true;
+}
+
+bool recvAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t r = recv(fd, p, len, 0);
+        if (r <= 0) return false;
+        p += r; len -= r;
+    }
+    return true;
+}
+
+void setRecvTimeout(int fd, int seconds) {
+    timeval tv{ seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+}
+
+bool isZero(const char* p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (p[i]) return false;
+    }
+    return true;
+}
+
+void xorInto(std::vector<char>& acc, const char* p, size_t n) {
+    if (acc.size() < n) acc.resize(n, 0);
+    for (size_t i = 0; i < n; ++i) acc[i] ^= p[i];
+}
+
+// Bytes written to `fd` the peer has not acknowledged yet; 0 where the
+// kernel won't say, so sends just block on a full buffer.
+uint64_t unacked(int fd) {
+#ifdef SIOCOUTQ
+    int n = 0;
+    if (ioctl(fd, SIOCOUTQ, &n) == 0 && n > 0) return uint64_t(n);
+#else
+    (void)fd;
+#endif
+    return 0;
+}
+
+// [offset u64][origSize u32][cipherSize u32][cipher], in one send.
+bool sendFrame(int fd, uint64_t offset, uint32_t orig, const std::vector<unsigned char>& cipher) {
+    std::vector<char> frame(16 + cipher.size());
+    put64(frame.data(), offset);
+    uint32_t sizes[2] = { htonl(orig), htonl(static_cast<uint32_t>(cipher.size())) };
+    memcpy(frame.data() + 8, sizes, sizeof(sizes));
+    memcpy(frame.data() + 16, cipher.data(), cipher.size());
+    return sendAll(fd, frame.data(), frame.size());
+}
+
+// ----------------------------------------------------------------------------
+// Sending
+
+struct SendPath {
+    int       index;
+    int       fd;
+    PathStats stats;
+    // The rest is shared under SendJob::m.
+    bool      alive = true;
+    uint64_t  wire = 0;          // bytes send() has taken, counted once it returns
+    uint64_t  delivered = 0;     // acknowledged by the peer
+    double    rate = 0;          // bytes/s acknowledged, smoothed
+    std::deque<std::pair<uint64_t, uint64_t>> outstanding{};   // (chunk, wire end) not yet delivered
+    // Rate sampling; monitor() only.
+    uint64_t  lastDelivered = 0;
+    uint64_t  lastQueued = 0;
+    clock_type::time_point sampledAt = clock_type::now();
+};
+
+struct SendJob {
+    std::string path;
+    uint64_t    size;
+    uint64_t    chunks;
+    int         level;
+    Options     mopts;
+    const std::vector<unsigned char>& key;
+    int         primary;                 // shut down to abandon the send
+    Progress::Transfer* progress;
+    std::atomic<uint64_t> cursor{0};     // next chunk to hand out
+    std::atomic<bool>     done{false};   // receiver has the file, or the send is lost
+    std::atomic<bool>     failed{false};
+    std::mutex            m{};
+    std::vector<SendPath>* paths = nullptr;
+    std::vector<bool>     hedged{};      // chunks already resent once
+};
+
+// Seconds until byte `wireEnd` of `q` reaches the peer at its current
+// rate; infinite on a path that failed or has shown no rate yet.
+double waitFor(const SendPath& q, uint64_t wireEnd) {
+    if (!q.alive || q.rate <= 0) return std::numeric_limits<double>::infinity();
+    return wireEnd > q.delivered ? (wireEnd - q.delivered) / q.rate : 0;
+}
+
+// A chunk worth resending on `p`: one a failed path never delivered
+// (each is handed out once, even if an earlier resend went the same
+// way) or, with `lagging`, one queued on a path that needs
+// HEDGE_AFTER_MS or more to drain and would arrive in less than half the
+// time on `p`. The chunk that waits longest goes first; the front of the
+// slow queue still drains there.
+bool pickHedge(SendPath& p, SendJob& job, bool lagging, uint64_t& idx) {
+    std::lock_guard<std::mutex> lk(job.m);
+    for (auto& q : *job.paths) {
+        if (&q == &p || q.alive || q.outstanding.empty()) continue;
+        idx = q.outstanding.front().first;
+        q.outstanding.pop_front();
+        job.hedged[idx] = true;
+        return true;
+    }
+    if (!lagging) return false;
+    double mine = p.rate > 0 ? (p.wire - p.delivered + CHUNK_SIZE) / p.rate : 0;
+    double best = 0;
+    bool found = false;
+    for (auto& q : *job.paths) {
+        if (&q == &p || waitFor(q, q.wire) * 1000 < HEDGE_AFTER_MS) continue;
+        for (auto& o : q.outstanding) {
+            if (job.hedged[o.first]) continue;
+            double w = waitFor(q, o.second);
+            if (w > 2 * mine && (!found || w > best)) { best = w; idx = o.first; found = true; }
+        }
+    }
+    if (found) job.hedged[idx] = true;
+    return found;
+}
+
+// Gives up on the whole send: a read or codec failure no other path
+// would get past. Shutting the primary down wakes sendFile.
+bool abandon(SendJob& job) {
+    job.failed = true;
+    shutdown(job.primary, SHUT_RDWR);
+    return false;
+}
+
+// Reads, compresses, encrypts and sends chunk `idx`; false if that
+// failed.
+bool sendChunk(SendPath& p, SendJob& job, ChunkReader& reader, uint64_t idx, bool resend) {
+    uint64_t offset = idx * CHUNK_SIZE;
+    size_t   want   = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, job.size - offset));
+    const char* data = nullptr;
+    if (reader.read(offset, want, data) != ssize_t(want)) {
+        std::cerr << "\nShort read at offset " << offset << std::endl;
+        return abandon(job);
+    }
+    // A zero chunk goes as an empty plaintext.
+    std::vector<char> comp;
+    if (!isZero(data, want) && !compressChunk(std::vector<char>(data, data + want), comp, job.level)) {
+        return abandon(job);
+    }
+    std::vector<unsigned char> cipher;
+    if (!encryptChunk(comp, cipher, job.key, DATA_NONCE_BASE + idx)) {
+        std::cerr << "\nEncryption failed" << std::endl;
+        return abandon(job);
+    }
+    // Outstanding (so it can be hedged) while send() may still block on
+    // it, but only on the wire once send() has taken it all: monitor()
+    // counts wire less what the socket holds as delivered.
+    {
+        std::lock_guard<std::mutex> lk(job.m);
+        p.outstanding.emplace_back(idx, p.wire + 16 + cipher.size());
+    }
+    bool sent = sendFrame(p.fd, offset, static_cast<uint32_t>(want), cipher);
+    {
+        std::lock_guard<std::mutex> lk(job.m);
+        if (sent) p.wire += 16 + cipher.size();
+    }
+    if (!sent) return false;
+    p.stats.chunks += 1;
+    p.stats.bytes  += want;
+    if (resend) p.stats.resent += 1;
+    else        job.progress->add(want);
+    return true;
+}
+
+// Sends the XOR of parity group `group`'s chunks; false if that failed.
+bool sendParity(SendPath& p, SendJob& job, ChunkReader& reader, uint64_t group) {
+    uint64_t first = group * job.mopts.parityGroup;
+    uint64_t last  = std::min<uint64_t>(first + job.mopts.parityGroup, job.chunks);
+    std::vector<char> acc, comp;
+    for (uint64_t c = first; c < last; ++c) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, job.size - c * CHUNK_SIZE));
+        const char* data = nullptr;
+        if (reader.read(c * CHUNK_SIZE, want, data) != ssize_t(want)) return abandon(job);
+        xorInto(acc, data, want);
+    }
+    std::vector<unsigned char> cipher;
+    if (!compressChunk(acc, comp, job.level) ||
+        !encryptChunk(comp, cipher, job.key, PARITY_NONCE_BASE + group)) {
+        return abandon(job);
+    }
+    if (!sendFrame(p.fd, PARITY_FLAG | group, static_cast<uint32_t>(acc.size()), cipher)) return false;
+    std::lock_guard<std::mutex> lk(job.m);
+    p.wire += 16 + cipher.size();
+    return true;
+}
+
+// One path's sender, until the receiver has the file. Before taking a
+// chunk it waits until what its socket still holds would drain within
+// QUEUE_TARGET_MS at the rate the peer has been acknowledging, so faster
+// paths take proportionally more chunks and a slowed path holds only a
+// quarter second of the file. Chunks a failed path never delivered are
+// taken over first; once the cursor runs out, chunks stuck behind a
+// lagging path are resent.
+void runPath(SendPath& p, SendJob& job) {
+    int in = open(job.path.c_str(), O_RDONLY);
+    if (in < 0) {
+        perror("open multipath");
+        abandon(job);
+        return;
+    }
+    // Each path reads its own stride of the file through its own
+    // descriptor, so plain pread keeps read-ahead per path.
+    auto reader = openChunkReader(job.path, in, job.size, ReadBackend::Pread);
+
+    bool ok = true;
+    while (ok && !job.done) {
+        double rate;
+        {
+            std::lock_guard<std::mutex> lk(job.m);
+            rate = p.rate;
+        }
+        if (unacked(p.fd) > std::max<uint64_t>(MIN_QUEUE_BYTES, uint64_t(rate * QUEUE_TARGET_MS / 1000))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+        uint64_t idx;
+        if (pickHedge(p, job, false, idx)) {
+            ok = sendChunk(p, job, *reader, idx, true);
+        } else if ((idx = job.cursor.fetch_add(1)) < job.chunks) {
+            int group = job.mopts.parityGroup;
+            ok = sendChunk(p, job, *reader, idx, false) &&
+                 (group == 0 || ((idx + 1) % group != 0 && idx + 1 != job.chunks) ||
+                  sendParity(p, job, *reader, idx / group));
+        } else if (job.mopts.hedge && pickHedge(p, job, true, idx)) {
+            ok = sendChunk(p, job, *reader, idx, true);
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+    close(in);
+    std::lock_guard<std::mutex> lk(job.m);
+    p.stats.mbPerSec = p.rate / (1024.0 * 1024.0);
+    if (!ok && !job.done && !job.failed) {
+        std::cerr << "\n[DEBUG] Path " << p.index << " failed" << std::endl;
+        p.alive = false;
+    }
+}
+
+// Tracks what each path's peer has acknowledged, from the bytes its
+// socket still holds, and the rate at which that grows. Sampled apart
+// from the senders, which may sit blocked in send() on a slow path.
+void monitor(SendJob& job) {
+    while (!job.done) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(RATE_POLL_MS));
+        auto now = clock_type::now();
+        std::lock_guard<std::mutex> lk(job.m);
+        for (auto& p : *job.paths) {
+            if (!p.alive) continue;
+            uint64_t queued = std::min(unacked(p.fd), p.wire);
+            p.delivered = std::max(p.delivered, p.wire - queued);
+            while (!p.outstanding.empty() && p.outstanding.front().second <= p.delivered) {
+                p.outstanding.pop_front();
+            }
+            double dt = std::chrono::duration<double>(now - p.sampledAt).count();
+            if (dt * 1000 < RATE_SAMPLE_MS) continue;
+            // Only a path that had something queued shows its capacity.
+            // A drop is believed quickly, so a slowed path stops taking
+            // work and gets hedged; a rise is smoothed.
+            if (p.lastQueued > 0) {
+                double r = (p.delivered - p.lastDelivered) / dt;
+                if (p.rate <= 0)     p.rate = r;
+                else if (r < p.rate) p.rate = p.rate * 0.2 + r * 0.8;
+                else                 p.rate = p.rate * 0.6 + r * 0.4;
+            }
+            p.lastDelivered = p.delivered;
+            p.lastQueued    = queued;
+            p.sampledAt     = now;
+        }
+    }
+}
+
+// Opens a further path for the session `token`; -1 if it could not join.
+int joinPath(const Route& route, int port, const unsigned char* token, int index) {
+    int fd = connectRoute(route, port);
+    if (fd < 0) return -1;
+    char hello[sizeof(JOIN_MAGIC) + TOKEN_BYTES + 1];
+    memcpy(hello, JOIN_MAGIC, sizeof(JOIN_MAGIC));
+    memcpy(hello + sizeof(JOIN_MAGIC), token, TOKEN_BYTES);
+    hello[sizeof(hello) - 1] = char(index);
+    setRecvTimeout(fd, JOIN_TIMEOUT_SEC);
+    char ack = 0;
+    if (!sendAll(fd, hello, sizeof(hello)) || !recvAll(fd, &ack, 1) || ack != 'J') {
+        std::cerr << "[DEBUG] Path " << route.local << " -> " << route.remote << " did not join" << std::endl;
+        CLOSE_SOCKET(fd);
+        return -1;
+    }
+    setRecvTimeout(fd, 0);
+    return fd;
+}
+
+// ----------------------------------------------------------------------------
+// Receiving
+
+// A chunk waiting for the ones before it.
+struct Held {
+    std::vector<char> data;   // empty for a zero chunk
+    size_t            len;
+    bool              written = false;
+};
+
+// Parity state of a group with members outstanding.
+struct Group {
+    std::vector<char> acc;    // XOR of the members in, and the parity once it is
+    uint64_t          have = 0;
+    bool              parity = false;
+};
+
+struct Session {
+    std::vector<unsigned char> key;
+    FileWriter*         out;
+    Progress::Transfer* progress;
+    uint64_t            size;
+    uint64_t            chunks;
+    int                 parityGroup;
+
+    std::mutex              m;
+    std::condition_variable cv;
+    std::vector<bool>       got;          // chunks received
+    uint64_t                received = 0;
+    uint64_t                duplicates = 0;
+    uint64_t                rebuilt = 0;
+    std::map<uint64_t, Held> held;        // by offset
+    uint64_t                heldBytes = 0;
+    uint64_t                next = 0;     // everything below is written
+    std::unordered_map<uint64_t, Group> groups;
+    std::vector<int>        fds;          // every path, to cut them off once done
+    int                     running = 0;
+    bool                    closing = false;
+    bool                    failed  = false;   // the output could not be written
+};
+
+std::mutex g_sessionsMutex;
+std::condition_variable g_sessionsCv;
+std::map<std::string, std::shared_ptr<Session>> g_sessions;   // by join token
+
+size_t chunkLength(const Session& s, uint64_t idx) {
+    return static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, s.size - idx * CHUNK_SIZE));
+}
+
+uint64_t groupMembers(const Session& s, uint64_t group) {
+    return std::min<uint64_t>(s.parityGroup, s.chunks - group * s.parityGroup);
+}
+
+// Caller holds s.m for these.
+void writeHeld(Session& s, uint64_t offset, Held& h) {
+    s.out->seek(offset);
+    bool ok = h.data.empty() ? s.out->hole(h.len) : s.out->write(h.data.data(), h.len);
+    if (!ok) s.failed = true;
+    s.heldBytes -= h.data.size();
+    h.data = std::vector<char>();
+    h.written = true;
+}
+
+// Writes what is now contiguous. Chunks a stalled path holds up are kept
+// back so the file is written in order, until REORDER_BYTES are waiting;
+// past that the oldest go out ahead of the gap.
+void place(Session& s, uint64_t offset, std::vector<char> data, size_t len) {
+    s.heldBytes += data.size();
+    s.held.emplace(offset, Held{ std::move(data), len });
+    while (!s.held.empty() && s.held.begin()->first == s.next) {
+        Held& h = s.held.begin()->second;
+        if (!h.written) writeHeld(s, s.next, h);
+        s.next += h.len;
+        s.held.erase(s.held.begin());
+    }
+    for (auto it = s.held.begin(); s.heldBytes > REORDER_BYTES && it != s.held.end(); ++it) {
+        if (!it->second.written) writeHeld(s, it->first, it->second);
+    }
+}
+
+void acceptChunk(Session& s, uint64_t idx, std::vector<char> data) {
+    size_t len = chunkLength(s, idx);
+    s.got[idx] = true;
+    ++s.received;
+    place(s, idx * CHUNK_SIZE, std::move(data), len);
+    s.progress->add(len);
+    if (s.received == s.chunks) s.cv.notify_all();
+}
+
+// With one member of `group` missing and its parity in, the accumulator
+// is that member.
+void rebuild(Session& s, uint64_t group) {
+    auto it = s.groups.find(group);
+    if (it == s.groups.end()) return;
+    Group& g = it->second;
+    if (!g.parity || g.have + 1 != groupMembers(s, group)) return;
+    uint64_t first = group * s.parityGroup;
+    uint64_t idx = first;
+    while (s.got[idx]) ++idx;
+    std::vector<char> data = std::move(g.acc);
+    data.resize(chunkLength(s, idx), 0);
+    if (isZero(data.data(), data.size())) data.clear();
+    s.groups.erase(it);
+    ++s.rebuilt;
+    acceptChunk(s, idx, std::move(data));
+}
+
+void onChunk(Session& s, uint64_t idx, std::vector<char> data) {
+    if (s.parityGroup) {
+        uint64_t group = idx / s.parityGroup;
+        Group& g = s.groups[group];
+        if (++g.have == groupMembers(s, group)) {
+            s.groups.erase(group);
+        } else {
+            xorInto(g.acc, data.data(), data.size());
+        }
+    }
+    acceptChunk(s, idx, std::move(data));
+    if (s.parityGroup) rebuild(s, idx / s.parityGroup);
+}
+
+void onParity(Session& s, uint64_t group, const std::vector<char>& data) {
+    uint64_t have = 0;
+    for (uint64_t c = group * s.parityGroup, n = groupMembers(s, group); n > 0; ++c, --n) have += s.got[c];
+    if (have == groupMembers(s, group)) return;   // nothing left to rebuild
+    Group& g = s.groups[group];
+    if (g.parity) return;
+    g.parity = true;
+    xorInto(g.acc, data.data(), data.size());
+    rebuild(s, group);
+}
+
+// Reads one path until it ends or the session is done. Frames that do
+// not check out end the path, not the session: what the other paths
+// bring still counts.
+void readPath(int fd, int index, Session& s) {
+    while (true) {
+        char hdr[16];
+        if (!recvAll(fd, hdr, sizeof(hdr))) break;
+        uint64_t offset = get64(hdr);
+        uint32_t sizes[2];
+        memcpy(sizes, hdr + 8, sizeof(sizes));
+        size_t orig = ntohl(sizes[0]), cps = ntohl(sizes[1]);
+        if (cps > size_t(CHUNK_SIZE) * 2 + 1024) { std::cerr << "Oversized frame" << std::endl; break; }
+        std::vector<unsigned char> cipher(cps);
+        if (!recvAll(fd, cipher.data(), cps)) break;
+
+        bool parity = (offset & PARITY_FLAG) != 0;
+        uint64_t idx = parity ? offset & ~PARITY_FLAG : offset / CHUNK_SIZE;
+        bool valid = parity ? s.parityGroup > 0 && idx * s.parityGroup < s.chunks &&
+                              orig == chunkLength(s, idx * s.parityGroup)
+                            : offset % CHUNK_SIZE == 0 && offset < s.size && orig == chunkLength(s, idx);
+        if (!valid) { std::cerr << "Bad frame offset " << offset << " on path " << index << std::endl; break; }
+        {
+            std::lock_guard<std::mutex> lk(s.m);
+            if (s.closing) break;
+            if (!parity && s.got[idx]) { ++s.duplicates; continue; }   // resent elsewhere too
+        }
+
+        std::vector<char> comp, plain;
+        if (!decryptChunk(cipher, comp, s.key, (parity ? PARITY_NONCE_BASE : DATA_NONCE_BASE) + idx)) {
+            std::cerr << "Decryption/auth failed on path " << index << std::endl;
+            break;
+        }
+        if (!comp.empty() && !decompressChunk(comp, plain, orig)) {
+            std::cerr << "Decompression failed on path " << index << std::endl;
+            break;
+        }
+        std::lock_guard<std::mutex> lk(s.m);
+        if (s.closing) break;
+        if (parity)            onParity(s, idx, plain);
+        else if (!s.got[idx])  onChunk(s, idx, std::move(plain));
+        else                   ++s.duplicates;
+    }
+}
+
+void runReader(int fd, std::shared_ptr<Session> s, int index) {
+    readPath(fd, index, *s);
+    // receive() closes it, once nothing can shut it down any more.
+    std::lock_guard<std::mutex> lk(s->m);
+    --s->running;
+    s->cv.notify_all();
+}
+
+// Finishes a join on its own thread: finds the session (its MULTIPATH
+// frame may still be on its way), accepts the path and reads it.
+void join(int conn) {
+    unsigned char hello[sizeof(JOIN_MAGIC) + TOKEN_BYTES + 1];
+    if (!recvAll(conn, hello, sizeof(hello))) { CLOSE_SOCKET(conn); return; }
+    std::string token(reinterpret_cast<char*>(hello) + sizeof(JOIN_MAGIC), TOKEN_BYTES);
+    int index = hello[sizeof(hello) - 1];
+
+    std::shared_ptr<Session> s;
+    {
+        std::unique_lock<std::mutex> lk(g_sessionsMutex);
+        g_sessionsCv.wait_for(lk, std::chrono::seconds(JOIN_TIMEOUT_SEC),
+                              [&]{ return g_sessions.count(token) > 0; });
+        auto it = g_sessions.find(token);
+        if (it != g_sessions.end()) s = it->second;
+    }
+    if (!s || index == 0) { CLOSE_SOCKET(conn); return; }
+    setRecvTimeout(conn, 0);
+    {
+        std::lock_guard<std::mutex> lk(s->m);
+        if (s->closing) { CLOSE_SOCKET(conn); return; }
+        ++s->running;
+        s->fds.push_back(conn);
+    }
+    char ack = 'J';
+    if (send(conn, &ack, 1, MSG_NOSIGNAL) != 1) shutdown(conn, SHUT_RDWR);
+    else std::cout << "[DEBUG] Path " << index << " joined" << std::endl;
+    runReader(conn, s, index);
+}
+
+} // namespace
+
+int connectRoute(const Route& route, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    if (!route.local.empty()) {
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        if (inet_pton(AF_INET, route.local.c_str(), &local.sin_addr) != 1 ||
+            bind(fd, (sockaddr*)&local, sizeof(local)) < 0) {
+            perror(("bind " + route.local).c_str());
+            CLOSE_SOCKET(fd);
+            return -1;
+        }
+    }
+    sockaddr_in remote{};
+    remote.sin_family = AF_INET;
+    remote.sin_port   = htons(port);
+    if (inet_pton(AF_INET, route.remote.c_str(), &remote.sin_addr) != 1 ||
+        connect(fd, (sockaddr*)&remote, sizeof(remote)) < 0) {
+        perror(("connect " + route.remote).c_str());
+        CLOSE_SOCKET(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::vector<Route> routesTo(const std::vector<std::string>& remotes) {
+    std::vector<Route> routes;
+#ifndef _WIN32
+    ifaddrs* list = nullptr;
+    if (getifaddrs(&list) != 0) list = nullptr;
+    for (auto& remote : remotes) {
+        in_addr r;
+        if (inet_pton(AF_INET, remote.c_str(), &r) != 1) continue;
+        std::string local;
+        if ((ntohl(r.s_addr) >> 24) == 127) {
+            local = remote;   // loopback: every address is its own way in
+        } else {
+            for (ifaddrs* i = list; i && local.empty(); i = i->ifa_next) {
+                if (!i->ifa_addr || !i->ifa_netmask || i->ifa_addr->sa_family != AF_INET ||
+                    !(i->ifa_flags & IFF_UP)) continue;
+                in_addr a = ((sockaddr_in*)i->ifa_addr)->sin_addr;
+                in_addr m = ((sockaddr_in*)i->ifa_netmask)->sin_addr;
+                if ((a.s_addr & m.s_addr) != (r.s_addr & m.s_addr)) continue;
+                char buf[INET_ADDRSTRLEN];
+                local = inet_ntop(AF_INET, &a, buf, sizeof(buf));
+            }
+        }
+        if (local.empty()) continue;
+        bool taken = std::any_of(routes.begin(), routes.end(), [&](const Route& x) { return x.local == local; });
+        if (!taken) routes.push_back(Route{ local, remote });
+    }
+    if (list) freeifaddrs(list);
+#endif
+    if (routes.empty() && !remotes.empty()) routes.push_back(Route{ "", remotes.front() });
+    return routes;
+}
+
+bool sendFile(int fd, const std::vector<unsigned char>& key,
+              const std::vector<Route>& routes, int port, const std::string& path,
+              const FileTransfer::SendOptions& opts, const Options& mopts,
+              std::vector<PathStats>* stats, std::function<void(int, int)> onPath) {
+    struct stat st;
+    if (path == "-" || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || routes.size() < 2) {
+        // Nothing to spread: streams can't be read out of order.
+        return FileTransfer::sendFile(fd, path, key, opts);
+    }
+
+    Options tail = mopts;
+    if (tail.parityGroup < 2) tail.parityGroup = 0;
+    tail.parityGroup = std::min(tail.parityGroup, 255);
+    unsigned char token[TOKEN_BYTES];
+    randombytes_buf(token, sizeof(token));
+    std::vector<char> begin(BEGIN_BYTES);
+    memcpy(begin.data(), token, TOKEN_BYTES);
+    put64(begin.data() + TOKEN_BYTES, st.st_size);
+    put64(begin.data() + TOKEN_BYTES + 8, uint64_t(st.st_blocks) * 512);
+    begin[TOKEN_BYTES + 16] = char(tail.parityGroup);
+    uint64_t counter = 0;
+    if (!FileTransfer::sendMultipathBegin(fd, begin, key, counter)) return false;
+
+    std::vector<SendPath> paths;
+    paths.push_back(SendPath{ 0, fd, PathStats{ routes[0] } });
+    for (size_t r = 1; r < routes.size() && paths.size() < size_t(MAX_PATHS); ++r) {
+        int index = int(paths.size());
+        int jfd = joinPath(routes[r], port, token, index);
+        if (jfd >= 0) paths.push_back(SendPath{ index, jfd, PathStats{ routes[r] } });
+    }
+    std::cout << "[DEBUG] Sending " << path << " over " << paths.size() << " paths" << std::endl;
+
+    auto progress = Progress::track(opts.label.empty() ? path : opts.label, true, st.st_size);
+    SendJob job{ path, uint64_t(st.st_size), (uint64_t(st.st_size) + CHUNK_SIZE - 1) / CHUNK_SIZE,
+                 opts.compressionLevel, tail, key, fd, progress.get() };
+    job.paths = &paths;
+    job.hedged.assign(job.chunks, false);
+    auto startTime = clock_type::now();
+    std::vector<std::thread> threads;
+    for (auto& p : paths) {
+        if (onPath) onPath(p.index, p.fd);
+        threads.emplace_back(runPath, std::ref(p), std::ref(job));
+    }
+    threads.emplace_back(monitor, std::ref(job));
+
+    // The receiver answers once it has every chunk, from whichever path;
+    // anything still queued behind a slow path is dropped.
+    bool ok = FileTransfer::waitFileAck(fd) && !job.failed;
+    job.done = true;
+    for (auto& p : paths) shutdown(p.fd, SHUT_RDWR);
+    for (auto& t : threads) t.join();
+    for (auto& p : paths) {
+        if (p.index != 0) CLOSE_SOCKET(p.fd);
+    }
+    progress->enter(ok ? Progress::Stage::Done : Progress::Stage::Failed);
+
+    double elapsed = std::chrono::duration<double>(clock_type::now() - startTime).count();
+    for (auto& p : paths) {
+        std::cout << std::fixed << std::setprecision(1)
+                  << "[DEBUG] Path " << p.index << " "
+                  << (p.stats.route.local.empty() ? "*" : p.stats.route.local) << " -> "
+                  << p.stats.route.remote << ": " << p.stats.chunks << " chunks ("
+                  << p.stats.resent << " resent), "
+                  << p.stats.bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+        if (stats) stats->push_back(p.stats);
+    }
+    if (!ok) { std::cerr << "\nMultipath send failed" << std::endl; return false; }
+    std::cout << "\rProgress: 100% (" << std::fixed << std::setprecision(1)
+              << (st.st_size / (1024.0 * 1024.0)) / (elapsed > 0 ? elapsed : 1.0) << " MB/s)\n";
+    std::cout << "[DEBUG] Finished sending file" << std::endl;
+    return true;
+}
+
+bool claim(int conn) {
+    char magic[sizeof(JOIN_MAGIC)];
+    setRecvTimeout(conn, JOIN_TIMEOUT_SEC);
+    ssize_t n = recv(conn, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+    setRecvTimeout(conn, 0);
+    if (n != ssize_t(sizeof(magic)) || memcmp(magic, JOIN_MAGIC, sizeof(magic)) != 0) return false;
+    std::thread(join, conn).detach();
+    return true;
+}
+
+
+bool receive(int fd, const std::vector<char>& body, const std::vector<unsigned char>& key,
+             FileWriter& out, Progress::Transfer* progress) {
+    if (body.size() != BEGIN_BYTES) return false;
+    auto s = std::make_shared<Session>();
+    s->key         = key;
+    s->out         = &out;
+    s->progress    = progress;
+    s->size        = get64(body.data() + TOKEN_BYTES);
+    s->chunks      = (s->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    s->parityGroup = uint8_t(body[TOKEN_BYTES + 16]);
+    s->got.assign(s->chunks, false);
+    s->fds.push_back(fd);
+    s->running     = 1;   // this path
+    std::string token(body.data(), TOKEN_BYTES);
+    {
+        std::lock_guard<std::mutex> lk(g_sessionsMutex);
+        g_sessions[token] = s;
+    }
+    g_sessionsCv.notify_all();
+    std::cout << "[DEBUG] Multipath receive of " << s->size << " bytes" << std::endl;
+
+    std::thread primary(runReader, fd, s, 0);
+    std::unique_lock<std::mutex> lk(s->m);
+    s->cv.wait(lk, [&]{ return s->received == s->chunks || s->running == 0 || s->failed; });
+    // Whatever is still in flight is a resend or the sender is gone;
+    // every reader stops, so the writer is the caller's again.
+    s->closing = true;
+    for (int f : s->fds) shutdown(f, SHUT_RD);
+    s->cv.wait(lk, [&]{ return s->running == 0; });
+    lk.unlock();
+    primary.join();
+    {
+        std::lock_guard<std::mutex> glk(g_sessionsMutex);
+        g_sessions.erase(token);
+    }
+    for (size_t i = 1; i < s->fds.size(); ++i) CLOSE_SOCKET(s->fds[i]);
+
+    bool complete = !s->failed && s->received == s->chunks && s->heldBytes == 0;
+    if (complete) {
+        std::cout << "[DEBUG] Multipath: " << s->fds.size() << " paths, " << s->duplicates
+                  << " duplicate chunks, " << s->rebuilt << " rebuilt from parity" << std::endl;
+    } else {
+        std::cerr << "Multipath receive incomplete: " << s->received << "/" << s->chunks << " chunks" << std::endl;
+    }
+    out.seek(s->size);
+    return complete;
+}
+
+} // namespace Multipath
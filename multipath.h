@@ -0,0 +1,108 @@
+// multipath.h
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include "transfer.h"      // FileTransfer::SendOptions
+#include "writer.h"        // FileWriter
+#include "progress.h"      // Progress::Transfer
+
+// One file over several TCP connections to the same receiver, e.g. one
+// per network interface.
+//
+// The first connection is an ordinary session: key exchange, then a
+// MULTIPATH control frame carrying a random join token, the file size
+// and the parity group size. Every further connection opens with
+// JOIN_MAGIC, the token and its path index instead of a key exchange,
+// and the listener hands it to the waiting session (see claim()). From
+// there each path carries
+//   [offset u64][origSize u32][cipherSize u32][cipher]
+// frames, the nonce being DATA_NONCE_BASE + offset / CHUNK_SIZE, so
+// chunks can arrive on any path, in any order and more than once, and
+// are written where they belong. Zero chunks are frames with an empty
+// plaintext. A frame whose offset has PARITY_FLAG set carries the XOR of
+// a group of chunks (nonce PARITY_NONCE_BASE + group), from which the
+// receiver rebuilds the one member of a group still missing. Once every
+// chunk is in, the receiver answers on the first connection and all of
+// them are finished.
+//
+// Paths pull chunks from a shared cursor, and each only pulls while what
+// it has queued in its socket would drain within QUEUE_TARGET_MS at its
+// measured rate, so chunks spread in proportion to throughput and a path
+// that slows down stops taking work within about a second. Once the
+// cursor runs out, idle paths resend what is still queued on a path
+// that has slowed so far it needs HEDGE_AFTER_MS or more to drain, and
+// whatever a failed path never delivered.
+namespace Multipath {
+
+static const char     JOIN_MAGIC[8]     = { 'Q', 'D', 'J', 'O', 'I', 'N', '0', '1' };
+static const uint64_t DATA_NONCE_BASE   = 1ull << 40;   // clear of the control frame sequence
+static const uint64_t PARITY_NONCE_BASE = 1ull << 41;   // + group
+static const uint64_t PARITY_FLAG       = 1ull << 63;
+static const int      QUEUE_TARGET_MS   = 250;
+static const int      HEDGE_AFTER_MS    = 2 * QUEUE_TARGET_MS;
+static const int      MAX_PATHS         = 16;
+
+// Tail handling for a send.
+struct Options {
+    bool hedge       = true;   // resend chunks a lagging path still holds
+    int  parityGroup = 0;      // a parity frame per this many chunks (2-255), 0 = none
+};
+
+// A connection to open: from `local` ("" = let the kernel choose) to
+// `remote`.
+struct Route {
+    std::string local;
+    std::string remote;
+};
+
+// Per-path outcome, for reporting.
+struct PathStats {
+    Route    route;
+    uint64_t bytes  = 0;   // file bytes carried
+    uint64_t chunks = 0;
+    uint64_t resent = 0;   // of those, chunks another path had already sent
+    double   mbPerSec = 0; // rate estimate when the path finished
+};
+
+// Connects `route` to `port`, bound to route.local if set. Returns the
+// socket or -1.
+int connectRoute(const Route& route, int port);
+
+// One route per local interface towards `remotes` (a receiver's
+// addresses): each remote is reached from the interface on its subnet,
+// and remotes sharing an interface are dropped. Remotes no interface
+// matches keep the kernel's choice if nothing else does.
+std::vector<Route> routesTo(const std::vector<std::string>& remotes);
+
+// Sends regular file `path` over `fd`, an already keyed connection made
+// along routes[0], plus a joined connection along each further route
+// (ones that fail to connect or join are skipped); `fd` carries nothing
+// further afterwards. Other sources go over `fd` alone as
+// FileTransfer::sendFile would. `onPath`, if set, is called with each
+// path's index and socket once it is up. Returns false if the receiver
+// did not confirm the file.
+bool sendFile(int fd, const std::vector<unsigned char>& key,
+              const std::vector<Route>& routes, int port, const std::string& path,
+              const FileTransfer::SendOptions& opts = FileTransfer::SendOptions(),
+              const Options& mopts = Options(),
+              std::vector<PathStats>* stats = nullptr,
+              std::function<void(int, int)> onPath = nullptr);
+
+// For the listener, on the connection's own thread as it waits up to
+// a few seconds for the first bytes: if `conn` is a join, hands it to
+// its session on another thread and returns true; otherwise leaves the
+// stream untouched and returns false.
+bool claim(int conn);
+
+// Receiver side of a MULTIPATH frame read from the primary `fd`: takes
+// `body` (token, size, parity group) and writes the chunks of every path
+// into `out`, which is open. Returns once every chunk is in or every
+// path has ended; true if the file is complete. Paths still sending are
+// cut off, so nothing more is read from `fd`; the caller closes `out`
+// and acknowledges.
+bool receive(int fd, const std::vector<char>& body, const std::vector<unsigned char>& key,
+             FileWriter& out, Progress::Transfer* progress);
+
+} // namespace Multipath
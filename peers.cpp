@@ -0,0 +1,253 @@
+// peers.cpp
+// Discovered-listener registry.
+
+#include "peers.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef _WIN32
+  #include <ws2tcpip.h>
+#else
+  #include <arpa/inet.h>
+#endif
+
+namespace Discovery {
+
+PeerRegistry::PeerRegistry(clock_type::duration ttl)
+    : ttl_(ttl), snap_(std::make_shared<Snapshot>()) {}
+
+// IPv4 addresses pack with the port into one integer; anything else is
+// hashed.
+uint64_t PeerRegistry::keyOf(const char* ip, int port) {
+    in_addr a;
+    uint64_t addr = inet_pton(AF_INET, ip, &a) == 1
+                  ? ntohl(a.s_addr)
+                  : (std::hash<std::string_view>()(ip) | (1ull << 47));
+    return (addr << 16) ^ uint16_t(port);
+}
+
+void PeerRegistry::changed(Change c, const Receiver& r) {
+    uint64_t v = ++version_;
+    for (auto& l : listeners_) l(c, r, v);
+}
+
+void PeerRegistry::dropAddress(uint64_t id, uint64_t addr) {
+    byAddr_.erase(addr);
+    auto it = peers_.find(id);
+    if (it == peers_.end()) return;
+    Entry& e = it->second;
+    for (size_t i = 0; i < e.heard.size(); ++i) {
+        if (e.heard[i].addr != addr) continue;
+        e.heard.erase(e.heard.begin() + i);
+        e.peer.addrs.erase(e.peer.addrs.begin() + i);
+        break;
+    }
+    if (e.peer.addrs.empty()) {
+        Receiver gone = e.peer;
+        peers_.erase(it);
+        changed(Change::Leave, gone);
+    } else {
+        e.peer.ip = e.peer.addrs.front();
+        changed(Change::Update, e.peer);
+    }
+}
+
+void PeerRegistry::seen(const Sighting& s) {
+    auto now = clock_type::now();
+    uint64_t addr = keyOf(s.ip, s.port);
+    uint64_t id   = s.instance ? s.instance : addr;
+    std::lock_guard<std::mutex> lk(m_);
+    auto it = peers_.find(id);
+    if (it == peers_.end()) {
+        // A listener that restarted, or an address now someone else's.
+        auto owner = byAddr_.find(addr);
+        if (owner != byAddr_.end()) dropAddress(owner->second, addr);
+        Receiver r{ s.ip, s.port, std::string(s.alias), std::string(s.pin), s.instance, s.caps, { s.ip } };
+        peers_.emplace(id, Entry{ r, nextJoin_++, now, { Heard{ addr, now } }, now, false });
+        byAddr_[addr] = id;
+        changed(Change::Join, r);
+        return;
+    }
+    Entry& e = it->second;
+    e.lastSeen = now;
+    Receiver& known = e.peer;
+    bool update = false;
+    auto h = std::find_if(e.heard.begin(), e.heard.end(), [&](const Heard& x) { return x.addr == addr; });
+    if (h != e.heard.end()) {
+        h->at = now;
+    } else {
+        auto owner = byAddr_.find(addr);
+        if (owner != byAddr_.end()) dropAddress(owner->second, addr);
+        known.addrs.push_back(s.ip);
+        e.heard.push_back(Heard{ addr, now });
+        byAddr_[addr] = id;
+        update = true;
+    }
+    // A new alias, PIN or capability updates the entry rather than adding
+    // another. A new load is kept at once but only shown, with the next
+    // update or once it has waited LOAD_REFRESH_SECONDS.
+    if (known.alias != s.alias || known.pin != s.pin || !known.caps.sameSettings(s.caps)) {
+        known.alias = std::string(s.alias);
+        known.pin   = std::string(s.pin);
+        update = true;
+    }
+    if (!known.caps.sameLoad(s.caps)) e.loadHeld = true;
+    known.caps = s.caps;
+    if (e.loadHeld && now - e.loadShown >= std::chrono::seconds(LOAD_REFRESH_SECONDS)) update = true;
+    if (update) {
+        e.loadShown = now;
+        e.loadHeld  = false;
+        changed(Change::Update, known);
+    }
+}
+
+void PeerRegistry::seen(const Receiver& r) {
+    seen(Sighting{ r.ip.c_str(), r.port, r.alias, r.pin, r.instance, r.caps });
+}
+
+void PeerRegistry::expire() {
+    auto cutoff = clock_type::now() - ttl_;
+    std::lock_guard<std::mutex> lk(m_);
+    std::vector<std::pair<uint64_t, uint64_t>> stale;   // (peer, address)
+    for (auto& kv : peers_) {
+        for (auto& h : kv.second.heard) {
+            if (h.at < cutoff) stale.emplace_back(kv.first, h.addr);
+        }
+    }
+    for (auto& st : stale) dropAddress(st.first, st.second);
+}
+
+std::shared_ptr<const PeerRegistry::Snapshot> PeerRegistry::snapshot() const {
+    auto s = std::atomic_load(&snap_);
+    if (s->version == version_.load()) return s;
+
+    std::lock_guard<std::mutex> lk(m_);
+    s = std::atomic_load(&snap_);
+    if (s->version == version_.load()) return s;   // another reader rebuilt it
+    std::vector<const Entry*> order;
+    order.reserve(peers_.size());
+    for (auto& kv : peers_) order.push_back(&kv.second);
+    std::sort(order.begin(), order.end(), [](const Entry* a, const Entry* b) {
+        return a->joined < b->joined;
+    });
+    auto fresh = std::make_shared<Snapshot>();
+    fresh->version = version_.load();
+    fresh->peers.reserve(order.size());
+    for (auto* e : order) fresh->peers.push_back(e->peer);
+    std::atomic_store(&snap_, std::shared_ptr<const Snapshot>(fresh));
+    return fresh;
+}
+
+void PeerRegistry::onChange(Listener listener) {
+    std::lock_guard<std::mutex> lk(m_);
+    listeners_.push_back(std::move(listener));
+}
+
+const char* changeName(PeerRegistry::Change c) {
+    switch (c) {
+    case PeerRegistry::Change::Join:   return "join";
+    case PeerRegistry::Change::Update: return "update";
+    case PeerRegistry::Change::Leave:  return "leave";
+    }
+    return "?";
+}
+
+namespace {
+
+const size_t  CACHE_MAX_PEERS  = 64;
+const int64_t CACHE_MAX_AGE    = 30 * 24 * 3600;
+
+struct CachedPeer {
+    int64_t  seen;
+    Receiver peer;
+};
+
+// One line per peer: "<unix seconds>\t<ip>\t<port>\t<alias>".
+std::vector<CachedPeer> readCache(const std::string& path) {
+    std::vector<CachedPeer> out;
+    std::ifstream in(path);
+    std::string line;
+    int64_t cutoff = int64_t(time(nullptr)) - CACHE_MAX_AGE;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        CachedPeer c;
+        std::string port;
+        if (!(fields >> c.seen) || fields.get() != '\t' ||
+            !std::getline(fields, c.peer.ip, '\t') ||
+            !std::getline(fields, port, '\t') ||
+            !std::getline(fields, c.peer.alias)) continue;
+        c.peer.port = std::atoi(port.c_str());
+        if (c.seen < cutoff || c.peer.port <= 0) continue;
+        out.push_back(c);
+    }
+    std::sort(out.begin(), out.end(), [](const CachedPeer& a, const CachedPeer& b) {
+        return a.seen > b.seen;
+    });
+    return out;
+}
+
+} // namespace
+
+std::string peerCachePath() {
+    std::string base;
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME")) {
+        base = xdg;
+    } else if (const char* home = std::getenv("HOME")) {
+        base = std::string(home) + "/.cache";
+        mkdir(base.c_str(), 0700);
+    } else {
+        return "";
+    }
+    return base + "/quickdrop/peers";
+}
+
+std::vector<Receiver> loadPeerCache(const std::string& path) {
+    std::vector<Receiver> peers;
+    if (path.empty()) return peers;
+    for (auto& c : readCache(path)) peers.push_back(c.peer);
+    return peers;
+}
+
+bool savePeerCache(const std::string& path, const std::vector<Receiver>& peers) {
+    if (path.empty() || peers.empty()) return true;
+    mkdir(path.substr(0, path.rfind('/')).c_str(), 0700);
+    int64_t now = time(nullptr);
+    std::vector<CachedPeer> merged;
+    for (auto& p : peers) {
+        for (auto& ip : p.addrs.empty() ? std::vector<std::string>{ p.ip } : p.addrs) {
+            CachedPeer c{ now, p };
+            c.peer.ip = ip;
+            merged.push_back(c);
+        }
+    }
+    size_t fresh = merged.size();
+    for (auto& c : readCache(path)) {
+        bool seen = std::any_of(merged.begin(), merged.begin() + fresh, [&](const CachedPeer& m) {
+            return m.peer.ip == c.peer.ip && m.peer.port == c.peer.port;
+        });
+        if (!seen) merged.push_back(c);
+    }
+    if (merged.size() > CACHE_MAX_PEERS) merged.resize(CACHE_MAX_PEERS);
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        for (auto& c : merged) {
+            // Aliases come off the network; keep them to one field.
+            std::string alias = c.peer.alias;
+            std::replace(alias.begin(), alias.end(), '\t', ' ');
+            std::replace(alias.begin(), alias.end(), '\n', ' ');
+            out << c.seen << '\t' << c.peer.ip << '\t' << c.peer.port << '\t' << alias << '\n';
+        }
+        if (!out) { perror("write peer cache"); return false; }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) { perror("rename peer cache"); return false; }
+    return true;
+}
+
+} // namespace Discovery
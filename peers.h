@@ -0,0 +1,147 @@
+// peers.h
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+namespace Discovery {
+
+// Codec bits in Capabilities::codecs.
+static const uint8_t CAP_ZSTD              = 1;
+static const uint8_t CAP_CHACHA20_POLY1305 = 2;
+
+// What a listener says about itself in its beacons. Zero means unknown:
+// everything is, from text beacons.
+struct Capabilities {
+    uint8_t  protocol  = 0;   // transfer protocol version
+    uint8_t  codecs    = 0;   // CAP_* bits
+    uint16_t cores     = 0;
+    uint16_t active    = 0;   // transfers in progress
+    uint32_t freeMB    = 0;   // free space where it receives
+    uint16_t probePort = 0;   // UDP port answering bandwidth probes
+
+    // Equal but for the load (active, freeMB), which a busy listener's
+    // beacons change nearly every time.
+    bool sameSettings(const Capabilities& o) const {
+        return protocol == o.protocol && codecs == o.codecs && cores == o.cores &&
+               probePort == o.probePort;
+    }
+    bool sameLoad(const Capabilities& o) const {
+        return active == o.active && freeMB == o.freeMB;
+    }
+};
+
+struct Receiver {
+    std::string ip;
+    int port;
+    std::string alias;
+    std::string pin;
+    uint64_t instance = 0;   // random per listening session; 0 from older peers
+    Capabilities caps;
+    std::vector<std::string> addrs;   // every address it is heard from; ip is the first
+};
+
+// A beacon as heard, before anything is copied out of the datagram.
+struct Sighting {
+    const char*      ip;     // NUL-terminated
+    int              port;
+    std::string_view alias;
+    std::string_view pin;
+    uint64_t         instance;
+    Capabilities     caps;
+};
+
+// How long a listener stays known after its last beacon (several of the
+// longest beacon intervals, so a lost datagram or two doesn't drop it).
+static const int PEER_TTL_SECONDS = 30;
+
+// A peer whose beacons change only its load is updated at most this often.
+static const int LOAD_REFRESH_SECONDS = 5;
+
+// Listeners heard on the discovery port. A listener is keyed by its
+// instance id (by ip:port for text beacons, which have none), so one on
+// several networks is one peer with several addresses. A beacon is two
+// hash lookups under a short lock; readers take an immutable snapshot
+// without locking, and only the first read after a change pays to
+// rebuild it. Every join, update and expiry bumps the version; a change
+// in load alone is held back up to LOAD_REFRESH_SECONDS, so a listener
+// busy receiving doesn't turn each of its beacons into an update.
+class PeerRegistry {
+public:
+    enum class Change { Join, Update, Leave };
+
+    struct Snapshot {
+        uint64_t version = 0;
+        std::vector<Receiver> peers;   // in the order they joined
+    };
+
+    // Runs under the registry lock for each change, with the version the
+    // change produced; keep it short.
+    using Listener = std::function<void(Change, const Receiver&, uint64_t version)>;
+
+    explicit PeerRegistry(std::chrono::steady_clock::duration ttl = std::chrono::seconds(PEER_TTL_SECONDS));
+
+    // Records a beacon. Allocates only when the peer is new or changed.
+    void seen(const Sighting& s);
+    void seen(const Receiver& r);
+    // Drops addresses, and peers, not heard from for the TTL.
+    void expire();
+
+    std::shared_ptr<const Snapshot> snapshot() const;
+    uint64_t version() const { return version_.load(); }
+
+    void onChange(Listener listener);
+
+private:
+    using clock_type = std::chrono::steady_clock;
+    struct Heard {
+        uint64_t addr;                 // keyOf(ip, port)
+        clock_type::time_point at;
+    };
+    struct Entry {
+        Receiver peer;
+        uint64_t joined;               // join sequence, for a stable order
+        clock_type::time_point lastSeen;
+        std::vector<Heard> heard;      // parallel to peer.addrs
+        clock_type::time_point loadShown;   // when peer.caps' load last went out
+        bool loadHeld;                 // peer.caps has a load not shown yet
+    };
+
+    static uint64_t keyOf(const char* ip, int port);
+    // Caller holds m_ for these.
+    void changed(Change c, const Receiver& r);
+    void dropAddress(uint64_t id, uint64_t addr);
+
+    clock_type::duration ttl_;
+    mutable std::mutex m_;
+    // Instance ids are random 64-bit values, so they won't meet the
+    // packed addresses text beacons are keyed by.
+    std::unordered_map<uint64_t, Entry> peers_;
+    std::unordered_map<uint64_t, uint64_t> byAddr_;   // address -> peers_ key
+    uint64_t nextJoin_ = 0;
+    std::atomic<uint64_t> version_{0};
+    std::vector<Listener> listeners_;
+    mutable std::shared_ptr<const Snapshot> snap_;   // accessed with std::atomic_load/store
+};
+
+const char* changeName(PeerRegistry::Change c);
+
+// Listeners found by earlier runs, so a query can go straight to them:
+// $XDG_CACHE_HOME/quickdrop/peers, else ~/.cache/quickdrop/peers, or ""
+// if neither is known.
+std::string peerCachePath();
+// Entries from the last 30 days, most recently seen first; PINs are not
+// kept.
+std::vector<Receiver> loadPeerCache(const std::string& path);
+// Merges `peers` into the cache as seen now, a line per address, keeping
+// the newest 64.
+bool savePeerCache(const std::string& path, const std::vector<Receiver>& peers);
+
+} // namespace Discovery
@@ -0,0 +1,207 @@
+// progress.cpp
+// Fixed-rate publisher for transfer progress.
+
+#include "progress.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdio>
+
+namespace Progress {
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const auto TICK   = std::chrono::milliseconds(250);
+const auto LINGER = std::chrono::seconds(5);   // finished transfers stay visible this long
+
+struct Tracked {
+    std::shared_ptr<Transfer> t;
+    uint64_t lastBytes = UINT64_MAX;   // as of the previous tick
+    int      lastStage = -1;
+    clock_type::time_point ended{};
+};
+
+std::mutex                                       g_mutex;
+std::vector<Tracked>                             g_tracked;
+std::vector<std::function<void(const std::string&)>> g_sinks;
+std::atomic<uint64_t>                            g_nextId{1};
+std::once_flag                                   g_started;
+
+double secondsSince(clock_type::time_point t) {
+    return std::chrono::duration<double>(clock_type::now() - t).count();
+}
+
+// Time the transfer has been running, or ran for if it has ended.
+double elapsedSeconds(const Transfer& t) {
+    int stage = t.stage.load();
+    if (stage == int(Stage::Done) || stage == int(Stage::Failed)) {
+        return t.stageAtUs[stage].load() / 1e6;
+    }
+    return secondsSince(t.start);
+}
+
+std::string jsonEscape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else out += c;
+    }
+    return out;
+}
+
+std::string toJson(const std::vector<Tracked>& all) {
+    std::ostringstream js;
+    js << std::fixed << std::setprecision(3) << "[";
+    for (size_t i = 0; i < all.size(); ++i) {
+        const Transfer& t = *all[i].t;
+        uint64_t bytes = t.bytes.load(std::memory_order_relaxed);
+        double secs = elapsedSeconds(t);
+        if (i) js << ",";
+        js << "{\"id\":" << t.id
+           << ",\"name\":\"" << jsonEscape(t.name) << "\""
+           << ",\"direction\":\"" << (t.sending ? "send" : "receive") << "\""
+           << ",\"bytes\":" << bytes
+           << ",\"total\":" << t.total.load(std::memory_order_relaxed)
+           << ",\"mbps\":" << (bytes / (1024.0 * 1024.0)) / (secs > 0 ? secs : 1.0)
+           << ",\"stage\":\"" << stageName(Stage(t.stage.load())) << "\""
+           << ",\"stages\":{";
+        bool first = true;
+        for (int s = 0; s < STAGE_COUNT; ++s) {
+            int64_t at = t.stageAtUs[s].load();
+            if (at < 0) continue;
+            js << (first ? "" : ",") << "\"" << stageName(Stage(s)) << "\":" << at / 1e6;
+            first = false;
+        }
+        js << "}}";
+    }
+    js << "]";
+    return js.str();
+}
+
+// One console line per tick for the most recently started active transfer,
+// in the format the transfer loops used to print per chunk.
+void printConsole(const Transfer& t) {
+    uint64_t done  = t.bytes.load(std::memory_order_relaxed);
+    uint64_t total = t.total.load(std::memory_order_relaxed);
+    double elapsed = elapsedSeconds(t);
+    double mbps    = (done / (1024.0 * 1024.0)) / (elapsed > 0 ? elapsed : 1.0);
+    std::cout << std::fixed << std::setprecision(1);
+    if (!t.sending) {
+        std::cout << "\rReceiving: " << mbps << " MB/s";
+    } else if (total > 0) {
+        std::cout << "\rProgress: " << int((double)done / total * 100) << "% (" << mbps << " MB/s)";
+    } else {
+        std::cout << "\rProgress: " << done / (1024.0 * 1024.0) << " MB (" << mbps << " MB/s)";
+    }
+    std::cout << std::flush;
+}
+
+void publisherLoop() {
+    while (true) {
+        std::this_thread::sleep_for(TICK);
+        std::vector<std::function<void(const std::string&)>> sinks;
+        std::string json;
+        {
+            std::lock_guard<std::mutex> lk(g_mutex);
+            bool changed = false;
+            const Transfer* console = nullptr;
+            for (auto& tr : g_tracked) {
+                uint64_t bytes = tr.t->bytes.load(std::memory_order_relaxed);
+                int stage = tr.t->stage.load();
+                if (bytes != tr.lastBytes || stage != tr.lastStage) changed = true;
+                tr.lastBytes = bytes;
+                tr.lastStage = stage;
+                bool active = stage == int(Stage::Transferring);
+                if (active && bytes > 0) console = tr.t.get();
+                if (!active && tr.ended == clock_type::time_point{}) tr.ended = clock_type::now();
+            }
+            if (console) printConsole(*console);
+            if (changed && !g_sinks.empty()) {
+                json  = toJson(g_tracked);
+                sinks = g_sinks;
+            }
+            auto now = clock_type::now();
+            for (auto it = g_tracked.begin(); it != g_tracked.end(); ) {
+                bool expired = it->ended != clock_type::time_point{} && now - it->ended > LINGER;
+                it = expired ? g_tracked.erase(it) : it + 1;
+            }
+        }
+        for (auto& sink : sinks) sink(json);
+    }
+}
+
+void ensurePublisher() {
+    std::call_once(g_started, []{ std::thread(publisherLoop).detach(); });
+}
+
+} // namespace
+
+const char* stageName(Stage s) {
+    switch (s) {
+    case Stage::Transferring: return "transferring";
+    case Stage::Syncing:      return "syncing";
+    case Stage::Done:         return "done";
+    case Stage::Failed:       return "failed";
+    }
+    return "?";
+}
+
+Transfer::Transfer() {
+    for (auto& at : stageAtUs) at.store(-1);
+    stageAtUs[int(Stage::Transferring)].store(0);
+}
+
+void Transfer::enter(Stage s) {
+    stageAtUs[int(s)].store(std::chrono::duration_cast<std::chrono::microseconds>(
+        clock_type::now() - start).count());
+    stage.store(int(s));
+}
+
+std::shared_ptr<Transfer> track(const std::string& name, bool sending, uint64_t total) {
+    auto t = std::make_shared<Transfer>();
+    t->id      = g_nextId++;
+    t->name    = name;
+    t->sending = sending;
+    t->total   = total;
+    {
+        std::lock_guard<std::mutex> lk(g_mutex);
+        Tracked tr;
+        tr.t = t;
+        g_tracked.push_back(tr);
+    }
+    ensurePublisher();
+    return t;
+}
+
+void subscribe(std::function<void(const std::string&)> sink) {
+    {
+        std::lock_guard<std::mutex> lk(g_mutex);
+        g_sinks.push_back(std::move(sink));
+    }
+    ensurePublisher();
+}
+
+std::string snapshotJson() {
+    std::lock_guard<std::mutex> lk(g_mutex);
+    return toJson(g_tracked);
+}
+
+int activeCount() {
+    std::lock_guard<std::mutex> lk(g_mutex);
+    int n = 0;
+    for (auto& tr : g_tracked) n += tr.t->stage.load() == int(Stage::Transferring);
+    return n;
+}
+
+} // namespace Progress
@@ -0,0 +1,56 @@
+// progress.h
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Live transfer progress. The transfer loops only bump relaxed atomic
+// counters; a publisher thread samples every tracked transfer at a fixed
+// rate, prints the console progress line and pushes a JSON snapshot to
+// subscribers (the web UI's WebSocket). Nothing on the per-chunk path
+// formats strings or takes a lock.
+namespace Progress {
+
+enum class Stage : int {
+    Transferring,   // bytes are moving
+    Syncing,        // receiver: waiting for the disk
+    Done,
+    Failed,
+};
+const int STAGE_COUNT = 4;
+
+const char* stageName(Stage s);
+
+struct Transfer {
+    uint64_t    id = 0;
+    std::string name;
+    bool        sending = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::atomic<uint64_t> bytes{0};   // logical bytes so far, holes and keeps included
+    std::atomic<uint64_t> total{0};   // 0 = unknown (streams)
+    std::atomic<int>      stage{int(Stage::Transferring)};
+    std::atomic<int64_t>  stageAtUs[STAGE_COUNT];   // when each stage began, -1 = not reached
+
+    Transfer();
+    void add(uint64_t n) { bytes.fetch_add(n, std::memory_order_relaxed); }
+    void enter(Stage s);
+};
+
+// Registers a transfer; it is reported until shortly after it ends.
+std::shared_ptr<Transfer> track(const std::string& name, bool sending, uint64_t total = 0);
+
+// Called with a JSON array of all tracked transfers on every tick on
+// which any of them changed. Runs on the publisher thread.
+void subscribe(std::function<void(const std::string&)> sink);
+
+// The same JSON, on demand.
+std::string snapshotJson();
+
+// Transfers still moving bytes, in either direction.
+int activeCount();
+
+} // namespace Progress
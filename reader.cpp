@@ -0,0 +1,274 @@
+// reader.cpp
+// Read backends for the sender: buffered pread, mmap and O_DIRECT.
+
+#include "reader.h"
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+// Auto picks O_DIRECT from this size up, pread below. Never mmap: the
+// sender copies each chunk out anyway, and a file truncated under the
+// mapping raises SIGBUS where pread just reads short.
+const uint64_t AUTO_DIRECT_MIN = 4ull << 30;    // 4 GB
+
+// Files at least this large are read once and should not stay cached;
+// pages are dropped in windows behind the read position.
+const uint64_t DROP_BEHIND_MIN = 64ull << 20;
+const uint64_t DROP_WINDOW     = 8ull << 20;
+
+void adviseSequential(int fd) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+    (void)fd;
+#endif
+}
+
+// Drops cached pages in [dropped, upTo) once the window behind the reader is full.
+void dropBehind(int fd, uint64_t& dropped, uint64_t upTo) {
+#ifdef POSIX_FADV_DONTNEED
+    if (upTo < dropped + DROP_WINDOW) return;
+    posix_fadvise(fd, static_cast<off_t>(dropped), static_cast<off_t>(upTo - dropped),
+                  POSIX_FADV_DONTNEED);
+    dropped = upTo;
+#else
+    (void)fd; (void)dropped; (void)upTo;
+#endif
+}
+
+struct PreadReader : ChunkReader {
+    int fd;
+    bool drop;
+    uint64_t dropped = 0;
+    std::vector<char> buffer;
+
+    PreadReader(int fd, uint64_t size) : fd(fd), drop(size >= DROP_BEHIND_MIN) {
+        adviseSequential(fd);
+    }
+
+    ssize_t read(uint64_t offset, size_t len, const char*& data) override {
+        if (buffer.size() < len) buffer.resize(len);
+        ssize_t n = pread(fd, buffer.data(), len, static_cast<off_t>(offset));
+        data = buffer.data();
+        if (n > 0 && drop) dropBehind(fd, dropped, offset + n);
+        return n;
+    }
+};
+
+struct MmapReader : ChunkReader {
+    int fd;
+    uint64_t size;
+    char* base;
+    bool drop;
+    uint64_t dropped = 0;
+
+    MmapReader(int fd, uint64_t size, char* base)
+        : fd(fd), size(size), base(base), drop(size >= DROP_BEHIND_MIN) {
+        madvise(base, size, MADV_SEQUENTIAL);
+    }
+    ~MmapReader() override { munmap(base, size); }
+
+    ssize_t read(uint64_t offset, size_t len, const char*& data) override {
+        // Touching pages past a truncated end raises SIGBUS, so read no
+        // further than the file reaches now. That only narrows the race
+        // with a concurrent truncate; hence mmap is never picked by Auto.
+        struct stat st;
+        if (fstat(fd, &st) != 0) return -1;
+        uint64_t end = std::min<uint64_t>(size, uint64_t(st.st_size));
+        if (offset >= end) return 0;
+        size_t n = static_cast<size_t>(std::min<uint64_t>(len, end - offset));
+        data = base + offset;
+        if (drop && offset + n >= dropped + DROP_WINDOW) {
+            // Unmap our references first so the page cache can let them go.
+            uint64_t page = sysconf(_SC_PAGESIZE);
+            uint64_t end  = (offset + n) / page * page;
+            if (end > dropped) {
+                madvise(base + dropped, end - dropped, MADV_DONTNEED);
+                dropBehind(fd, dropped, end);
+            }
+        }
+        return static_cast<ssize_t>(n);
+    }
+};
+
+// O_DIRECT reads into a pool of aligned buffers. Worker threads keep up to
+// DEPTH blocks in flight ahead of the consumer; a jump outside the window
+// (e.g. over a large hole) restarts the read-ahead at the new position.
+struct DirectReader : ChunkReader {
+    static const size_t BLOCK   = 1 << 20;   // 1 MB per I/O
+    static const size_t DEPTH   = 16;        // buffers in the pool
+    static const int    WORKERS = 4;         // concurrent O_DIRECT reads
+
+    struct Block { char* buf; ssize_t n; int err; };   // err: pread's errno if n < 0
+
+    int dfd;          // O_DIRECT descriptor, owned
+    int fd;           // buffered descriptor for unaligned leftovers
+    uint64_t size;
+    std::vector<char*> pool;
+    std::vector<char*> freeBufs;
+    std::map<uint64_t, Block> ready;   // block offset → data
+    uint64_t next = 0;                 // next block offset to issue
+    uint64_t generation = 0;           // bumped when read-ahead restarts
+    uint64_t current = UINT64_MAX;     // block the consumer is reading from
+    bool stop = false;
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    std::vector<char> spill;
+
+    DirectReader(int dfd, int fd, uint64_t size) : dfd(dfd), fd(fd), size(size) {
+        for (size_t i = 0; i < DEPTH; ++i) {
+            void* p = nullptr;
+            if (posix_memalign(&p, 4096, BLOCK) == 0) pool.push_back(static_cast<char*>(p));
+        }
+        freeBufs = pool;
+        for (int i = 0; i < WORKERS; ++i) workers.emplace_back([this]{ work(); });
+    }
+
+    ~DirectReader() override {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+        for (char* p : pool) free(p);
+        close(dfd);
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lk(m);
+        while (true) {
+            cv.wait(lk, [&]{ return stop || (!freeBufs.empty() && next < size); });
+            if (stop) return;
+            char* buf = freeBufs.back();
+            freeBufs.pop_back();
+            uint64_t off = next, gen = generation;
+            next += BLOCK;
+            lk.unlock();
+            ssize_t n = pread(dfd, buf, BLOCK, static_cast<off_t>(off));
+            int err = n < 0 ? errno : 0;
+            lk.lock();
+            if (gen != generation) freeBufs.push_back(buf);
+            else ready[off] = { buf, n, err };
+            cv.notify_all();
+        }
+    }
+
+    // Returns buffers of blocks before `block` to the pool. Caller holds m.
+    void releaseBefore(uint64_t block) {
+        for (auto it = ready.begin(); it != ready.end() && it->first < block; ) {
+            freeBufs.push_back(it->second.buf);
+            it = ready.erase(it);
+        }
+    }
+
+    ssize_t read(uint64_t offset, size_t len, const char*& data) override {
+        if (offset >= size) return 0;
+        uint64_t block = offset / BLOCK * BLOCK;
+        std::unique_lock<std::mutex> lk(m);
+        if (block != current) {
+            releaseBefore(block);
+            // Blocks in [current, next) are ready or in flight; anything
+            // else was never issued (forward jump) or already released.
+            if (block >= next || current == UINT64_MAX || block < current) {
+                generation++;
+                releaseBefore(UINT64_MAX);
+                next = block;
+            }
+            current = block;
+            cv.notify_all();
+        }
+        cv.wait(lk, [&]{ return ready.count(block) > 0; });
+        const Block& b = ready[block];
+        if (b.n < 0) { errno = b.err; return -1; }   // the worker's errno, not ours
+        uint64_t within = offset - block;
+        if (within >= uint64_t(b.n)) return 0;
+        size_t avail = static_cast<size_t>(b.n - within);
+        if (len <= avail || b.n < ssize_t(BLOCK)) {   // short block: EOF
+            data = b.buf + within;
+            return static_cast<ssize_t>(std::min(len, avail));
+        }
+        lk.unlock();
+        // Straddles a block boundary; not produced by the chunk grid but
+        // serve it through the page cache rather than fail.
+        if (spill.size() < len) spill.resize(len);
+        ssize_t n = pread(fd, spill.data(), len, static_cast<off_t>(offset));
+        data = spill.data();
+        return n;
+    }
+};
+
+int openDirect(const std::string& path) {
+#if defined(O_DIRECT)
+    return open(path.c_str(), O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+    int dfd = open(path.c_str(), O_RDONLY);
+    if (dfd >= 0) fcntl(dfd, F_NOCACHE, 1);
+    return dfd;
+#else
+    (void)path;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+} // namespace
+
+bool parseReadBackend(const std::string& name, ReadBackend& out) {
+    if (name == "auto")   { out = ReadBackend::Auto;   return true; }
+    if (name == "pread")  { out = ReadBackend::Pread;  return true; }
+    if (name == "mmap")   { out = ReadBackend::Mmap;   return true; }
+    if (name == "direct") { out = ReadBackend::Direct; return true; }
+    return false;
+}
+
+const char* readBackendName(ReadBackend backend) {
+    switch (backend) {
+    case ReadBackend::Auto:   return "auto";
+    case ReadBackend::Pread:  return "pread";
+    case ReadBackend::Mmap:   return "mmap";
+    case ReadBackend::Direct: return "direct";
+    }
+    return "?";
+}
+
+ReadBackend chooseReadBackend(uint64_t size) {
+    if (size >= AUTO_DIRECT_MIN) return ReadBackend::Direct;
+    return ReadBackend::Pread;
+}
+
+std::unique_ptr<ChunkReader> openChunkReader(const std::string& path, int fd,
+                                             uint64_t size, ReadBackend backend) {
+    if (backend == ReadBackend::Auto) backend = chooseReadBackend(size);
+
+    if (backend == ReadBackend::Mmap && size > 0) {
+        void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED) {
+            return std::unique_ptr<ChunkReader>(new MmapReader(fd, size, static_cast<char*>(base)));
+        }
+        perror("mmap reader, falling back to pread");
+    }
+    if (backend == ReadBackend::Direct && size > 0) {
+        int dfd = openDirect(path);
+        if (dfd >= 0) {
+            return std::unique_ptr<ChunkReader>(new DirectReader(dfd, fd, size));
+        }
+        perror("O_DIRECT reader, falling back to pread");
+    }
+    return std::unique_ptr<ChunkReader>(new PreadReader(fd, size));
+}
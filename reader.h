@@ -0,0 +1,38 @@
+// reader.h
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+// How sendFile pulls bytes from a regular file.
+enum class ReadBackend {
+    Auto,    // pick by file size: Direct for very large files, else Pread
+    Pread,   // buffered pread with sequential/drop-behind fadvise hints
+    Mmap,    // read-only mapping with MADV_SEQUENTIAL; only if asked for, as a
+             // file truncated mid-send can still raise SIGBUS
+    Direct,  // O_DIRECT into aligned pooled buffers, read ahead by worker threads
+};
+
+// Parses "auto", "pread", "mmap" or "direct"; false if unknown.
+bool parseReadBackend(const std::string& name, ReadBackend& out);
+const char* readBackendName(ReadBackend backend);
+
+// Resolves Auto to a concrete backend for a file of `size` bytes.
+ReadBackend chooseReadBackend(uint64_t size);
+
+// Random-access reader over one regular file. Reads are expected to be
+// mostly sequential; backends prefetch and drop pages on that basis.
+struct ChunkReader {
+    virtual ~ChunkReader() = default;
+
+    // Points `data` at up to `len` bytes starting at `offset`. The bytes
+    // stay valid until the next call. Returns the count, 0 at EOF, -1 on error.
+    virtual ssize_t read(uint64_t offset, size_t len, const char*& data) = 0;
+};
+
+// Opens a reader for `path`, already open as `fd` (not owned). Falls back
+// to Pread if the requested backend cannot be used for this file.
+std::unique_ptr<ChunkReader> openChunkReader(const std::string& path, int fd,
+                                             uint64_t size, ReadBackend backend);
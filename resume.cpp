@@ -0,0 +1,275 @@
+// resume.cpp
+// Resumption tickets: derivation, the sender's cache and the receiver's
+// single-use store.
+
+#include "resume.h"
+#include "transfer.h"      // createConnection, CLOSE_SOCKET
+#include "crypto.h"        // doKeyExchange
+
+#include <sodium.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace Resume {
+
+namespace {
+
+const size_t NONCE_BYTES  = 16;
+const size_t SECRET_BYTES = 32;
+const size_t HELLO_BYTES  = sizeof(RESUME_MAGIC) + TICKET_ID_BYTES + NONCE_BYTES;
+const size_t MAX_TICKETS  = 4096;   // receiver side; the oldest go first
+const int    ANSWER_TIMEOUT_SEC = 10;
+
+struct Ticket {
+    std::string id;        // TICKET_ID_BYTES raw bytes
+    std::string secret;    // SECRET_BYTES raw bytes
+    int64_t     expires;   // unix seconds
+};
+
+// H_key(label || extra), `out` bytes long.
+std::string derive(const std::string& key, const char* label, const std::string& extra, size_t out) {
+    std::string msg = std::string(label) + extra;
+    std::string h(out, '\0');
+    crypto_generichash(reinterpret_cast<unsigned char*>(&h[0]), out,
+                       reinterpret_cast<const unsigned char*>(msg.data()), msg.size(),
+                       reinterpret_cast<const unsigned char*>(key.data()), key.size());
+    return h;
+}
+
+Ticket ticketFor(const std::vector<unsigned char>& sessionKey) {
+    std::string k(sessionKey.begin(), sessionKey.end());
+    return Ticket{ derive(k, "QDTICKET", "", TICKET_ID_BYTES),
+                   derive(k, "QDRESUME", "", SECRET_BYTES),
+                   int64_t(time(nullptr)) + TICKET_LIFETIME_S };
+}
+
+std::vector<unsigned char> resumedKey(const std::string& secret, const std::string& nonce) {
+    std::string k = derive(secret, "QDRESKEY", nonce, crypto_aead_chacha20poly1305_ietf_KEYBYTES);
+    return std::vector<unsigned char>(k.begin(), k.end());
+}
+
+std::string toHex(const std::string& bin) {
+    std::string hex(bin.size() * 2 + 1, '\0');
+    sodium_bin2hex(&hex[0], hex.size(), reinterpret_cast<const unsigned char*>(bin.data()), bin.size());
+    hex.pop_back();
+    return hex;
+}
+
+bool fromHex(const std::string& hex, size_t len, std::string& bin) {
+    bin.assign(len, '\0');
+    size_t got = 0;
+    return sodium_hex2bin(reinterpret_cast<unsigned char*>(&bin[0]), len, hex.data(), hex.size(),
+                          nullptr, &got, nullptr) == 0 && got == len;
+}
+
+// ---- Sender's cache: one line per receiver,
+// "<host:port>\t<expires>\t<id hex>\t<secret hex>".
+
+std::mutex g_cacheMutex;   // threads of one process; processes race benignly
+
+std::vector<std::pair<std::string, Ticket>> readTickets(const std::string& path) {
+    std::vector<std::pair<std::string, Ticket>> out;
+    std::ifstream in(path);
+    std::string line;
+    int64_t now = time(nullptr);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string peer, id, secret;
+        Ticket t;
+        if (!std::getline(fields, peer, '\t') || !(fields >> t.expires) || fields.get() != '\t' ||
+            !std::getline(fields, id, '\t') || !std::getline(fields, secret)) continue;
+        if (t.expires <= now || !fromHex(id, TICKET_ID_BYTES, t.id) ||
+            !fromHex(secret, SECRET_BYTES, t.secret)) continue;
+        out.emplace_back(peer, t);
+    }
+    return out;
+}
+
+bool writeTickets(const std::string& path, const std::vector<std::pair<std::string, Ticket>>& tickets) {
+    mkdir(path.substr(0, path.rfind('/')).c_str(), 0700);
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) { perror("open ticket cache"); return false; }
+    std::string body;
+    for (auto& t : tickets) {
+        body += t.first + '\t' + std::to_string(t.second.expires) + '\t' +
+                toHex(t.second.id) + '\t' + toHex(t.second.secret) + '\n';
+    }
+    bool ok = write(fd, body.data(), body.size()) == ssize_t(body.size());
+    close(fd);
+    if (!ok) { perror("write ticket cache"); unlink(tmp.c_str()); return false; }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) { perror("rename ticket cache"); return false; }
+    return true;
+}
+
+// Replaces the ticket for `peer` with `t`.
+void storeTicket(const std::string& peer, const Ticket& t) {
+    std::string path = ticketCachePath();
+    if (path.empty()) return;
+    std::lock_guard<std::mutex> lk(g_cacheMutex);
+    auto tickets = readTickets(path);
+    tickets.erase(std::remove_if(tickets.begin(), tickets.end(),
+                                 [&](const std::pair<std::string, Ticket>& e) { return e.first == peer; }),
+                  tickets.end());
+    tickets.emplace_back(peer, t);
+    writeTickets(path, tickets);
+}
+
+// Removes and returns the ticket for `peer`; it is good for one hello.
+bool takeTicket(const std::string& peer, Ticket& t) {
+    std::string path = ticketCachePath();
+    if (path.empty()) return false;
+    std::lock_guard<std::mutex> lk(g_cacheMutex);
+    auto tickets = readTickets(path);
+    auto it = std::find_if(tickets.begin(), tickets.end(),
+                           [&](const std::pair<std::string, Ticket>& e) { return e.first == peer; });
+    if (it == tickets.end()) return false;
+    t = it->second;
+    tickets.erase(it);
+    writeTickets(path, tickets);
+    return true;
+}
+
+std::string peerKey(const std::string& host, int port) {
+    return FileTransfer::parseHost(host) + ":" + std::to_string(port);
+}
+
+// ---- Receiver's store, by ticket id.
+
+std::mutex g_ticketsMutex;
+std::unordered_map<std::string, Ticket> g_tickets;
+
+} // namespace
+
+int dial(const std::string& host, int port, std::vector<unsigned char>& key,
+         const std::string& via) {
+    Ticket t;
+    if (sodium_init() < 0 || !takeTicket(peerKey(host, port), t)) return -1;
+    std::string nonce(NONCE_BYTES, '\0');
+    randombytes_buf(&nonce[0], nonce.size());
+    std::string hello = std::string(RESUME_MAGIC, sizeof(RESUME_MAGIC)) + t.id + nonce;
+
+    int fd = FileTransfer::createConnection(via.empty() ? host : via, port);
+    if (fd < 0) return -1;
+    if (send(fd, hello.data(), hello.size(), MSG_NOSIGNAL) != ssize_t(hello.size())) {
+        perror("send resume hello");
+        CLOSE_SOCKET(fd);
+        return -1;
+    }
+    key = resumedKey(t.secret, nonce);
+    std::cout << "[DEBUG] Resuming session with " << peerKey(host, port) << std::endl;
+    return fd;
+}
+
+bool accepted(int fd, const std::string& host, int port, const std::vector<unsigned char>& key) {
+    timeval tv{ ANSWER_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    char answer = 0;
+    bool ok = recv(fd, &answer, 1, MSG_WAITALL) == 1 && answer == RESUME_OK;
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    if (ok) save(host, port, key);
+    else    std::cout << "[DEBUG] " << peerKey(host, port) << " refused the resumption ticket" << std::endl;
+    return ok;
+}
+
+void save(const std::string& host, int port, const std::vector<unsigned char>& key) {
+    Ticket t = ticketFor(key);
+    storeTicket(peerKey(host, port), t);
+}
+
+int connect(const std::string& host, int port, std::vector<unsigned char>& key,
+            const std::string& via) {
+    int fd = dial(host, port, key, via);
+    if (fd >= 0) {
+        if (accepted(fd, host, port, key)) return fd;
+        CLOSE_SOCKET(fd);
+    }
+    fd = FileTransfer::createConnection(via.empty() ? host : via, port);
+    if (fd < 0) return -1;
+    if (!doKeyExchange(fd, key)) {
+        CLOSE_SOCKET(fd);
+        return -1;
+    }
+    save(host, port, key);
+    return fd;
+}
+
+std::string ticketCachePath() {
+    std::string base;
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME")) {
+        base = xdg;
+    } else if (const char* home = std::getenv("HOME")) {
+        base = std::string(home) + "/.cache";
+        mkdir(base.c_str(), 0700);
+    } else {
+        return "";
+    }
+    return base + "/quickdrop/tickets";
+}
+
+void remember(const std::vector<unsigned char>& key) {
+    Ticket t = ticketFor(key);
+    int64_t now = time(nullptr);
+    std::lock_guard<std::mutex> lk(g_ticketsMutex);
+    if (g_tickets.size() >= MAX_TICKETS) {
+        for (auto it = g_tickets.begin(); it != g_tickets.end(); ) {
+            if (it->second.expires <= now) it = g_tickets.erase(it);
+            else ++it;
+        }
+    }
+    if (g_tickets.size() >= MAX_TICKETS) {
+        auto oldest = std::min_element(g_tickets.begin(), g_tickets.end(),
+            [](const std::pair<const std::string, Ticket>& a, const std::pair<const std::string, Ticket>& b) {
+                return a.second.expires < b.second.expires;
+            });
+        g_tickets.erase(oldest);
+    }
+    g_tickets[t.id] = t;
+}
+
+Hello accept(int conn, std::vector<unsigned char>& key) {
+    char hello[HELLO_BYTES];
+    timeval tv{ ANSWER_TIMEOUT_SEC, 0 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    ssize_t n = recv(conn, hello, sizeof(RESUME_MAGIC), MSG_PEEK | MSG_WAITALL);
+    bool resume = n == ssize_t(sizeof(RESUME_MAGIC)) &&
+                  memcmp(hello, RESUME_MAGIC, sizeof(RESUME_MAGIC)) == 0;
+    bool whole  = resume && recv(conn, hello, sizeof(hello), MSG_WAITALL) == ssize_t(sizeof(hello));
+    tv.tv_sec = 0;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    if (!resume) return Hello::None;   // a key exchange, or nothing the exchange won't catch
+    if (!whole) return Hello::Refused;
+
+    std::string id(hello + sizeof(RESUME_MAGIC), TICKET_ID_BYTES);
+    std::string nonce(hello + sizeof(RESUME_MAGIC) + TICKET_ID_BYTES, NONCE_BYTES);
+    Ticket t;
+    {
+        std::lock_guard<std::mutex> lk(g_ticketsMutex);
+        auto it = g_tickets.find(id);
+        bool known = it != g_tickets.end() && it->second.expires > int64_t(time(nullptr));
+        if (known) t = it->second;
+        if (it != g_tickets.end()) g_tickets.erase(it);   // single use
+        if (!known) {
+            std::cerr << "Refused an unknown or expired resumption ticket" << std::endl;
+            return Hello::Refused;
+        }
+    }
+    if (send(conn, &RESUME_OK, 1, MSG_NOSIGNAL) != 1) { perror("send resume answer"); return Hello::Refused; }
+    key = resumedKey(t.secret, nonce);
+    remember(key);
+    std::cout << "[DEBUG] Resumed session" << std::endl;
+    return Hello::Resumed;
+}
+
+} // namespace Resume
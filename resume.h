@@ -0,0 +1,74 @@
+// resume.h
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Session resumption, so a sender that has talked to a receiver before
+// skips the key exchange and its verify code prompt.
+//
+// After a verified exchange both ends derive from the session key a
+// ticket id and a resumption secret: the receiver keeps them in memory,
+// the sender in its ticket cache (ticketCachePath()). A later connection
+// from that sender opens with
+//   [RESUME_MAGIC][ticket id][client nonce]
+// instead of a key exchange, both ends key the session with
+// H(secret, client nonce), and the sender may carry on with frames at
+// once. The receiver answers RESUME_OK, or closes the connection if it
+// doesn't know the ticket, and the sender falls back to a full exchange.
+// Tickets are single use: every session, resumed or not, derives the
+// next one from its own key, so a replayed hello is refused.
+namespace Resume {
+
+static const char RESUME_MAGIC[8]   = { 'Q', 'D', 'R', 'E', 'S', 'U', 'M', '1' };
+static const char RESUME_OK         = 'R';
+static const int  TICKET_ID_BYTES   = 16;
+static const int  TICKET_LIFETIME_S = 24 * 3600;
+
+// ---- Sender
+
+// Opens a resumed session to host:port if a ticket for it is cached:
+// connects (the hello rides in the SYN where TCP Fast Open is on), sends
+// the hello and fills `key`. Nothing is read, so frames can follow
+// straight away; call accepted() before taking them as delivered.
+// Tickets are cached under host:port as given; `via`, if set, is the
+// address actually connected to (any of the receiver's will take them).
+// Returns -1 if there is no ticket or the connection fails.
+int dial(const std::string& host, int port, std::vector<unsigned char>& key,
+         const std::string& via = "");
+
+// Waits for the answer to a dial(). True if the receiver took the ticket,
+// and the next one is cached; false if it refused it, and anything sent
+// on `fd` was dropped.
+bool accepted(int fd, const std::string& host, int port, const std::vector<unsigned char>& key);
+
+// Caches the ticket derived from a verified session key for host:port.
+void save(const std::string& host, int port, const std::vector<unsigned char>& key);
+
+// A keyed connection to host:port: resumed if a ticket is accepted (one
+// round trip, no prompt), else connected and keyed with doKeyExchange.
+// Either way the next ticket is cached. `via` as for dial(). Returns the
+// socket or -1.
+int connect(const std::string& host, int port, std::vector<unsigned char>& key,
+            const std::string& via = "");
+
+// $XDG_CACHE_HOME/quickdrop/tickets, else ~/.cache/quickdrop/tickets, or
+// "" if neither is known. The file holds secrets and is kept 0600.
+std::string ticketCachePath();
+
+// ---- Receiver
+
+// Remembers the ticket derived from a verified session key.
+void remember(const std::vector<unsigned char>& key);
+
+enum class Hello { None, Resumed, Refused };
+
+// For the listener, ahead of the key exchange and off the accept thread,
+// as it waits for the first bytes. If `conn`
+// opens with a resume hello whose ticket is known, answers it, fills
+// `key` and remembers the next ticket (Resumed); an unknown, used or
+// expired ticket is Refused and `conn` should be closed. Anything else
+// leaves the stream untouched (None).
+Hello accept(int conn, std::vector<unsigned char>& key);
+
+} // namespace Resume
@@ -0,0 +1,129 @@
+// session.cpp
+// Pool of keyed connections that several files are sent over in turn.
+
+#include "session.h"
+#include "resume.h"        // Resume::connect
+
+#include <iostream>
+#include <poll.h>
+
+Session::~Session() {
+    if (fd >= 0) CLOSE_SOCKET(fd);
+}
+
+bool Session::send(const std::string& path, const std::string& name,
+                   const FileTransfer::SendOptions& opts) {
+    for (; unacked >= SESSION_MAX_UNACKED; --unacked) {
+        if (!FileTransfer::waitFileAck(fd, &dropped)) return false;
+    }
+    if (!FileTransfer::sendSessionFile(fd, path, name, key, counter, nullptr, nullptr, opts)) return false;
+    ++files;
+    ++unacked;
+    return true;
+}
+
+bool Session::finish() {
+    for (; unacked > 0; --unacked) {
+        if (!FileTransfer::waitFileAck(fd, &dropped)) return false;
+    }
+    bool delivered = !dropped;
+    dropped = false;
+    return delivered;
+}
+
+// A parked session has nothing to read: readable means the receiver
+// closed it (or broke protocol), either way it can't be reused.
+static bool stillOpen(int fd) {
+    pollfd p{ fd, POLLIN, 0 };
+    return poll(&p, 1, 0) == 0;
+}
+
+SessionPool::SessionPool(std::chrono::steady_clock::duration idle, Handshake handshake)
+    : idleTimeout_(idle), handshake_(std::move(handshake)) {}
+
+std::unique_ptr<Session> SessionPool::acquire(const std::string& host, int port,
+                                              const std::function<std::string()>& connectTo) {
+    std::string peer = host + ":" + std::to_string(port);
+    std::vector<std::unique_ptr<Session>> dead;   // closed outside the lock
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        auto range = idle_.equal_range(peer);
+        for (auto it = range.first; it != range.second; ) {
+            std::unique_ptr<Session> s = std::move(it->second.session);
+            it = idle_.erase(it);
+            if (stillOpen(s->fd)) {
+                std::cout << "[DEBUG] Reusing session to " << peer << " ("
+                          << s->files << " files so far)" << std::endl;
+                return s;
+            }
+            dead.push_back(std::move(s));
+        }
+    }
+
+    auto s = std::make_unique<Session>();
+    s->peer = peer;
+    std::string addr = connectTo ? connectTo() : host;
+    if (handshake_) {
+        s->fd = FileTransfer::createConnection(addr, port);
+        if (s->fd < 0) return nullptr;
+        if (!handshake_(s->fd, s->key)) {
+            std::cerr << "Key exchange with " << peer << " failed" << std::endl;
+            return nullptr;
+        }
+    } else {
+        s->fd = Resume::connect(host, port, s->key, addr);
+        if (s->fd < 0) return nullptr;
+    }
+    // Every file ends in a small frame the receiver acks; don't let Nagle hold it.
+    FileTransfer::setNoDelay(s->fd);
+    ++opened_;
+    return s;
+}
+
+void SessionPool::release(std::unique_ptr<Session> s, bool ok) {
+    if (!s || !ok || !s->finish()) return;   // dropping it closes the connection
+    std::lock_guard<std::mutex> lk(m_);
+    if (idle_.count(s->peer) >= size_t(SESSION_IDLE_PER_PEER)) return;
+    std::string peer = s->peer;
+    idle_.emplace(peer, Parked{ std::move(s), clock_type::now() });
+}
+
+void SessionPool::expire() {
+    std::vector<std::unique_ptr<Session>> dead;
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        auto now = clock_type::now();
+        for (auto it = idle_.begin(); it != idle_.end(); ) {
+            if (now - it->second.since > idleTimeout_) {
+                dead.push_back(std::move(it->second.session));
+                it = idle_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto& s : dead) {
+        std::cout << "[DEBUG] Closing idle session to " << s->peer << " after "
+                  << s->files << " files" << std::endl;
+    }
+}
+
+size_t SessionPool::idleCount() const {
+    std::lock_guard<std::mutex> lk(m_);
+    return idle_.size();
+}
+
+SessionPool& sessionPool() {
+    static SessionPool pool;
+    return pool;
+}
+
+bool sendPooled(const std::string& host, int port, const std::string& path, const std::string& name,
+                const FileTransfer::SendOptions& opts,
+                const std::function<std::string()>& connectTo) {
+    auto s = sessionPool().acquire(host, port, connectTo);
+    if (!s) return false;
+    bool ok = s->send(path, name, opts) && s->finish();
+    sessionPool().release(std::move(s), ok);
+    return ok;
+}
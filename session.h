@@ -0,0 +1,100 @@
+// session.h
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+#include "transfer.h"      // FileTransfer::SendOptions
+
+// How long a pooled session may sit unused before it is closed.
+static const int SESSION_IDLE_SECONDS = 30;
+// Idle sessions kept per receiver; more are closed on release.
+static const int SESSION_IDLE_PER_PEER = 4;
+// Files a session may have unacknowledged before send() waits for the
+// oldest, so the receiver's acks never fill the socket buffers.
+static const unsigned SESSION_MAX_UNACKED = 256;
+
+// A keyed connection to one receiver that carries any number of files,
+// one after another, as named session files (see
+// FileTransfer::sendSessionFile). Files are acknowledged by the receiver
+// in order, so several can be in flight before finish() collects their
+// acks.
+struct Session {
+    std::string peer;                 // "host:port", the pool key
+    int fd = -1;
+    std::vector<unsigned char> key;
+    uint64_t counter = 0;             // session nonce sequence; one per file
+    uint64_t files   = 0;             // files sent on this session so far
+    unsigned unacked = 0;             // sent, not yet confirmed
+    bool     dropped = false;         // a file since the last finish() was cancelled
+
+    ~Session();
+
+    // Sends `path` as file `name`; its ack is collected by finish(), or
+    // by a later send() once SESSION_MAX_UNACKED are outstanding.
+    bool send(const std::string& path, const std::string& name,
+              const FileTransfer::SendOptions& opts = FileTransfer::SendOptions());
+    // Waits until the receiver has confirmed every file sent. False if
+    // one of them was cancelled (its source shrank while being sent),
+    // though the session itself is still in step then.
+    bool finish();
+};
+
+// Sessions kept open between transfers, keyed by receiver, so only the
+// first file to a receiver pays for the connect and the key exchange
+// (with its verify code prompt). A session is lent to one sender at a
+// time; ones idle for longer than the timeout, or that the receiver has
+// closed, are dropped.
+class SessionPool {
+public:
+    // Keys a fresh connection. By default sessions are opened with
+    // Resume::connect: resumed with a cached ticket, else a key exchange.
+    using Handshake = std::function<bool(int fd, std::vector<unsigned char>& key)>;
+
+    explicit SessionPool(std::chrono::steady_clock::duration idle = std::chrono::seconds(SESSION_IDLE_SECONDS),
+                         Handshake handshake = nullptr);
+
+    // An idle session to host:port if one is still open, else a newly
+    // connected and keyed one; nullptr if that fails. Sessions are pooled
+    // under host:port as given; `connectTo`, if set, picks the address a
+    // new one connects to instead (say the receiver's fastest), and is
+    // only called when nothing is pooled.
+    std::unique_ptr<Session> acquire(const std::string& host, int port,
+                                     const std::function<std::string()>& connectTo = nullptr);
+    // Takes a session back once its sender is done with it. Files still
+    // unacknowledged are waited for first; a session that failed, or
+    // whose acks don't come, is closed instead of kept.
+    void release(std::unique_ptr<Session> s, bool ok = true);
+    // Closes sessions idle for longer than the timeout.
+    void expire();
+
+    size_t idleCount() const;
+    uint64_t opened() const { return opened_.load(); }   // sessions keyed so far
+
+private:
+    using clock_type = std::chrono::steady_clock;
+    struct Parked {
+        std::unique_ptr<Session> session;
+        clock_type::time_point since;
+    };
+
+    clock_type::duration idleTimeout_;
+    Handshake handshake_;
+    mutable std::mutex m_;
+    std::unordered_multimap<std::string, Parked> idle_;   // by Session::peer
+    std::atomic<uint64_t> opened_{0};
+};
+
+// The process-wide pool behind send-to, the web UI and its uploads.
+SessionPool& sessionPool();
+
+// Sends `path` to host:port as file `name` on a pooled session and
+// waits for the receiver to confirm it. `connectTo` as for acquire().
+bool sendPooled(const std::string& host, int port, const std::string& path, const std::string& name,
+                const FileTransfer::SendOptions& opts = FileTransfer::SendOptions(),
+                const std::function<std::string()>& connectTo = nullptr);
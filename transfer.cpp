@@ -0,0 +1,957 @@
+// transfer.cpp
+// Chunked compress → encrypt → send pipeline and its receiving counterpart.
+//
+// Wire format, one frame per chunk:
+//   [origSize u32][cipherSize u32][cipher bytes]
+// A frame with origSize == 0 is a control frame: its cipher decrypts to an
+// uncompressed [type u8][body] message instead of chunk data.
+// Frames use the session key with a running nonce, except inside a named
+// session file: after its FILE_BEGIN, up to and including its FILE_END,
+// they use the file's own key with a nonce starting from 0 (see fileKey).
+
+#include "transfer.h"
+#include "compression.h"   // compressChunk, decompressChunk, decompressChunkInto
+#include "encryption.h"    // encryptChunk, decryptChunk
+#include "writer.h"        // FileWriter
+#include "progress.h"      // Progress::track
+#include "multipath.h"     // Multipath::receive
+
+#include <sodium.h>
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+#include <iomanip>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <netinet/tcp.h>
+
+namespace FileTransfer {
+
+// Control message types carried in origSize == 0 frames
+enum ControlType : uint8_t {
+    CTRL_HOLE       = 'H',   // body: u64 length of a zero/hole region
+    CTRL_KEEP       = 'K',   // body: u64 length the receiver already has
+    CTRL_FILE_BEGIN = 'F',   // body: u64 size, u8 FileFlags, then the relative file name
+    CTRL_FILE_END   = 'E',   // no body; receiver answers with FILE_ACK
+    CTRL_FILE_CANCEL = 'C',  // no body, instead of FILE_END; receiver answers with FILE_DROPPED
+    CTRL_SIZE       = 'S',   // body: u64 size, u64 bytes allocated on the sender
+    CTRL_MULTIPATH  = 'M',   // body: join token, u64 size, u64 allocated, u8 parity group; see multipath.h
+};
+
+// FILE_BEGIN flags.
+enum FileFlags : uint8_t {
+    FILE_IN_PLACE = 1,       // keep frames may follow: update an existing file in place
+};
+
+// Byte the receiver sends back once a named file is complete on disk.
+static const char FILE_ACK = 'A';
+// Sent back instead for a file the sender cancelled; nothing was kept.
+static const char FILE_DROPPED = 'D';
+
+bool initSockets() {
+#ifdef _WIN32
+    WSADATA wsa;
+    return WSAStartup(MAKEWORD(2,2), &wsa) == 0;
+#else
+    return true;
+#endif
+}
+
+void cleanupSockets() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+int createListener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(port);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1); }
+#ifdef TCP_FASTOPEN
+    // Accept data in the SYN, so a resumed sender's hello costs no round trip.
+    int qlen = 16;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (char*)&qlen, sizeof(qlen)) < 0) {
+        perror("setsockopt TCP_FASTOPEN");
+    }
+#endif
+    // Room for a multipath sender's joins arriving together.
+    if (listen(fd, 16) < 0) { perror("listen"); exit(1); }
+    return fd;
+}
+
+// Helper function to parse host:port and return just the host
+std::string parseHost(const std::string &hostPort) {
+    size_t colonPos = hostPort.find(':');
+    if (colonPos != std::string::npos) {
+        return hostPort.substr(0, colonPos);
+    }
+    return hostPort;
+}
+
+int createConnection(const std::string &host, int port) {
+    std::string cleanHost = parseHost(host);
+    std::cout << "[DEBUG] Connecting to " << cleanHost << ":" << port << std::endl;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if (inet_pton(AF_INET, cleanHost.c_str(), &addr.sin_addr) <= 0) {
+        perror("inet_pton"); CLOSE_SOCKET(fd); return -1;
+    }
+#ifdef TCP_FASTOPEN_CONNECT
+    // With a Fast Open cookie from an earlier connection, connect()
+    // returns at once and the first write leaves in the SYN; without one
+    // the kernel falls back to a normal handshake. Off unless the
+    // net.ipv4.tcp_fastopen sysctl allows it.
+    int tfo = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char*)&tfo, sizeof(tfo));
+#endif
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect"); CLOSE_SOCKET(fd); return -1;
+    }
+    std::cout << "[DEBUG] Connected successfully" << std::endl;
+    return fd;
+}
+
+// ----------------------------------------------------------------------------
+// Framing helpers
+
+static bool recvAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t r = recv(fd, p, len, 0);
+        if (r <= 0) return false;
+        p += r; len -= r;
+    }
+    return true;
+}
+
+static void put64(char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = char((v >> (56 - 8*i)) & 0xFF);
+}
+
+static uint64_t get64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | uint8_t(p[i]);
+    return v;
+}
+
+// Header and payload leave in a single sendmsg, so on a TCP_NODELAY
+// socket a small frame is one segment rather than two.
+static bool sendFrame(int fd, uint32_t origSize, const std::vector<unsigned char>& cipher) {
+    uint32_t hdr[2] = { htonl(origSize), htonl(static_cast<uint32_t>(cipher.size())) };
+    iovec iov[2] = {
+        { hdr, sizeof(hdr) },
+        { const_cast<unsigned char*>(cipher.data()), cipher.size() },
+    };
+    msghdr msg{};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 2;
+    while (msg.msg_iovlen > 0) {
+        ssize_t s = sendmsg(fd, &msg, 0);
+        if (s <= 0) { perror("send data"); return false; }
+        while (s > 0) {
+            size_t take = std::min<size_t>(s, msg.msg_iov->iov_len);
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + take;
+            msg.msg_iov->iov_len -= take;
+            s -= take;
+            if (msg.msg_iov->iov_len == 0) { ++msg.msg_iov; --msg.msg_iovlen; }
+        }
+    }
+    return true;
+}
+
+// Encrypts and sends a control message; consumes one nonce like a data chunk.
+static bool sendControl(int fd, ControlType type, const std::vector<char>& body,
+                        const std::vector<unsigned char>& key, uint64_t& counter) {
+    std::vector<char> msg(1 + body.size());
+    msg[0] = char(type);
+    std::copy(body.begin(), body.end(), msg.begin() + 1);
+    std::vector<unsigned char> cipher;
+    if (!encryptChunk(msg, cipher, key, counter++)) {
+        std::cerr << "\nEncryption failed" << std::endl;
+        return false;
+    }
+    return sendFrame(fd, 0, cipher);
+}
+
+// Sends a hole or keep run of `length` bytes.
+static bool sendLength(int fd, ControlType type, uint64_t length,
+                       const std::vector<unsigned char>& key, uint64_t& counter) {
+    std::vector<char> body(8);
+    put64(body.data(), length);
+    return sendControl(fd, type, body, key, counter);
+}
+
+// Key for the frames of one session file, so every file has a nonce
+// space of its own however long the session lives. Derived from the
+// session key and the nonce of the file's FILE_BEGIN frame, which both
+// ends know and which never repeats within a session.
+static std::vector<unsigned char> fileKey(const std::vector<unsigned char>& sessionKey,
+                                          uint64_t beginNonce) {
+    char msg[16] = { 'Q', 'D', 'F', 'I', 'L', 'E', '0', '1' };
+    put64(msg + 8, beginNonce);
+    std::vector<unsigned char> key(crypto_aead_chacha20poly1305_ietf_KEYBYTES);
+    crypto_generichash(key.data(), key.size(), reinterpret_cast<unsigned char*>(msg), sizeof msg,
+                       sessionKey.data(), sessionKey.size());
+    return key;
+}
+
+// ----------------------------------------------------------------------------
+// Sparse helpers
+
+// True if every byte of `p` is zero. Each 256-byte block is OR-reduced
+// through 64-bit words so the compiler can vectorize the inner loop.
+static bool isZeroBlock(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 256 <= n; i += 256) {
+        uint64_t acc = 0;
+        for (int j = 0; j < 32; ++j) {
+            uint64_t w;
+            memcpy(&w, p + i + j * 8, sizeof w);
+            acc |= w;
+        }
+        if (acc) return false;
+    }
+    for (; i < n; ++i) {
+        if (p[i]) return false;
+    }
+    return true;
+}
+
+// Finds the next [start, end) data extent at or after `from`, widened to
+// CHUNK_SIZE boundaries so chunks always sit on the same grid. Without
+// SEEK_DATA support the whole remainder is treated as one data extent.
+static void nextDataExtent(int fd, uint64_t from, uint64_t size,
+                           uint64_t& start, uint64_t& end) {
+    start = from;
+    end   = size;
+#ifdef SEEK_DATA
+    off_t d = lseek(fd, static_cast<off_t>(from), SEEK_DATA);
+    if (d < 0) {
+        if (errno == ENXIO) start = size;  // only a hole remains
+        return;
+    }
+    off_t h = lseek(fd, d, SEEK_HOLE);
+    uint64_t hole = (h < 0) ? size : uint64_t(h);
+    start = std::max<uint64_t>(from, uint64_t(d) - uint64_t(d) % CHUNK_SIZE);
+    end   = (hole + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    start = std::min(start, size);
+    end   = std::min(end, size);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+// Digest of one chunk, used to skip chunks the peer already has.
+static ChunkDigest digestChunk(const char* data, size_t n) {
+    ChunkDigest d;
+    crypto_generichash(d.data(), d.size(),
+                       reinterpret_cast<const unsigned char*>(data), n,
+                       nullptr, 0);
+    return d;
+}
+
+// Turns plaintext chunks into frames. Zero chunks are folded into a
+// pending hole run, chunks whose digest matches the previous send of the
+// file into a pending keep run; everything else is compressed, encrypted
+// and sent.
+struct ChunkSender {
+    int fd;
+    const std::vector<unsigned char>& key;
+    uint64_t&   chunkCounter;            // nonce sequence, shared by a session's files
+    ControlType runType    = CTRL_HOLE;
+    uint64_t    pendingRun = 0;          // hole/keep bytes not yet announced to the peer
+    uint64_t    holeBytes  = 0;
+    uint64_t    keptBytes  = 0;
+    int         level      = 3;          // zstd compression level
+    std::vector<ChunkDigest>* digests = nullptr;  // previous send, updated in place
+    Progress::Transfer* progress = nullptr;       // sampled by the progress publisher
+
+    ChunkSender(int fd, const std::vector<unsigned char>& key, uint64_t& counter)
+        : fd(fd), key(key), chunkCounter(counter) {}
+
+    bool hole(uint64_t offset, uint64_t length) {
+        if (digests) {
+            // The peer will punch these chunks; forget what they held.
+            for (uint64_t c = offset / CHUNK_SIZE;
+                 c < digests->size() && c * CHUNK_SIZE < offset + length; ++c) {
+                (*digests)[c] = ChunkDigest{};
+            }
+        }
+        holeBytes += length;
+        return run(CTRL_HOLE, length);
+    }
+
+    bool push(const char* data, size_t n, uint64_t offset) {
+        if (digests && offset % CHUNK_SIZE == 0) {
+            size_t idx = offset / CHUNK_SIZE;
+            ChunkDigest d = digestChunk(data, n);
+            if (idx >= digests->size()) digests->resize(idx + 1);
+            if ((*digests)[idx] == d) {
+                keptBytes += n;
+                return run(CTRL_KEEP, n);
+            }
+            (*digests)[idx] = d;
+        }
+        if (isZeroBlock(data, n)) return hole(offset, n);
+
+        // Compress
+        std::vector<char> raw(data, data + n), comp;
+        if (!compressChunk(raw, comp, level)) return false;
+        return pushCompressed(comp, n);
+    }
+
+    // Encrypts and sends `n` bytes already compressed into `comp`.
+    bool pushCompressed(const std::vector<char>& comp, size_t n) {
+        if (!flushRun()) return false;
+        std::vector<unsigned char> cipher;
+        if (!encryptChunk(comp, cipher, key, chunkCounter++)) {
+            std::cerr << "\nEncryption failed" << std::endl;
+            return false;
+        }
+        return sendFrame(fd, static_cast<uint32_t>(n), cipher);
+    }
+
+    bool run(ControlType type, uint64_t length) {
+        if (length == 0) return true;
+        if (pendingRun > 0 && runType != type && !flushRun()) return false;
+        runType     = type;
+        pendingRun += length;
+        return true;
+    }
+
+    bool flushRun() {
+        if (pendingRun == 0) return true;
+        if (!sendLength(fd, runType, pendingRun, key, chunkCounter)) return false;
+        pendingRun = 0;
+        return true;
+    }
+
+    // Publishes the read position; a relaxed store, cheap enough per chunk.
+    void reached(uint64_t offset) {
+        if (progress) progress->bytes.store(offset, std::memory_order_relaxed);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Read-ahead
+
+struct ReadAhead {
+    struct Chunk {
+        uint64_t offset;
+        uint64_t size;               // plaintext bytes
+        bool     hole;               // a hole or all-zero chunk: sent as a run
+        std::vector<char> comp;      // compressed payload otherwise
+    };
+
+    // The file as it was when reading started; sends of anything else
+    // ignore the chunks.
+    dev_t    dev;
+    ino_t    ino;
+    uint64_t size;
+    int64_t  mtimeNs;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<Chunk> chunks;        // deque: references stay valid as it grows
+    bool done = false;
+    std::atomic<bool> abandon{false};
+    std::thread worker;
+
+    static int64_t mtimeOf(const struct stat& st) {
+#ifdef __APPLE__
+        return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+
+    bool matches(const struct stat& st) const {
+        return st.st_dev == dev && st.st_ino == ino && uint64_t(st.st_size) == size &&
+               mtimeOf(st) == mtimeNs;
+    }
+
+    void add(Chunk c) {
+        std::lock_guard<std::mutex> lk(m);
+        chunks.push_back(std::move(c));
+        cv.notify_all();
+    }
+
+    ~ReadAhead() {
+        abandon = true;
+        if (worker.joinable()) worker.join();
+    }
+};
+
+// Walks the file like sendRegular until `budget` bytes have been read,
+// leaving what it prepared in `ahead`. Stops early, without error, on
+// anything unexpected; the send then reads the rest itself.
+static void readAheadLoop(ReadAhead& ahead, int in, uint64_t budget, int level) {
+    std::vector<char> raw(CHUNK_SIZE);
+    uint64_t offset = 0, readBytes = 0;
+    bool stop = false;
+    while (!stop && offset < ahead.size && readBytes < budget && !ahead.abandon) {
+        uint64_t dataStart, dataEnd;
+        nextDataExtent(in, offset, ahead.size, dataStart, dataEnd);
+        if (dataStart > offset) {
+            ahead.add(ReadAhead::Chunk{ offset, dataStart - offset, true, {} });
+            offset = dataStart;
+        }
+        while (offset < dataEnd && readBytes < budget && !ahead.abandon) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, dataEnd - offset));
+            ssize_t r = pread(in, raw.data(), want, static_cast<off_t>(offset));
+            if (r != ssize_t(want)) { stop = true; break; }
+            raw.resize(want);
+            ReadAhead::Chunk c{ offset, want, isZeroBlock(raw.data(), want), {} };
+            if (!c.hole && !compressChunk(raw, c.comp, level)) { stop = true; break; }
+            raw.resize(CHUNK_SIZE);
+            ahead.add(std::move(c));
+            offset    += want;
+            readBytes += want;
+        }
+    }
+    close(in);
+    std::lock_guard<std::mutex> lk(ahead.m);
+    ahead.done = true;
+    ahead.cv.notify_all();
+}
+
+std::shared_ptr<ReadAhead> startReadAhead(const std::string& path, const SendOptions& opts,
+                                          uint64_t budget) {
+    if (path == "-") return nullptr;
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0) return nullptr;   // the send reports it
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) { close(in); return nullptr; }
+    auto ahead = std::make_shared<ReadAhead>();
+    ahead->dev   = st.st_dev;
+    ahead->ino   = st.st_ino;
+    ahead->size  = st.st_size;
+    ahead->mtimeNs = ReadAhead::mtimeOf(st);
+    ReadAhead* a = ahead.get();   // joined by the destructor
+    int level = opts.compressionLevel;
+    ahead->worker = std::thread([a, in, budget, level]{ readAheadLoop(*a, in, budget, level); });
+    return ahead;
+}
+
+// Sends the chunks `ahead` prepared, waiting for any still being
+// compressed; `offset` is left where they end.
+static bool sendReadAhead(ReadAhead& ahead, ChunkSender& out, uint64_t& offset) {
+    for (size_t i = 0; ; ++i) {
+        std::unique_lock<std::mutex> lk(ahead.m);
+        ahead.cv.wait(lk, [&]{ return ahead.done || i < ahead.chunks.size(); });
+        if (i >= ahead.chunks.size()) break;
+        const ReadAhead::Chunk& c = ahead.chunks[i];
+        lk.unlock();
+        bool ok = c.hole ? out.hole(offset, c.size) : out.pushCompressed(c.comp, c.size);
+        if (!ok) return false;
+        offset += c.size;
+        out.reached(offset);
+    }
+    std::cout << "[DEBUG] First " << offset << " bytes were read ahead of the key exchange" << std::endl;
+    return true;
+}
+
+// Reads until `buf` is full or EOF so pipe sources still produce full chunks.
+static ssize_t readFull(int in, char* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(in, buf + got, len - got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += r;
+    }
+    return static_cast<ssize_t>(got);
+}
+
+// Sends a regular file extent by extent, skipping holes without reading them.
+static bool sendRegular(int in, ChunkReader& reader, uint64_t& totalSize, ChunkSender& out,
+                        uint64_t& offset) {
+    while (offset < totalSize) {
+        uint64_t dataStart, dataEnd;
+        nextDataExtent(in, offset, totalSize, dataStart, dataEnd);
+        out.hole(offset, dataStart - offset);
+        offset = dataStart;
+
+        while (offset < dataEnd) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, dataEnd - offset));
+            const char* data = nullptr;
+            ssize_t bytesRead = reader.read(offset, want, data);
+            if (bytesRead < 0) { perror("read sendFile"); return false; }
+            if (bytesRead == 0) { totalSize = offset; return true; }  // file shrank
+            if (!out.push(data, bytesRead, offset)) return false;
+            offset += bytesRead;
+            out.reached(offset);
+        }
+    }
+    return true;
+}
+
+// Sends a pipe/FIFO/stdin source of unknown length until EOF.
+static bool sendStream(int in, ChunkSender& out, uint64_t& offset) {
+    std::vector<char> buffer(CHUNK_SIZE);
+    while (true) {
+        ssize_t bytesRead = readFull(in, buffer.data(), CHUNK_SIZE);
+        if (bytesRead < 0) { perror("read sendFile"); return false; }
+        if (bytesRead == 0) return true;
+        if (!out.push(buffer.data(), bytesRead, offset)) return false;
+        offset += bytesRead;
+        out.reached(offset);
+    }
+}
+
+// Low-latency variant of sendStream: a partial chunk is flushed once it
+// reaches opts.flushBytes or its oldest byte has waited opts.flushDeadlineUs.
+static bool sendStreamLowLatency(int in, ChunkSender& out, uint64_t& offset,
+                                 const SendOptions& opts) {
+    using clock = std::chrono::steady_clock;
+    const size_t limit = std::max(1, std::min(opts.flushBytes, CHUNK_SIZE));
+    const auto deadline = std::chrono::microseconds(opts.flushDeadlineUs);
+    std::vector<char> buffer(limit);
+    size_t fill = 0;
+    clock::time_point firstByte;
+
+    while (true) {
+        timeval tv{};
+        timeval* wait = nullptr;   // block until data when nothing is pending
+        if (fill > 0) {
+            auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+                firstByte + deadline - clock::now()).count();
+            if (left < 0) left = 0;
+            tv.tv_sec  = left / 1000000;
+            tv.tv_usec = left % 1000000;
+            wait = &tv;
+        }
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(in, &rfds);
+        int ready = select(in + 1, &rfds, nullptr, nullptr, wait);
+        if (ready < 0 && errno != EINTR) { perror("select sendFile"); return false; }
+
+        if (ready > 0) {
+            ssize_t r = read(in, buffer.data() + fill, limit - fill);
+            if (r < 0 && errno != EINTR) { perror("read sendFile"); return false; }
+            if (r == 0) {
+                return fill == 0 || out.push(buffer.data(), fill, offset - fill);
+            }
+            if (r > 0) {
+                if (fill == 0) firstByte = clock::now();
+                fill   += r;
+                offset += r;
+            }
+        }
+        if (fill > 0 && (fill >= limit || clock::now() >= firstByte + deadline)) {
+            out.reached(offset);
+            if (!out.push(buffer.data(), fill, offset - fill)) return false;
+            fill = 0;
+        }
+    }
+}
+
+void setNoDelay(int fd) {
+    int opt = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt)) < 0) {
+        perror("setsockopt TCP_NODELAY");
+    }
+}
+
+// Sends the body of `in` through `out`; shared by single-file and
+// session sends. Returns false on any read or send error.
+static bool sendBody(int in, const std::string& path, const struct stat& st,
+                     ChunkSender& out, uint64_t& offset, const SendOptions& opts) {
+    // Pipes, FIFOs and terminals have no meaningful size; stream them to EOF.
+    bool streaming = !S_ISREG(st.st_mode);
+    uint64_t totalSize = streaming ? 0 : st.st_size;
+    auto progress = Progress::track(opts.label.empty() ? path : opts.label, true,
+                                    streaming ? opts.expectedSize : totalSize);
+    out.progress = progress.get();
+
+    bool ok = true;
+    if (!streaming) {
+        // Chunks read ahead go first, unless the file changed since or
+        // every chunk has to be digested anyway.
+        if (opts.readAhead && !out.digests && offset == 0 && opts.readAhead->matches(st)) {
+            ok = sendReadAhead(*opts.readAhead, out, offset);
+        }
+        auto reader = openChunkReader(path, in, totalSize, opts.readBackend);
+        ok = ok && sendRegular(in, *reader, totalSize, out, offset);
+    }
+    else if (opts.lowLatency) ok = sendStreamLowLatency(in, out, offset, opts);
+    else                      ok = sendStream(in, out, offset);
+    if (ok && out.digests) {
+        out.digests->resize((offset + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+    ok = ok && out.flushRun();
+    out.reached(offset);
+    progress->enter(ok ? Progress::Stage::Done : Progress::Stage::Failed);
+    out.progress = nullptr;
+    return ok;
+}
+
+bool sendFile(int fd, const std::string &path, const std::vector<unsigned char>& sessionKey,
+              const SendOptions& opts) {
+    bool fromStdin = (path == "-");
+    std::cout << "[DEBUG] Sending " << (fromStdin ? "stdin" : "file: " + path) << std::endl;
+    int in = fromStdin ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (in < 0) { perror("open sendFile"); return false; }
+    struct stat st;
+    if (fstat(in, &st) != 0) { perror("stat"); if (!fromStdin) close(in); return false; }
+
+    uint64_t chunkCounter = 0;
+    ChunkSender out(fd, sessionKey, chunkCounter);
+    out.level = opts.compressionLevel;
+    if (opts.lowLatency) setNoDelay(fd);
+    uint64_t offset = 0;        // logical position, holes included
+    auto startTime = std::chrono::steady_clock::now();
+
+    if (S_ISREG(st.st_mode)) {
+        // Announce the size so the receiver can preallocate.
+        std::vector<char> size(16);
+        put64(size.data(), st.st_size);
+        put64(size.data() + 8, uint64_t(st.st_blocks) * 512);
+        if (!sendControl(fd, CTRL_SIZE, size, sessionKey, chunkCounter)) {
+            if (!fromStdin) close(in);
+            return false;
+        }
+    }
+    if (!fromStdin && S_ISREG(st.st_mode)) {
+        ReadBackend backend = opts.readBackend == ReadBackend::Auto
+                            ? chooseReadBackend(st.st_size) : opts.readBackend;
+        std::cout << "[DEBUG] Read backend: " << readBackendName(backend) << std::endl;
+    }
+    bool ok = sendBody(in, path, st, out, offset, opts);
+    if (!fromStdin) close(in);
+    if (!ok) return false;
+
+    auto totalElapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - startTime).count();
+    double finalMbps = (offset / (1024.0 * 1024.0)) /
+                       (totalElapsed > 0 ? totalElapsed : 1.0);
+    std::cout << "\rProgress: 100% ("
+              << std::fixed << std::setprecision(1)
+              << finalMbps << " MB/s)\n";
+    if (out.holeBytes > 0) {
+        std::cout << "[DEBUG] Skipped " << out.holeBytes << " sparse/zero bytes" << std::endl;
+    }
+    std::cout << "[DEBUG] Finished sending file" << std::endl;
+    return true;
+}
+
+bool sendSessionFile(int fd, const std::string &path, const std::string &name,
+                     const std::vector<unsigned char>& sessionKey, uint64_t& chunkCounter,
+                     std::vector<ChunkDigest>* digests, uint64_t* bytesSent,
+                     const SendOptions& opts) {
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0) { perror("open sendSessionFile"); return false; }
+    struct stat st;
+    if (fstat(in, &st) != 0) { perror("stat"); close(in); return false; }
+
+    // Only a file sent before can have unchanged chunks; anything else is
+    // written to a temporary and renamed into place.
+    bool inPlace = digests && !digests->empty();
+    std::vector<char> begin(9 + name.size());
+    put64(begin.data(), S_ISREG(st.st_mode) ? st.st_size : opts.expectedSize);
+    begin[8] = char(inPlace ? FILE_IN_PLACE : 0);
+    std::copy(name.begin(), name.end(), begin.begin() + 9);
+    std::vector<char> size(16);
+    put64(size.data(), st.st_size);
+    put64(size.data() + 8, uint64_t(st.st_blocks) * 512);
+
+    // FILE_BEGIN is the file's one frame under the session key.
+    uint64_t beginNonce = chunkCounter;
+    if (!sendControl(fd, CTRL_FILE_BEGIN, begin, sessionKey, chunkCounter)) { close(in); return false; }
+    std::vector<unsigned char> key = fileKey(sessionKey, beginNonce);
+    uint64_t fileCounter = 0;
+
+    ChunkSender out(fd, key, fileCounter);
+    out.level   = opts.compressionLevel;
+    out.digests = digests;
+    uint64_t offset = 0;
+    bool ok = (!S_ISREG(st.st_mode) || sendControl(fd, CTRL_SIZE, size, key, fileCounter)) &&
+              sendBody(in, path, st, out, offset, opts);
+    close(in);
+    // A file cut short while it was read can't reach the size announced
+    // for it; cancel just this one and keep the session. The receiver
+    // drops its copy, so digests of what was sent describe nothing.
+    bool shrank = ok && S_ISREG(st.st_mode) && offset < uint64_t(st.st_size);
+    if (shrank) {
+        std::cerr << path << " shrank while being sent, cancelled" << std::endl;
+        if (digests) digests->clear();
+    }
+    ok = ok && sendControl(fd, shrank ? CTRL_FILE_CANCEL : CTRL_FILE_END, {}, key, fileCounter);
+    if (bytesSent) *bytesSent = offset - out.keptBytes - out.holeBytes;
+    return ok;
+}
+
+bool sendMultipathBegin(int fd, const std::vector<char>& body,
+                        const std::vector<unsigned char>& sessionKey, uint64_t& chunkCounter) {
+    return sendControl(fd, CTRL_MULTIPATH, body, sessionKey, chunkCounter);
+}
+
+bool waitFileAck(int fd, bool* cancelled) {
+    char ack;
+    if (!recvAll(fd, &ack, 1)) return false;
+    if (ack == FILE_DROPPED && cancelled) *cancelled = true;
+    else if (ack != FILE_ACK) return false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Receiving
+
+// Preallocating a sparse file would fill in its holes, so only do it
+// when the sender's copy is (nearly) fully allocated.
+static bool worthPreallocating(uint64_t size, uint64_t allocated) {
+    return size > 0 && allocated >= size - size / 8;
+}
+
+// Resolves a peer-supplied relative name under `baseDir`, creating parent
+// directories. Returns "" for absolute names or ones escaping via "..".
+static std::string resolveName(const std::string& baseDir, const std::string& name) {
+    if (name.empty() || name[0] == '/') return "";
+    std::string path = baseDir;
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t slash = name.find('/', start);
+        std::string part = name.substr(start, slash == std::string::npos ? std::string::npos
+                                                                          : slash - start);
+        if (part.empty() || part == "." || part == "..") return "";
+        path += "/" + part;
+        if (slash == std::string::npos) break;
+        mkdir(path.c_str(), 0755);
+        start = slash + 1;
+    }
+    return path;
+}
+
+void receiveFile(int fd, const std::string &outPath, const std::vector<unsigned char>& sessionKey,
+                 const ReceiveOptions& opts) {
+    bool toStdout = (outPath == "-");
+    std::cout << "[DEBUG] Receiving to: " << (toStdout ? "stdout" : outPath) << std::endl;
+    // All we send are one-byte file acks, which a pipelining sender may be
+    // blocked on; Nagle would hold each behind the last until the sender's
+    // delayed ACK.
+    setNoDelay(fd);
+#ifdef SO_BUSY_POLL
+    if (opts.busyPollUs > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (char*)&opts.busyPollUs, sizeof(opts.busyPollUs)) < 0) {
+        perror("setsockopt SO_BUSY_POLL");
+    }
+#endif
+
+    // Named files from a session land inside outPath when it is a
+    // directory, otherwise next to it.
+    std::string baseDir = ".";
+    struct stat ost;
+    if (!toStdout && stat(outPath.c_str(), &ost) == 0 && S_ISDIR(ost.st_mode)) {
+        baseDir = outPath;
+    } else if (outPath.find('/') != std::string::npos) {
+        baseDir = outPath.substr(0, outPath.rfind('/'));
+    }
+
+    WriteOptions wopts;
+    wopts.direct         = opts.directWrites;
+    wopts.flushEachWrite = opts.flushEachChunk;
+    wopts.mmap           = opts.mmapWrites;
+    wopts.durability     = toStdout ? Durability::None : opts.durability;
+    wopts.syncEveryBytes = opts.syncEveryBytes;
+    wopts.skipIdentical  = opts.skipIdentical;
+    FileWriter out(wopts);
+    double syncSeconds = 0;
+    uint64_t skippedBytes = 0;
+    uint64_t chunkCounter = 0;
+    // Inside a named file, frames are under that file's key and count.
+    std::vector<unsigned char> namedKey;
+    uint64_t namedCounter = 0;
+    const std::vector<unsigned char>* key = &sessionKey;
+    uint64_t* counter = &chunkCounter;
+    bool ok = true;
+    std::shared_ptr<Progress::Transfer> progress;   // the file being written
+    // What the sender announced for the open output. A file is only
+    // committed once it holds that many bytes and, if named, its
+    // FILE_END has arrived; streams of unknown length end at EOF.
+    bool     sized    = false;
+    uint64_t expected = 0;
+    bool     inNamed  = false;
+    auto complete = [&]() { return !sized || out.position() == expected; };
+
+    // Unnamed data (single-file senders) goes to outPath, opened lazily.
+    // Comparing against the old contents needs them kept in place.
+    auto ensureOpen = [&]() {
+        if (out.isOpen()) return true;
+        sized = false;
+        progress = Progress::track(toStdout ? "stdout" : outPath, false);
+        if (out.open(outPath, opts.skipIdentical)) return true;
+        progress->enter(Progress::Stage::Failed);
+        return false;
+    };
+    auto closeOutput = [&](bool commit) {
+        if (!out.isOpen()) return true;
+        progress->enter(Progress::Stage::Syncing);
+        bool closed = out.close(commit);
+        progress->enter(closed && commit ? Progress::Stage::Done : Progress::Stage::Failed);
+        syncSeconds  += out.syncSeconds();
+        skippedBytes += out.skippedBytes();
+        return closed;
+    };
+
+    while (true) {
+        uint32_t hdr[2];
+        errno = 0;
+        if (!recvAll(fd, hdr, sizeof(hdr))) {
+            // A clean close ends the stream; a reset means the sender gave up.
+            if (errno != 0) { perror("recv header"); ok = false; }
+            break;
+        }
+
+        size_t orig = ntohl(hdr[0]), cps = ntohl(hdr[1]);
+        std::vector<unsigned char> cipher(cps);
+        if (!recvAll(fd, cipher.data(), cps)) { perror("recv data"); ok = false; break; }
+
+        std::vector<char> comp, decomp;
+        if (!decryptChunk(cipher, comp, *key, (*counter)++)) {
+            std::cerr << "Decryption/auth failed" << std::endl;
+            ok = false;
+            break;
+        }
+
+        if (orig == 0) {
+            if (comp.empty()) continue;
+            ControlType type = ControlType(comp[0]);
+            if ((type == CTRL_HOLE || type == CTRL_KEEP) && comp.size() == 9) {
+                uint64_t len = get64(comp.data() + 1);
+                if (!ensureOpen()) { ok = false; break; }
+                if (!(type == CTRL_KEEP ? out.keep(len) : out.hole(len))) { ok = false; break; }
+                progress->add(len);
+            } else if (type == CTRL_SIZE && comp.size() == 17) {
+                if (!ensureOpen()) { ok = false; break; }
+                uint64_t size = get64(comp.data() + 1);
+                sized    = true;
+                expected = size;
+                progress->total.store(size);
+                if (worthPreallocating(size, get64(comp.data() + 9)) && !out.map(size)) {
+                    out.preallocate(size);
+                }
+            } else if (type == CTRL_FILE_BEGIN && comp.size() >= 10) {
+                if (inNamed || !complete()) {
+                    std::cerr << "File began before the previous one was complete" << std::endl;
+                    ok = false;
+                    break;
+                }
+                if (!closeOutput(true)) { ok = false; break; }
+                std::string name(comp.begin() + 10, comp.end());
+                std::string path = toStdout ? "-" : resolveName(baseDir, name);
+                if (path.empty()) { std::cerr << "Rejected file name: " << name << std::endl; ok = false; break; }
+                progress = Progress::track(name, false, get64(comp.data() + 1));
+                bool inPlace = uint8_t(comp[9]) & FILE_IN_PLACE;
+                if (!out.open(path, inPlace)) { progress->enter(Progress::Stage::Failed); ok = false; break; }
+                inNamed = true;
+                // A stream announces its length here if it knows it, and
+                // is held to it like a size frame.
+                expected = get64(comp.data() + 1);
+                sized    = expected > 0;
+                std::cout << "\n[DEBUG] Receiving " << name << " ("
+                          << get64(comp.data() + 1) << " bytes)" << std::endl;
+                namedKey     = fileKey(sessionKey, chunkCounter - 1);
+                namedCounter = 0;
+                key     = &namedKey;
+                counter = &namedCounter;
+            } else if (type == CTRL_MULTIPATH && comp.size() == 34) {
+                // Chunks come on this and joined connections in any order,
+                // so the output has to be seekable.
+                if (toStdout) { std::cerr << "Multipath transfers need a file to write to" << std::endl; ok = false; break; }
+                if (!ensureOpen()) { ok = false; break; }
+                uint64_t size = get64(comp.data() + 17);
+                progress->total.store(size);
+                if (worthPreallocating(size, get64(comp.data() + 25))) out.preallocate(size);
+                std::vector<char> body(comp.begin() + 1, comp.end());
+                bool complete = Multipath::receive(fd, body, sessionKey, out, progress.get());
+                if (!closeOutput(complete) || !complete) { ok = false; break; }
+                // Resends may still be in flight, so the connection ends here.
+                char ack = FILE_ACK;
+                if (send(fd, &ack, 1, 0) != 1) { perror("send ack"); ok = false; }
+                break;
+            } else if (type == CTRL_FILE_END) {
+                key     = &sessionKey;
+                counter = &chunkCounter;
+                if (!inNamed || !complete()) {
+                    std::cerr << "File ended at " << out.position() << " of " << expected
+                              << " announced bytes" << std::endl;
+                    ok = false;
+                    break;
+                }
+                inNamed = false;
+                if (!closeOutput(true)) { ok = false; break; }
+                char ack = FILE_ACK;
+                if (send(fd, &ack, 1, 0) != 1) { perror("send ack"); ok = false; break; }
+            } else if (type == CTRL_FILE_CANCEL) {
+                key     = &sessionKey;
+                counter = &chunkCounter;
+                if (!inNamed) { std::cerr << "Cancel outside a file" << std::endl; ok = false; break; }
+                std::cerr << "Sender cancelled the file after " << out.position() << " bytes" << std::endl;
+                inNamed = false;
+                sized   = false;
+                closeOutput(false);
+                char ack = FILE_DROPPED;
+                if (send(fd, &ack, 1, 0) != 1) { perror("send ack"); ok = false; break; }
+            } else {
+                std::cerr << "Unknown control frame" << std::endl;
+            }
+            continue;
+        }
+
+        if (!ensureOpen()) { ok = false; break; }
+        // Mapped output: decompress straight into the file's pages.
+        char* dst = out.mappedAt(orig);
+        bool decompressed = dst ? decompressChunkInto(comp, dst, orig)
+                                : decompressChunk(comp, decomp, orig);
+        if (!decompressed) {
+            std::cerr << "Decompression failed" << std::endl;
+            ok = false;
+            break;
+        }
+
+        if (dst) out.advance(orig);
+        else if (!out.write(decomp.data(), decomp.size())) { ok = false; break; }
+        progress->add(orig);
+    }
+
+    // A receive cut off early, even by a clean close, leaves the previous
+    // file in place.
+    if (ok && out.isOpen() && (inNamed || !complete())) {
+        std::cerr << "Connection closed after " << out.position() << " of "
+                  << (inNamed && !sized ? std::string("?") : std::to_string(expected))
+                  << " bytes" << std::endl;
+        ok = false;
+    }
+    if (!closeOutput(ok)) ok = false;
+    if (ok) std::cout << "\n[DEBUG] Finished receiving file (durability "
+                      << durabilityName(wopts.durability) << ", "
+                      << std::setprecision(3) << syncSeconds << "s in fsync"
+                      << (opts.skipIdentical ? ", " + std::to_string(skippedBytes) + " identical bytes not rewritten" : "")
+                      << ")" << std::endl;
+    else    std::cerr << "\nReceive failed" << std::endl;
+}
+
+} // namespace FileTransfer
@@ -0,0 +1,133 @@
+// transfer.h
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <array>
+#include <memory>
+#include "reader.h"        // ReadBackend, ChunkReader
+#include "writer.h"        // Durability
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #pragma comment(lib, "Ws2_32.lib")
+  using socklen_t = int;
+  #define CLOSE_SOCKET closesocket
+#else
+  #include <sys/socket.h>
+  #include <arpa/inet.h>
+  #include <unistd.h>
+  #include <netinet/in.h>
+  #define CLOSE_SOCKET close
+#endif
+
+// Configuration constants
+static const int CHUNK_SIZE   = 64 * 1024;  // 64 KB
+static const int PORT_DEFAULT = 9000;
+static const int PROTOCOL_VERSION = 5;      // advertised in beacons; bump on wire changes
+static const uint64_t READ_AHEAD_BYTES = 8ull << 20;  // file data prepared before the key is known
+
+namespace FileTransfer {
+
+// The first chunks of a file, read and compressed in the background
+// while the connection is still being keyed (see startReadAhead).
+struct ReadAhead;
+
+// Sender tuning; the defaults favour bulk throughput.
+struct SendOptions {
+    bool lowLatency       = false;      // flush partial chunks of stream sources
+    int  flushDeadlineUs  = 1000;       // longest a byte may wait in a partial chunk
+    int  flushBytes       = 16 * 1024;  // flush as soon as this much is buffered
+    int  compressionLevel = 3;          // zstd level
+    ReadBackend readBackend = ReadBackend::Auto;  // how regular files are read
+    std::string label;                  // name in progress reports; default the path
+    uint64_t    expectedSize = 0;       // length of a stream source, if known: its progress
+                                        // total, and a session file must reach it
+    std::shared_ptr<ReadAhead> readAhead;  // chunks prepared by startReadAhead, sent first
+};
+
+// Per-chunk digest remembered between sends of the same file.
+using ChunkDigest = std::array<unsigned char, 16>;
+
+// Receiver tuning.
+struct ReceiveOptions {
+    bool flushEachChunk = false;  // hand each chunk to the disk immediately
+    int  busyPollUs     = 0;      // SO_BUSY_POLL on the data socket, 0 = off
+    bool directWrites   = false;  // O_DIRECT for aligned write-behind batches
+    bool mmapWrites     = false;  // decompress into a mapping of dense files
+    bool skipIdentical  = false;  // update existing files in place, skipping unchanged regions
+    Durability durability = Durability::End;   // ignored for stdout
+    uint64_t syncEveryBytes = 64ull << 20;     // Periodic fsync interval
+};
+
+bool initSockets();
+void cleanupSockets();
+
+// Binds and listens on `port`, taking TCP Fast Open where the kernel
+// allows; exits the process on failure.
+int createListener(int port);
+
+// Strips an optional ":port" suffix from `hostPort`.
+std::string parseHost(const std::string &hostPort);
+
+// Connects to host:port (TCP Fast Open where the kernel allows), returns
+// the socket or -1 on error.
+int createConnection(const std::string &host, int port);
+
+// Disables Nagle so small frames leave immediately.
+void setNoDelay(int fd);
+
+// Streams `path` over `fd` as compressed, encrypted chunks. Holes and
+// all-zero chunks are sent as compact hole frames instead of data.
+// "-" reads stdin; pipes and FIFOs are streamed until EOF.
+// In low-latency mode partial chunks are flushed on a deadline.
+// Returns false if the file can't be read or the connection fails.
+bool sendFile(int fd, const std::string &path, const std::vector<unsigned char>& sessionKey,
+              const SendOptions& opts = SendOptions());
+
+// Starts reading and compressing the first `budget` bytes of regular
+// file `path` on a background thread, so the work overlaps connecting
+// and the key exchange; pass the result in SendOptions::readAhead and the
+// send encrypts and sends those chunks as soon as it has the key. Ignored
+// if the file changed in between or the send tracks chunk digests.
+// nullptr for stdin and anything that isn't a regular file.
+std::shared_ptr<ReadAhead> startReadAhead(const std::string& path, const SendOptions& opts,
+                                          uint64_t budget = READ_AHEAD_BYTES);
+
+// Sends `path` as file `name` on an already keyed session so many files
+// can share one connection. `chunkCounter` carries the session's nonce
+// sequence across files; each file's frames after the first are under a
+// key derived for that file, with a nonce space of their own. With `digests` (the previous send of this file) chunks
+// that did not change become keep frames; it is updated in place. Such a
+// resend updates the receiver's copy in place; every other file is written
+// to a temporary there and renamed over the old one once complete.
+// `bytesSent`, if given, receives the payload bytes actually sent.
+// A regular file that shrinks while it is read is cancelled rather than
+// ended, and the session stays usable; see waitFileAck.
+bool sendSessionFile(int fd, const std::string &path, const std::string &name,
+                     const std::vector<unsigned char>& sessionKey, uint64_t& chunkCounter,
+                     std::vector<ChunkDigest>* digests = nullptr, uint64_t* bytesSent = nullptr,
+                     const SendOptions& opts = SendOptions());
+
+// Starts a multipath transfer (see multipath.h) on a keyed session: sends
+// the MULTIPATH control frame carrying `body`.
+bool sendMultipathBegin(int fd, const std::vector<char>& body,
+                        const std::vector<unsigned char>& sessionKey, uint64_t& chunkCounter);
+
+// Blocks until the receiver confirms the next session file is on disk.
+// A file sendSessionFile cancelled (its source shrank while it was read)
+// is answered as dropped instead: that sets `cancelled` and returns true,
+// or fails if `cancelled` is null.
+bool waitFileAck(int fd, bool* cancelled = nullptr);
+
+// Receives the chunk stream from `fd` into `outPath`, recreating holes
+// as sparse regions rather than writing zeros. "-" writes to stdout.
+// Disk writes happen on a write-behind thread (see FileWriter), and
+// announced sizes are preallocated. Files appear under their final name
+// only once complete and synced per `opts.durability`.
+// Named session files land inside `outPath` if it is a directory,
+// otherwise next to it.
+void receiveFile(int fd, const std::string &outPath, const std::vector<unsigned char>& sessionKey,
+                 const ReceiveOptions& opts = ReceiveOptions());
+
+} // namespace FileTransfer
@@ -0,0 +1,209 @@
+// trust.cpp
+// Identity key, trust store and the first-contact policy.
+
+#include "trust.h"
+
+#include <sodium.h>
+
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace Trust {
+
+namespace {
+
+std::atomic<Policy> g_policy{Policy::Prompt};
+
+std::mutex    g_identityMutex;
+bool          g_identityLoaded = false;
+unsigned char g_secretKey[crypto_sign_SECRETKEYBYTES];
+
+std::mutex g_storeMutex;    // store appends, and one prompt at a time
+
+std::string configPath(const char* name) {
+    std::string base;
+    if (const char* xdg = std::getenv("XDG_CONFIG_HOME")) {
+        base = xdg;
+    } else if (const char* home = std::getenv("HOME")) {
+        base = std::string(home) + "/.config";
+        mkdir(base.c_str(), 0700);
+    } else {
+        return "";
+    }
+    return base + "/quickdrop/" + name;
+}
+
+std::string toHex(const unsigned char* bin, size_t len) {
+    std::string hex(len * 2 + 1, '\0');
+    sodium_bin2hex(&hex[0], hex.size(), bin, len);
+    hex.pop_back();
+    return hex;
+}
+
+bool readIdentity(const std::string& path) {
+    std::ifstream in(path);
+    std::string hex;
+    size_t got = 0;
+    return in && std::getline(in, hex) &&
+           sodium_hex2bin(g_secretKey, sizeof(g_secretKey), hex.data(), hex.size(),
+                          nullptr, &got, nullptr) == 0 && got == sizeof(g_secretKey);
+}
+
+bool createIdentity(const std::string& path) {
+    unsigned char pk[crypto_sign_PUBLICKEYBYTES];
+    crypto_sign_keypair(pk, g_secretKey);
+    mkdir(path.substr(0, path.rfind('/')).c_str(), 0700);
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) { perror("open identity"); return false; }
+    std::string line = toHex(g_secretKey, sizeof(g_secretKey)) + "\n";
+    bool ok = write(fd, line.data(), line.size()) == ssize_t(line.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!ok) { perror("write identity"); unlink(tmp.c_str()); return false; }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) { perror("rename identity"); return false; }
+    std::cout << "[DEBUG] Created identity " << fingerprint(pk) << " in " << path << std::endl;
+    return true;
+}
+
+// Appends to the trust store; the caller holds g_storeMutex.
+bool appendTrusted(const std::string& fp, const std::string& label) {
+    std::string path = trustStorePath();
+    if (path.empty()) return false;
+    mkdir(path.substr(0, path.rfind('/')).c_str(), 0700);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) { perror("open trust store"); return false; }
+    std::string line = fp + "\t" + label + "\n";
+    bool ok = write(fd, line.data(), line.size()) == ssize_t(line.size());
+    close(fd);
+    if (!ok) perror("write trust store");
+    return ok;
+}
+
+// Asks on the terminal whether to trust a new peer. Stdin may be
+// carrying file data (`send-to -`), so it is only read if it is the
+// terminal; /dev/tty otherwise. No terminal at all means no.
+bool askUser() {
+    std::string answer;
+    if (isatty(STDIN_FILENO)) {
+        if (!std::getline(std::cin, answer)) return false;
+    } else {
+        std::ifstream tty("/dev/tty");
+        if (!tty || !std::getline(tty, answer)) {
+            std::cerr << "No terminal to confirm on; pin the peer with `QuickDrop trust` "
+                         "or pass --trust=tofu" << std::endl;
+            return false;
+        }
+    }
+    return answer.empty() || answer == "y" || answer == "Y" || answer == "yes";
+}
+
+} // namespace
+
+bool parsePolicy(const std::string& name, Policy& out) {
+    if (name == "prompt") { out = Policy::Prompt; return true; }
+    if (name == "tofu")   { out = Policy::Tofu;   return true; }
+    if (name == "pinned") { out = Policy::Pinned; return true; }
+    return false;
+}
+
+const char* policyName(Policy policy) {
+    switch (policy) {
+    case Policy::Prompt: return "prompt";
+    case Policy::Tofu:   return "tofu";
+    case Policy::Pinned: return "pinned";
+    }
+    return "?";
+}
+
+void setPolicy(Policy policy) { g_policy = policy; }
+Policy policy() { return g_policy; }
+
+bool loadIdentity(unsigned char publicKey[PUBLIC_KEY_BYTES]) {
+    std::lock_guard<std::mutex> lk(g_identityMutex);
+    if (!g_identityLoaded) {
+        std::string path = identityPath();
+        if (path.empty() || sodium_init() < 0) return false;
+        if (!readIdentity(path) && !createIdentity(path)) return false;
+        g_identityLoaded = true;
+    }
+    // An Ed25519 secret key ends in its public key.
+    memcpy(publicKey, g_secretKey + crypto_sign_SECRETKEYBYTES - crypto_sign_PUBLICKEYBYTES,
+           crypto_sign_PUBLICKEYBYTES);
+    return true;
+}
+
+bool sign(const std::string& msg, unsigned char sig[SIGNATURE_BYTES]) {
+    std::lock_guard<std::mutex> lk(g_identityMutex);
+    return g_identityLoaded &&
+           crypto_sign_detached(sig, nullptr, reinterpret_cast<const unsigned char*>(msg.data()),
+                                msg.size(), g_secretKey) == 0;
+}
+
+bool verify(const std::string& msg, const unsigned char sig[SIGNATURE_BYTES],
+            const unsigned char publicKey[PUBLIC_KEY_BYTES]) {
+    return crypto_sign_verify_detached(sig, reinterpret_cast<const unsigned char*>(msg.data()),
+                                       msg.size(), publicKey) == 0;
+}
+
+std::string fingerprint(const unsigned char publicKey[PUBLIC_KEY_BYTES]) {
+    unsigned char hash[16];
+    crypto_generichash(hash, sizeof(hash), publicKey, PUBLIC_KEY_BYTES, nullptr, 0);
+    return toHex(hash, sizeof(hash));
+}
+
+bool isTrusted(const std::string& fp) {
+    std::string path = trustStorePath();
+    if (path.empty()) return false;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, fp.size(), fp) == 0 &&
+            (line.size() == fp.size() || line[fp.size()] == '\t')) return true;
+    }
+    return false;
+}
+
+bool addTrusted(const std::string& fp, const std::string& label) {
+    std::lock_guard<std::mutex> lk(g_storeMutex);
+    return isTrusted(fp) || appendTrusted(fp, label);
+}
+
+bool admit(const std::string& fp, const std::string& address, uint16_t code) {
+    if (isTrusted(fp)) {
+        std::cout << "[DEBUG] Trusted peer " << fp << " at " << address << std::endl;
+        return true;
+    }
+    std::cout << "New peer " << fp << " at " << address << ", verify code: " << code << std::endl;
+    switch (policy()) {
+    case Policy::Pinned:
+        std::cerr << "Refused untrusted peer " << fp << " (--trust=pinned); if the verify code "
+                     "matches, run `QuickDrop trust " << fp << "`" << std::endl;
+        return false;
+    case Policy::Tofu:
+        addTrusted(fp, address);   // if that fails, admitted this once
+        return true;
+    case Policy::Prompt:
+        break;
+    }
+    std::lock_guard<std::mutex> lk(g_storeMutex);   // one question at a time
+    if (isTrusted(fp)) return true;                  // admitted while we waited
+    std::cout << "Trust it? [Y/n] " << std::flush;
+    if (!askUser()) {
+        std::cerr << "Refused peer " << fp << std::endl;
+        return false;
+    }
+    appendTrusted(fp, address);   // if that fails, admitted this once
+    return true;
+}
+
+std::string identityPath()   { return configPath("identity"); }
+std::string trustStorePath() { return configPath("trusted"); }
+
+} // namespace Trust
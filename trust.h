@@ -0,0 +1,60 @@
+// trust.h
+#pragma once
+#include <string>
+#include <cstdint>
+
+// Long-term identities and the store of peers trusted by them.
+//
+// Every installation has an Ed25519 identity key, created on first use
+// (identityPath()). During the key exchange each end signs both
+// ephemeral public keys with it, so a peer is known by the fingerprint
+// of its identity key for as long as it keeps that key. Fingerprints in
+// the trust store (trustStorePath()) are admitted without a prompt; the
+// verify code is only shown for a peer not seen before, and whether that
+// one is admitted depends on the policy:
+//   Prompt  ask on the terminal; refused if there is none (CLI default)
+//   Tofu    admit and pin it without asking
+//   Pinned  refuse it; peers are added with `QuickDrop trust` (web mode default)
+namespace Trust {
+
+enum class Policy { Prompt, Tofu, Pinned };
+
+// Parses "prompt", "tofu" or "pinned"; false if unknown.
+bool parsePolicy(const std::string& name, Policy& out);
+const char* policyName(Policy policy);
+
+// Process-wide policy for key exchanges; Prompt unless set.
+void setPolicy(Policy policy);
+Policy policy();
+
+static const int PUBLIC_KEY_BYTES = 32;
+static const int SIGNATURE_BYTES  = 64;
+
+// Loads this installation's identity, creating it if there is none.
+// False if it can't be read or saved.
+bool loadIdentity(unsigned char publicKey[PUBLIC_KEY_BYTES]);
+// Signs `msg` with the identity loaded by loadIdentity().
+bool sign(const std::string& msg, unsigned char sig[SIGNATURE_BYTES]);
+bool verify(const std::string& msg, const unsigned char sig[SIGNATURE_BYTES],
+            const unsigned char publicKey[PUBLIC_KEY_BYTES]);
+
+// Hex fingerprint of an identity key, as `QuickDrop id` prints it.
+std::string fingerprint(const unsigned char publicKey[PUBLIC_KEY_BYTES]);
+
+bool isTrusted(const std::string& fingerprint);
+// Adds a fingerprint to the trust store; `label` is a note for people,
+// say the address it was first seen at.
+bool addTrusted(const std::string& fingerprint, const std::string& label);
+
+// Decides about a peer that proved identity `fingerprint` in a key
+// exchange with verify code `code`: trusted peers are admitted at once,
+// others as the policy says. Never reads stdin unless the policy is
+// Prompt. `address` is shown and kept as the label.
+bool admit(const std::string& fingerprint, const std::string& address, uint16_t code);
+
+// $XDG_CONFIG_HOME/quickdrop/..., else ~/.config/quickdrop/..., or ""
+// if neither is known. The identity file is kept 0600.
+std::string identityPath();
+std::string trustStorePath();
+
+} // namespace Trust
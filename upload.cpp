@@ -0,0 +1,765 @@
+// upload.cpp
+// Side HTTP server for the web UI: streaming and resumable uploads, and
+// range downloads of received files.
+
+#include "upload.h"
+#include "transfer.h"
+#include "session.h"       // sessionPool
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const size_t   MAX_HEAD     = 16 * 1024;          // request line + headers
+const uint64_t SLICE_SIZE   = 4ull << 20;         // resumable upload granularity
+const uint64_t MAX_UPLOAD   = 1ull << 40;         // 1 TB; bounds the slice map
+const auto     UPLOAD_IDLE  = std::chrono::minutes(30);   // abandoned uploads expire
+
+// One client connection; `buf` holds bytes read past the current request head.
+struct HttpConn {
+    int         fd;
+    std::string buf;
+};
+
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> query;
+    bool        hasLength     = false;
+    uint64_t    contentLength = 0;
+    bool        keepAlive     = true;
+    std::map<std::string, std::string> headers;   // lower-cased names
+};
+
+// '+' means a space in query strings but not in paths.
+std::string urlDecode(const std::string& s, bool plusIsSpace = true) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '+' && plusIsSpace) {
+            out += ' ';
+        } else if (s[i] == '%' && i + 2 < s.size()) {
+            out += char(std::strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+// Reads up to the blank line ending the headers and parses what we use.
+bool readRequestHead(HttpConn& conn, HttpRequest& req) {
+    char buf[4096];
+    size_t end;
+    while ((end = conn.buf.find("\r\n\r\n")) == std::string::npos) {
+        if (conn.buf.size() > MAX_HEAD) return false;
+        ssize_t r = recv(conn.fd, buf, sizeof(buf), 0);
+        if (r <= 0) return false;
+        conn.buf.append(buf, r);
+    }
+    std::string head = conn.buf.substr(0, end);
+    conn.buf.erase(0, end + 4);
+
+    size_t lineEnd = head.find("\r\n");
+    std::string line = head.substr(0, lineEnd);
+    size_t sp1 = line.find(' '), sp2 = line.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) return false;
+    req.method = line.substr(0, sp1);
+    req.keepAlive = line.compare(sp2 + 1, std::string::npos, "HTTP/1.0") != 0;
+    std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t q = target.find('?');
+    req.path = target.substr(0, q);
+    if (q != std::string::npos) {
+        std::string qs = target.substr(q + 1);
+        for (size_t pos = 0; pos <= qs.size(); ) {
+            size_t amp = qs.find('&', pos);
+            if (amp == std::string::npos) amp = qs.size();
+            std::string kv = qs.substr(pos, amp - pos);
+            size_t eq = kv.find('=');
+            if (!kv.empty()) {
+                req.query[urlDecode(kv.substr(0, eq))] =
+                    eq == std::string::npos ? "" : urlDecode(kv.substr(eq + 1));
+            }
+            pos = amp + 1;
+        }
+    }
+
+    for (size_t pos = lineEnd; pos != std::string::npos && pos < head.size(); ) {
+        size_t next = head.find("\r\n", pos + 2);
+        std::string h = head.substr(pos + 2, next == std::string::npos ? std::string::npos : next - pos - 2);
+        size_t colon = h.find(':');
+        if (colon != std::string::npos) {
+            std::string name = h.substr(0, colon);
+            std::string value = h.substr(colon + 1);
+            for (auto& c : name) c = char(tolower(c));
+            value.erase(0, value.find_first_not_of(' '));
+            req.headers[name] = value;
+            for (auto& c : value) c = char(tolower(c));
+            if (name == "content-length") {
+                req.hasLength = true;
+                req.contentLength = std::strtoull(value.c_str(), nullptr, 10);
+            } else if (name == "connection") {
+                if (value.find("close") != std::string::npos) req.keepAlive = false;
+            }
+        }
+        pos = next;
+    }
+    return true;
+}
+
+std::string responseHead(int status, const char* reason, uint64_t length,
+                         const char* contentType, bool keepAlive, const std::string& extra = "") {
+    return "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n"
+           "Access-Control-Allow-Origin: *\r\n"
+           "Access-Control-Allow-Methods: GET, HEAD, POST, PUT, OPTIONS\r\n"
+           "Access-Control-Allow-Headers: Content-Type, Range\r\n"
+           "Content-Type: " + contentType + "\r\n"
+           "Content-Length: " + std::to_string(length) + "\r\n" + extra +
+           "Connection: " + (keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+}
+
+void respond(int fd, int status, const char* reason, const std::string& body = "",
+             const char* contentType = "text/plain", bool keepAlive = false) {
+    std::string r = responseHead(status, reason, body.size(), contentType, keepAlive) + body;
+    send(fd, r.data(), r.size(), 0);
+}
+
+bool writeAll(int fd, const char* p, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w; len -= w;
+    }
+    return true;
+}
+
+bool pwriteAll(int fd, const char* p, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, static_cast<off_t>(off));
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w; len -= w; off += w;
+    }
+    return true;
+}
+
+// Hands `remaining` body bytes to `sink` in pieces, starting with any
+// already buffered on the connection.
+template <typename Sink>
+bool readBody(HttpConn& conn, uint64_t remaining, Sink sink) {
+    size_t first = static_cast<size_t>(std::min<uint64_t>(conn.buf.size(), remaining));
+    if (first > 0 && !sink(conn.buf.data(), first)) return false;
+    conn.buf.erase(0, first);
+    remaining -= first;
+    std::vector<char> buf(CHUNK_SIZE);
+    while (remaining > 0) {
+        ssize_t r = recv(conn.fd, buf.data(), static_cast<size_t>(std::min<uint64_t>(remaining, buf.size())), 0);
+        if (r <= 0 || !sink(buf.data(), r)) return false;
+        remaining -= r;
+    }
+    return true;
+}
+
+// Moves exactly `remaining` body bytes from the client into the pipe
+// feeding the peer session; spliced in the kernel where possible.
+bool pumpBody(HttpConn& conn, int pipeW, uint64_t remaining) {
+    size_t first = static_cast<size_t>(std::min<uint64_t>(conn.buf.size(), remaining));
+    if (!writeAll(pipeW, conn.buf.data(), first)) return false;
+    conn.buf.erase(0, first);
+    remaining -= first;
+#ifdef __linux__
+    while (remaining > 0) {
+        ssize_t n = splice(conn.fd, nullptr, pipeW, nullptr,
+                           static_cast<size_t>(std::min<uint64_t>(remaining, 1 << 20)),
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) break;   // not spliceable here; copy instead
+        if (n <= 0) return false;
+        remaining -= n;
+    }
+#endif
+    return readBody(conn, remaining, [&](const char* p, size_t n) { return writeAll(pipeW, p, n); });
+}
+
+// A pooled session to the peer named in the query string, so uploads
+// after the first to a peer skip the connect and key exchange.
+std::unique_ptr<Session> connectPeer(const HttpRequest& req) {
+    std::string ip = req.query.count("ip") ? req.query.at("ip") : "127.0.0.1";
+    int port = req.query.count("port") ? std::atoi(req.query.at("port").c_str()) : PORT_DEFAULT;
+    return sessionPool().acquire(ip, port);
+}
+
+// Cuts off the send to `peer` before the pipe feeding it is closed, so
+// the sender fails at its next frame instead of ending the file at the
+// short EOF; the receiver discards the partial file. The close on
+// release is a reset.
+void abortPeer(int peer) {
+    struct linger lg = { 1, 0 };
+    setsockopt(peer, SOL_SOCKET, SO_LINGER, (char*)&lg, sizeof(lg));
+    shutdown(peer, SHUT_RDWR);
+}
+
+// Sends what arrives on pipe `from` as file `name`, waits for the peer's
+// ack and closes `from`. The session goes back to the pool if all went
+// well.
+bool forwardPipe(std::unique_ptr<Session>& peer, int from, const std::string& name,
+                 const FileTransfer::SendOptions& opts) {
+    bool ok = peer->send("/dev/fd/" + std::to_string(from), name, opts);
+    close(from);
+    return ok && peer->finish();
+}
+
+// POST /upload: the whole file as one streamed body.
+bool handleStream(HttpConn& conn, const HttpRequest& req) {
+    auto peer = connectPeer(req);
+    if (!peer) { respond(conn.fd, 502, "Bad Gateway", "Cannot reach peer"); return false; }
+
+    int p[2];
+    if (pipe(p) < 0) { perror("pipe"); respond(conn.fd, 500, "Internal Server Error"); return false; }
+    std::cout << "[DEBUG] Streaming " << req.contentLength << " byte upload to " << peer->peer << std::endl;
+    // The read end is closed as soon as the send returns, so a failed
+    // send turns our pipe writes into EPIPE instead of a stall.
+    FileTransfer::SendOptions opts;
+    opts.label        = req.query.count("name") ? req.query.at("name") : "upload";
+    opts.expectedSize = req.contentLength;
+    bool sent = false;
+    std::thread sender([&]{ sent = forwardPipe(peer, p[0], opts.label, opts); });
+    bool ok = pumpBody(conn, p[1], req.contentLength);
+    if (!ok) abortPeer(peer->fd);
+    close(p[1]);
+    sender.join();
+    ok = ok && sent;
+    sessionPool().release(std::move(peer), ok);
+    if (ok) respond(conn.fd, 200, "OK", "Sent " + std::to_string(req.contentLength) + " bytes");
+    else    respond(conn.fd, 502, "Bad Gateway", "Upload interrupted");
+    return false;
+}
+
+// ----------------------------------------------------------------------------
+// Resumable uploads
+//
+// The browser cuts the file into SLICE_SIZE pieces and PUTs them, several
+// at a time and in any order. Slices land in a spool file; a forwarder
+// thread feeds the contiguous prefix to the peer session as it grows, so the
+// peer starts receiving long before the upload is complete. GET reports
+// which slices are still missing, so a client that lost its connection
+// (or its page) re-sends only those.
+
+struct UploadSession {
+    std::string id;
+    std::string name;                // for progress reports
+    uint64_t    size   = 0;
+    int         spool  = -1;
+    std::string spoolPath;
+    std::vector<char> have;          // per slice: stored in the spool
+    uint64_t    forwarded = 0;       // bytes handed to the sender
+    bool        complete  = false;
+    bool        failed    = false;
+    clock_type::time_point touched = clock_type::now();
+    std::mutex  m;
+    std::condition_variable cv;
+
+    ~UploadSession() { if (spool >= 0) close(spool); }
+
+    size_t slices() const { return static_cast<size_t>((size + SLICE_SIZE - 1) / SLICE_SIZE); }
+    uint64_t sliceLength(size_t i) const { return std::min<uint64_t>(SLICE_SIZE, size - i * SLICE_SIZE); }
+};
+
+std::mutex g_uploadsMutex;
+std::map<std::string, std::shared_ptr<UploadSession>> g_uploads;
+
+std::string newUploadId() {
+    static std::mt19937_64 rng(std::random_device{}());
+    static std::mutex m;
+    std::lock_guard<std::mutex> lk(m);
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)rng());
+    return buf;
+}
+
+std::shared_ptr<UploadSession> findUpload(const std::string& id) {
+    std::lock_guard<std::mutex> lk(g_uploadsMutex);
+    auto it = g_uploads.find(id);
+    return it == g_uploads.end() ? nullptr : it->second;
+}
+
+// Drops finished sessions and ones nobody has touched for UPLOAD_IDLE.
+void reapUploads() {
+    std::lock_guard<std::mutex> lk(g_uploadsMutex);
+    for (auto it = g_uploads.begin(); it != g_uploads.end(); ) {
+        std::lock_guard<std::mutex> slk(it->second->m);
+        bool done = it->second->complete || it->second->failed;
+        if (done && clock_type::now() - it->second->touched > UPLOAD_IDLE) it = g_uploads.erase(it);
+        else ++it;
+    }
+}
+
+// Feeds slices to the peer session in order as they arrive, then cleans up.
+void forwardUpload(std::shared_ptr<UploadSession> s, std::unique_ptr<Session> peer) {
+    int p[2];
+    bool ok = pipe(p) == 0;
+    std::thread sender;
+    bool sent = false;
+    FileTransfer::SendOptions opts;
+    opts.label        = s->name;
+    opts.expectedSize = s->size;
+    if (ok) sender = std::thread([&]{ sent = forwardPipe(peer, p[0], s->name, opts); });
+    std::vector<char> buf(CHUNK_SIZE);
+    for (size_t i = 0; ok && i < s->slices(); ++i) {
+        {
+            std::unique_lock<std::mutex> lk(s->m);
+            while (!s->have[i]) {
+                if (s->cv.wait_until(lk, s->touched + UPLOAD_IDLE) == std::cv_status::timeout &&
+                    clock_type::now() - s->touched >= UPLOAD_IDLE) {
+                    std::cerr << "Upload " << s->id << " abandoned" << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        uint64_t off = i * SLICE_SIZE, end = off + s->sliceLength(i);
+        while (ok && off < end) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(buf.size(), end - off));
+            ok = pread(s->spool, buf.data(), n, static_cast<off_t>(off)) == ssize_t(n) &&
+                 writeAll(p[1], buf.data(), n);
+            off += n;
+            std::lock_guard<std::mutex> lk(s->m);
+            s->forwarded = off;
+        }
+    }
+    if (!ok) abortPeer(peer->fd);
+    if (sender.joinable()) {
+        close(p[1]);
+        sender.join();
+    }
+    ok = ok && sent;
+    sessionPool().release(std::move(peer), ok);
+    // Free the space now; the descriptor lives as long as the session so a
+    // late retried slice cannot write into a reused fd. A slice still
+    // being written trims the spool again once it sees the upload is over.
+    unlink(s->spoolPath.c_str());
+    std::lock_guard<std::mutex> lk(s->m);
+    if (ftruncate(s->spool, 0) != 0) perror("truncate upload spool");
+    s->complete = ok;
+    s->failed   = !ok;
+    s->touched  = clock_type::now();
+    std::cout << "[DEBUG] Upload " << s->id << (ok ? " forwarded" : " failed") << std::endl;
+}
+
+std::string uploadStatus(UploadSession& s) {
+    std::lock_guard<std::mutex> lk(s.m);
+    std::string missing;
+    for (size_t i = 0; i < s.have.size(); ++i) {
+        if (s.have[i]) continue;
+        if (!missing.empty()) missing += ",";
+        missing += std::to_string(i);
+    }
+    const char* state = s.complete ? "complete" : s.failed ? "failed" : "uploading";
+    return "{\"id\":\"" + s.id + "\",\"size\":" + std::to_string(s.size) +
+           ",\"slice\":" + std::to_string(SLICE_SIZE) +
+           ",\"forwarded\":" + std::to_string(s.forwarded) +
+           ",\"state\":\"" + state + "\",\"missing\":[" + missing + "]}";
+}
+
+// POST /upload/init?size=N&ip=..&port=..: keys the peer session and
+// creates the spool; the reply is the status of the new upload.
+bool handleInit(HttpConn& conn, const HttpRequest& req) {
+    if (!req.query.count("size")) { respond(conn.fd, 400, "Bad Request", "size required"); return false; }
+    const std::string& sizeArg = req.query.at("size");
+    char* end = nullptr;
+    errno = 0;
+    uint64_t size = std::strtoull(sizeArg.c_str(), &end, 10);
+    if (sizeArg.empty() || *end != '\0' || sizeArg[0] == '-' || errno == ERANGE || size > MAX_UPLOAD) {
+        respond(conn.fd, 413, "Payload Too Large", "size must be a byte count up to 1 TB");
+        return false;
+    }
+    reapUploads();
+    auto s = std::make_shared<UploadSession>();
+    s->id   = newUploadId();
+    s->size = size;
+    s->name = req.query.count("name") ? req.query.at("name") : "upload " + s->id;
+    s->have.assign(s->slices(), 0);
+    const char* tmp = std::getenv("TMPDIR");
+    s->spoolPath = std::string(tmp ? tmp : "/tmp") + "/quickdrop-upload-" + s->id;
+    s->spool = open(s->spoolPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (s->spool < 0) { perror("open upload spool"); respond(conn.fd, 500, "Internal Server Error"); return false; }
+    // The whole file is spooled before it can be forwarded in full.
+    struct statvfs vfs;
+    if (fstatvfs(s->spool, &vfs) == 0 && uint64_t(vfs.f_bavail) * vfs.f_frsize < size) {
+        close(s->spool);
+        s->spool = -1;
+        unlink(s->spoolPath.c_str());
+        respond(conn.fd, 507, "Insufficient Storage", "Not enough space to spool the upload");
+        return false;
+    }
+
+    auto peer = connectPeer(req);
+    if (!peer) {
+        close(s->spool);
+        unlink(s->spoolPath.c_str());
+        respond(conn.fd, 502, "Bad Gateway", "Cannot reach peer");
+        return false;
+    }
+    std::cout << "[DEBUG] Resumable upload " << s->id << ": " << s->size
+              << " bytes to " << peer->peer << std::endl;
+    {
+        std::lock_guard<std::mutex> lk(g_uploadsMutex);
+        g_uploads[s->id] = s;
+    }
+    std::thread(forwardUpload, s, std::move(peer)).detach();
+    respond(conn.fd, 200, "OK", uploadStatus(*s), "application/json", req.keepAlive);
+    return req.keepAlive;
+}
+
+// PUT /upload/<id>?offset=O with one whole slice as the body.
+bool handleSlice(HttpConn& conn, const HttpRequest& req, UploadSession& s) {
+    uint64_t off = req.query.count("offset") ? std::strtoull(req.query.at("offset").c_str(), nullptr, 10) : 0;
+    size_t index = static_cast<size_t>(off / SLICE_SIZE);
+    // On errors the body is not read, so the connection is closed.
+    if (off % SLICE_SIZE != 0 || index >= s.slices() || req.contentLength != s.sliceLength(index)) {
+        respond(conn.fd, 400, "Bad Request", "offset/length must cover exactly one slice");
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lk(s.m);
+        if (s.complete || s.failed) { respond(conn.fd, 410, "Gone", "Upload finished"); return false; }
+    }
+    uint64_t at = off;
+    bool ok = readBody(conn, req.contentLength, [&](const char* p, size_t n) {
+        bool w = pwriteAll(s.spool, p, n, at);
+        at += n;
+        return w;
+    });
+    {
+        std::lock_guard<std::mutex> lk(s.m);
+        if (s.complete || s.failed) {
+            // Ended while this slice was written: don't keep its bytes.
+            if (ftruncate(s.spool, 0) != 0) perror("truncate upload spool");
+            if (ok) respond(conn.fd, 410, "Gone", "Upload finished");
+            return false;
+        }
+        if (!ok) return false;
+        s.have[index] = 1;
+        s.touched = clock_type::now();
+    }
+    s.cv.notify_all();
+    respond(conn.fd, 200, "OK", "", "text/plain", req.keepAlive);
+    return req.keepAlive;
+}
+
+// ----------------------------------------------------------------------------
+// Downloads
+//
+// GET/HEAD /files/<name> serves a file from the received directory with
+// a strong ETag, If-None-Match / If-Range, and single byte ranges. The
+// body goes out with sendfile(), so it never passes through userspace.
+
+std::string etagFor(const struct stat& st) {
+    char buf[64];
+#ifdef __APPLE__
+    long long ns = (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    long long ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    snprintf(buf, sizeof(buf), "\"%llx-%llx\"", (unsigned long long)st.st_size, (unsigned long long)ns);
+    return buf;
+}
+
+// Parses a single "bytes=a-b" / "bytes=a-" / "bytes=-n" range. Returns
+// false when the header should be ignored (absent, malformed, several
+// ranges); `satisfiable` is false if the range lies outside the file.
+bool parseRange(const std::string& h, uint64_t size, uint64_t& from, uint64_t& to, bool& satisfiable) {
+    if (h.compare(0, 6, "bytes=") != 0 || h.find(',') != std::string::npos) return false;
+    std::string spec = h.substr(6);
+    size_t dash = spec.find('-');
+    if (dash == std::string::npos) return false;
+    std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+    if (a.empty() && b.empty()) return false;
+    satisfiable = true;
+    if (a.empty()) {                       // suffix: last n bytes
+        uint64_t n = std::strtoull(b.c_str(), nullptr, 10);
+        if (n == 0 || size == 0) { satisfiable = false; return true; }
+        from = size - std::min(n, size);
+        to   = size - 1;
+        return true;
+    }
+    from = std::strtoull(a.c_str(), nullptr, 10);
+    to   = b.empty() ? size - 1 : std::min<uint64_t>(std::strtoull(b.c_str(), nullptr, 10), size - 1);
+    if (from >= size || to < from) satisfiable = false;
+    return true;
+}
+
+bool sendFileRange(int sock, int fd, uint64_t off, uint64_t len) {
+#ifdef __linux__
+    while (len > 0) {
+        off_t o = static_cast<off_t>(off);
+        ssize_t n = sendfile(sock, fd, &o, static_cast<size_t>(std::min<uint64_t>(len, 1ull << 30)));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;   // copy below
+        if (n <= 0) return false;
+        off += n; len -= n;
+    }
+#endif
+    std::vector<char> buf(256 * 1024);
+    while (len > 0) {
+        ssize_t n = pread(fd, buf.data(), static_cast<size_t>(std::min<uint64_t>(len, buf.size())),
+                          static_cast<off_t>(off));
+        if (n <= 0) return false;
+        for (ssize_t sent = 0; sent < n; ) {
+            ssize_t w = send(sock, buf.data() + sent, n - sent, 0);
+            if (w <= 0) return false;
+            sent += w;
+        }
+        off += n; len -= n;
+    }
+    return true;
+}
+
+// Opens `parts` under `dir` a component at a time, following no symlink
+// on the way: names in received/ come from peers, and a link there must
+// not serve a file from elsewhere. -1 if any component is missing or a link.
+int openBeneath(const std::string& dir, const std::vector<std::string>& parts) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    for (size_t i = 0; fd >= 0 && i < parts.size(); ++i) {
+        int flags = O_RDONLY | O_NOFOLLOW | (i + 1 < parts.size() ? O_DIRECTORY : 0);
+        int next = openat(fd, parts[i].c_str(), flags);
+        close(fd);
+        fd = next;
+    }
+    return fd;
+}
+
+bool handleDownload(HttpConn& conn, const HttpRequest& req, const std::string& filesDir) {
+    std::string name = urlDecode(req.path.substr(7), false);   // after "/files/"
+    std::vector<std::string> parts;
+    for (size_t start = 0; start <= name.size(); ) {
+        size_t slash = name.find('/', start);
+        std::string part = name.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        if (part.empty() || part == "." || part == "..") { respond(conn.fd, 404, "Not Found"); return false; }
+        parts.push_back(part);
+        if (slash == std::string::npos) break;
+        start = slash + 1;
+    }
+    int fd = openBeneath(filesDir, parts);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        respond(conn.fd, 404, "Not Found", "", "text/plain", req.keepAlive);
+        return req.keepAlive;
+    }
+    uint64_t size = st.st_size;
+    std::string etag = etagFor(st);
+    std::string common = "ETag: " + etag + "\r\nAccept-Ranges: bytes\r\n";
+
+    auto header = [&](const char* name) {
+        auto it = req.headers.find(name);
+        return it == req.headers.end() ? std::string() : it->second;
+    };
+    if (header("if-none-match") == etag) {
+        close(fd);
+        std::string head = responseHead(304, "Not Modified", 0, "application/octet-stream", req.keepAlive, common);
+        send(conn.fd, head.data(), head.size(), 0);
+        return req.keepAlive;
+    }
+
+    uint64_t from = 0, to = size ? size - 1 : 0;
+    bool satisfiable = true;
+    bool ranged = !header("range").empty() &&
+                  (header("if-range").empty() || header("if-range") == etag) &&
+                  parseRange(header("range"), size, from, to, satisfiable);
+    if (ranged && !satisfiable) {
+        close(fd);
+        std::string head = responseHead(416, "Range Not Satisfiable", 0, "text/plain", req.keepAlive,
+                                        common + "Content-Range: bytes */" + std::to_string(size) + "\r\n");
+        send(conn.fd, head.data(), head.size(), 0);
+        return req.keepAlive;
+    }
+    uint64_t len = size == 0 ? 0 : to - from + 1;
+    std::string extra = common;
+    if (ranged) {
+        extra += "Content-Range: bytes " + std::to_string(from) + "-" + std::to_string(to) +
+                 "/" + std::to_string(size) + "\r\n";
+    }
+    std::string head = responseHead(ranged ? 206 : 200, ranged ? "Partial Content" : "OK", len,
+                                    "application/octet-stream", req.keepAlive, extra);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, static_cast<off_t>(from), static_cast<off_t>(len), POSIX_FADV_SEQUENTIAL);
+#endif
+    bool body = req.method != "HEAD" && len > 0;
+#ifdef MSG_MORE
+    int flags = body ? MSG_MORE : 0;   // let the headers share a segment with the body
+#else
+    int flags = 0;
+#endif
+    bool ok = send(conn.fd, head.data(), head.size(), flags) == ssize_t(head.size()) &&
+              (req.method == "HEAD" || sendFileRange(conn.fd, fd, from, len));
+    close(fd);
+    return ok && req.keepAlive;
+}
+
+// Serves requests on one connection until either side closes it.
+void handleConnection(int client, const std::string& pin, const std::string& filesDir) {
+    HttpConn conn{ client, "" };
+    while (true) {
+        HttpRequest req;
+        if (!readRequestHead(conn, req)) return;
+        if (req.method == "OPTIONS") {
+            respond(client, 204, "No Content", "", "text/plain", req.keepAlive);
+            if (req.keepAlive) continue;
+            return;
+        }
+        if (req.query["pin"] != pin) { respond(client, 403, "Forbidden", "Invalid PIN"); return; }
+
+        bool more = false;
+        if (req.method == "POST" && req.path == "/upload") {
+            if (!req.hasLength) { respond(client, 411, "Length Required"); return; }
+            more = handleStream(conn, req);
+        } else if (req.method == "POST" && req.path == "/upload/init") {
+            more = handleInit(conn, req);
+        } else if ((req.method == "GET" || req.method == "HEAD") && req.path.compare(0, 7, "/files/") == 0) {
+            more = handleDownload(conn, req, filesDir);
+        } else if (req.path.compare(0, 8, "/upload/") == 0) {
+            auto s = findUpload(req.path.substr(8));
+            if (!s) { respond(client, 404, "Not Found", "Unknown upload"); return; }
+            if (req.method == "GET") {
+                respond(client, 200, "OK", uploadStatus(*s), "application/json", req.keepAlive);
+                more = req.keepAlive;
+            } else if (req.method == "PUT" && req.hasLength) {
+                more = handleSlice(conn, req, *s);
+            } else {
+                respond(client, 405, "Method Not Allowed");
+            }
+        } else {
+            respond(client, 404, "Not Found");
+        }
+        if (!more) return;
+    }
+}
+
+// Walks `dir` recursively, skipping receiver temporaries.
+void listInto(const std::string& dir, const std::string& rel, std::vector<ReceivedFile>& out) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name == "." || name == "..") continue;
+        std::string path = dir + "/" + name;
+        std::string relName = rel.empty() ? name : rel + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;   // links are neither listed nor served
+        if (S_ISDIR(st.st_mode)) {
+            listInto(path, relName, out);
+        } else if (S_ISREG(st.st_mode) && name.find(".part-") == std::string::npos) {
+            out.push_back({ relName, uint64_t(st.st_size), int64_t(st.st_mtime) });
+        }
+    }
+    closedir(d);
+}
+
+// The browser side of /upload/init and friends, served as /upload.js.
+const char* const UPLOAD_CLIENT_JS = R"(// Resumable upload (see upload.h): the file goes up in slices, several
+// at a time, and the peer starts receiving as soon as the leading slices
+// are in. The upload id is kept in localStorage, so after a failure or a
+// reload only the missing slices are sent.
+const UPLOAD_BASE = `${location.protocol}//${location.hostname}:__UPLOAD_PORT__/upload`;
+const PARALLEL_SLICES = 4;
+const sleep = ms => new Promise(r => setTimeout(r, ms));
+
+async function uploadResumable(file, params, onProgress) {
+  const qs = new URLSearchParams(params).toString();
+  const resumeKey = ['qd-upload', file.name, file.size, file.lastModified, params.ip, params.port].join(':');
+  let status = null;
+  const known = localStorage.getItem(resumeKey);
+  if (known) {
+    const r = await fetch(`${UPLOAD_BASE}/${known}?${qs}`);
+    if (r.ok) status = await r.json();
+    if (status && status.state === 'failed') status = null;
+  }
+  if (!status) {
+    const r = await fetch(`${UPLOAD_BASE}/init?${qs}&size=${file.size}`, { method: 'POST' });
+    if (!r.ok) throw new Error(String(r.status));
+    status = await r.json();
+    localStorage.setItem(resumeKey, status.id);
+  }
+
+  const url = `${UPLOAD_BASE}/${status.id}?${qs}`;
+  const total = Math.ceil(file.size / status.slice);
+  const queue = status.missing.slice();
+  let done = total - queue.length;
+  const worker = async () => {
+    while (queue.length) {
+      const i = queue.shift();
+      const body = file.slice(i * status.slice, Math.min(file.size, (i + 1) * status.slice));
+      for (let attempt = 0; ; attempt++) {
+        // Network errors and 5xx are retried with backoff.
+        const r = await fetch(`${url}&offset=${i * status.slice}`, { method: 'PUT', body }).catch(() => null);
+        if (r && r.ok) break;
+        if ((r && r.status < 500) || attempt >= 5) throw new Error(r ? String(r.status) : 'network');
+        await sleep(500 * 2 ** attempt);
+      }
+      if (onProgress) onProgress(++done / total);
+    }
+  };
+  await Promise.all(Array.from({ length: PARALLEL_SLICES }, worker));
+
+  // All slices are in; wait for the forwarder to finish with the peer.
+  for (;;) {
+    const s = await (await fetch(url)).json();
+    if (s.state === 'complete') break;
+    if (s.state === 'failed') throw new Error('forward failed');
+    await sleep(500);
+  }
+  localStorage.removeItem(resumeKey);
+}
+)";
+
+} // namespace
+
+std::string uploadClientScript(int port) {
+    std::string js = UPLOAD_CLIENT_JS;
+    js.replace(js.find("__UPLOAD_PORT__"), 15, std::to_string(port));
+    return js;
+}
+
+std::vector<ReceivedFile> listReceivedFiles(const std::string& dir) {
+    std::vector<ReceivedFile> files;
+    listInto(dir, "", files);
+    return files;
+}
+
+void runUploadServer(int port, const std::string& pin, const std::string& filesDir) {
+    signal(SIGPIPE, SIG_IGN);   // a dropped peer must not kill the web UI
+    int lst = FileTransfer::createListener(port);
+    std::cout << "Streaming uploads on port " << port << std::endl;
+    while (true) {
+        int client = accept(lst, nullptr, nullptr);
+        if (client < 0) { perror("accept upload"); continue; }
+        std::thread([client, pin, filesDir]{
+            handleConnection(client, pin, filesDir);
+            CLOSE_SOCKET(client);
+        }).detach();
+    }
+}
@@ -0,0 +1,48 @@
+// upload.h
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+static const int UPLOAD_PORT_DEFAULT = 8081;
+
+// Where the web UI's listener puts what it receives.
+static const char* const RECEIVED_DIR = "received";
+
+// Serves browser uploads and downloads on `port` until the process
+// exits. Every request carries pin=N.
+//
+//   POST /upload?ip=A&port=P           body: the raw file bytes
+//   POST /upload/init?ip=A&port=P&size=N   start a resumable upload (up to 1 TB,
+//                                      and only with room to spool it)
+//   PUT  /upload/<id>?offset=O         body: one whole slice
+//   GET  /upload/<id>                  status: missing slices, state
+//   GET  /files/<name>                 a file under `filesDir`, with Range
+//                                      and ETag support, sent by sendfile();
+//                                      symlinks there are not followed
+//
+// Uploads may carry name=N, the name the peer stores them under (and the
+// label in progress reports, see progress.h). Data is forwarded as it
+// arrives, on a pooled session to the peer (session.h), so
+// memory use stays constant however large the upload is. Resumable
+// uploads are spooled to a temporary file; slices may arrive in parallel
+// and out of order, and the contiguous prefix is forwarded as it grows.
+// (Crow reads a request's whole body before its handler runs, which is
+// why this is a separate listener rather than a set of routes.)
+// Responses carry CORS headers so the web UI on Crow's port can call it.
+void runUploadServer(int port, const std::string& pin, const std::string& filesDir);
+
+// The browser's half of resumable uploads to the server on `port`:
+// uploadResumable(file, params, onProgress), which resolves once the peer
+// has the file. Both web UIs load it as /upload.js.
+std::string uploadClientScript(int port);
+
+struct ReceivedFile {
+    std::string name;    // relative to the directory listed
+    uint64_t    size;
+    int64_t     mtime;   // seconds since the epoch
+};
+
+// Regular files under `dir`, recursively, without in-progress temporaries
+// or anything reached through a symlink.
+std::vector<ReceivedFile> listReceivedFiles(const std::string& dir);
@@ -0,0 +1,223 @@
+// watch.cpp
+// Continuous directory sync over a single keyed session.
+
+#include "watch.h"
+#include "resume.h"        // Resume::connect
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+// Longest wait between attempts to reopen a lost session; it doubles up to this.
+const int RECONNECT_MAX_SECONDS = 30;
+
+struct Watcher {
+    int                        ifd;
+    std::string                root;
+    std::map<int, std::string> dirs;      // watch descriptor → relative dir ("" = root)
+    std::map<std::string, clock_type::time_point> pending;  // relative path → first event
+};
+
+std::string joinRel(const std::string& dir, const std::string& name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+// Watches `rel` and everything below it, queueing the files already there.
+void addTree(Watcher& w, const std::string& rel) {
+    std::string full = rel.empty() ? w.root : w.root + "/" + rel;
+    int wd = inotify_add_watch(w.ifd, full.c_str(), WATCH_MASK);
+    if (wd < 0) { perror(("inotify_add_watch " + full).c_str()); return; }
+    w.dirs[wd] = rel;
+
+    DIR* d = opendir(full.c_str());
+    if (!d) return;
+    auto now = clock_type::now();
+    while (dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name == "." || name == "..") continue;
+        std::string child = joinRel(rel, name);
+        struct stat st;
+        if (stat((w.root + "/" + child).c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) addTree(w, child);
+        else if (S_ISREG(st.st_mode)) w.pending.emplace(child, now);
+    }
+    closedir(d);
+}
+
+// Drains the inotify queue into w.pending.
+void readEvents(Watcher& w) {
+    alignas(inotify_event) char buf[16 * 1024];
+    ssize_t n = read(w.ifd, buf, sizeof(buf));
+    auto now = clock_type::now();
+    for (ssize_t i = 0; i < n; ) {
+        auto* ev = reinterpret_cast<inotify_event*>(buf + i);
+        i += sizeof(inotify_event) + ev->len;
+        if (ev->len == 0) continue;
+        auto it = w.dirs.find(ev->wd);
+        if (it == w.dirs.end()) continue;
+        std::string rel = joinRel(it->second, ev->name);
+        if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) addTree(w, rel);
+        } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            w.pending.emplace(rel, now);   // keeps the earliest event of a burst
+        }
+    }
+}
+
+double cpuSeconds() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+} // namespace
+
+int runWatch(const std::string& dir, const std::string& ip, int port,
+             int debounceMs, const FileTransfer::SendOptions& opts) {
+    signal(SIGPIPE, SIG_IGN);   // a lost session must fail the send, not end the watch
+    Watcher w;
+    w.root = dir;
+    w.ifd  = inotify_init1(IN_CLOEXEC);
+    if (w.ifd < 0) { perror("inotify_init1"); return 1; }
+    addTree(w, "");
+
+    std::vector<unsigned char> sessionKey;
+    uint64_t chunkCounter = 0;
+    int sock = -1;
+    auto openSession = [&]() {
+        sock = Resume::connect(ip, port, sessionKey);
+        if (sock < 0) return false;
+        // Each file ends in a small frame the receiver acks; don't let Nagle hold it.
+        FileTransfer::setNoDelay(sock);
+        chunkCounter = 0;
+        return true;
+    };
+    if (!openSession()) return 1;
+
+    std::cout << "[WATCH] Syncing " << dir << " to " << ip << ":" << port << std::endl;
+    std::map<std::string, std::vector<FileTransfer::ChunkDigest>> digests;
+    const auto debounce = std::chrono::milliseconds(debounceMs);
+    const auto maxBurst = debounce * 10;   // don't starve under constant churn
+    auto lastEvent = clock_type::now();
+    auto idleSince = clock_type::now();
+    double idleCpu = cpuSeconds();
+
+    while (true) {
+        int timeout = -1;   // nothing pending: sleep in poll, no CPU while idle
+        if (!w.pending.empty()) {
+            auto now = clock_type::now();
+            auto oldest = w.pending.begin()->second;
+            for (auto& p : w.pending) oldest = std::min(oldest, p.second);
+            if (now - lastEvent < debounce && now - oldest < maxBurst) {
+                timeout = int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::min(lastEvent + debounce, oldest + maxBurst) - now).count()) + 1;
+            } else {
+                timeout = 0;
+            }
+        }
+        pollfd pfd{ w.ifd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) { perror("poll"); break; }
+        if (ready > 0) {
+            readEvents(w);
+            lastEvent = clock_type::now();
+            continue;
+        }
+        if (w.pending.empty() || timeout != 0) continue;
+
+        // Quiet long enough: ship the batch.
+        auto batchStart = clock_type::now();
+        double idleSecs = std::chrono::duration<double>(batchStart - idleSince).count();
+        double idleCpuMs = (cpuSeconds() - idleCpu) * 1000.0;
+
+        struct Sent { std::string name; clock_type::time_point event; uint64_t size, bytes; };
+        std::vector<Sent> sent;
+        bool failed = false;
+        auto batch = std::move(w.pending);
+        w.pending.clear();
+        for (auto& p : batch) {
+            std::string full = w.root + "/" + p.first;
+            struct stat st;
+            if (stat(full.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;  // gone again
+            uint64_t bytes = 0;
+            if (!FileTransfer::sendSessionFile(sock, full, p.first, sessionKey, chunkCounter,
+                                               &digests[p.first], &bytes, opts)) {
+                failed = true;
+                break;
+            }
+            sent.push_back({ p.first, p.second, uint64_t(st.st_size), bytes });
+        }
+        for (auto& s : sent) {
+            bool cancelled = false;
+            if (!FileTransfer::waitFileAck(sock, &cancelled)) { failed = true; break; }
+            batch.erase(s.name);
+            if (cancelled) {   // cut short under the sender: send what it holds now
+                std::cout << "\n[WATCH] " << s.name << " changed while being sent, queued again" << std::endl;
+                w.pending.emplace(s.name, clock_type::now());
+                continue;
+            }
+            double ms = std::chrono::duration<double, std::milli>(clock_type::now() - s.event).count();
+            std::cout << "\n[WATCH] " << s.name << ": " << s.size << " bytes, "
+                      << s.bytes << " sent, available after "
+                      << std::fixed << std::setprecision(1) << ms << " ms" << std::endl;
+        }
+        if (failed) {
+            // The receiver kept none of the files still in the batch, so
+            // they go again in full on a new session.
+            std::cerr << "[WATCH] Session lost, reconnecting" << std::endl;
+            CLOSE_SOCKET(sock);
+            for (auto& p : batch) {
+                digests.erase(p.first);
+                w.pending.insert(p);
+            }
+            for (int wait = 1; !openSession(); wait = std::min(wait * 2, RECONNECT_MAX_SECONDS)) {
+                std::cerr << "[WATCH] Retrying in " << wait << " s" << std::endl;
+                std::this_thread::sleep_for(std::chrono::seconds(wait));
+            }
+            std::cout << "[WATCH] Session reopened" << std::endl;
+            continue;
+        }
+        std::cout << "[WATCH] Idle " << std::fixed << std::setprecision(1) << idleSecs
+                  << " s before batch, " << std::setprecision(2) << idleCpuMs
+                  << " ms CPU while idle" << std::endl;
+        idleSince = clock_type::now();
+        idleCpu   = cpuSeconds();
+    }
+
+    CLOSE_SOCKET(sock);
+    close(w.ifd);
+    return 1;
+}
+
+#else
+
+int runWatch(const std::string&, const std::string&, int, int,
+             const FileTransfer::SendOptions&) {
+    std::cerr << "watch mode needs inotify and is only available on Linux" << std::endl;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,13 @@
+// watch.h
+#pragma once
+#include <string>
+#include "transfer.h"
+
+// Opens one session to ip:port, mirrors `dir` once, then keeps sending
+// files as they are closed after writing or moved in. Bursts of events
+// are coalesced until the tree has been quiet for `debounceMs`, and only
+// changed chunks of a previously sent file travel. A lost session is
+// reopened, with backoff, and what it had not delivered is sent again.
+// Needs inotify (Linux). Returns a process exit code.
+int runWatch(const std::string& dir, const std::string& ip, int port,
+             int debounceMs, const FileTransfer::SendOptions& opts);
@@ -14,21 +14,125 @@ document.querySelectorAll('[data-panel]').forEach(btn => {
   document.getElementById('start-listen').onclick = async () => {
     const alias = document.getElementById('listen-alias').value || 'QuickDropPeer';
     document.getElementById('listen-log').textContent = 'Starting…';
-    await fetch(`/listen?alias=${encodeURIComponent(alias)}`);
-    document.getElementById('listen-log').textContent = 'Broadcasting and ready to receive.';
+    const res = await fetch(`/listen?alias=${encodeURIComponent(alias)}`);
+    const { pin } = await res.json();
+    document.getElementById('received-pin').value = pin;
+    document.getElementById('listen-log').textContent = `Broadcasting and ready to receive. PIN: ${pin}`;
   };
   
   // — DISCOVER —
+  // The server pushes the peer list: a snapshot on connect, then batches
+  // of join/update/leave deltas, each tagged with the version it produced.
+  // A gap means changes were missed, so reconnect for a fresh snapshot.
+  const WS_BASE = `${location.protocol === 'https:' ? 'wss' : 'ws'}://${location.host}`;
+  const peers = new Map();
+  let peersVersion = -1, peersRenderQueued = false;
+  
+  function renderPeers() {
+    if (peersRenderQueued) return;
+    peersRenderQueued = true;
+    requestAnimationFrame(() => {
+      peersRenderQueued = false;
+      const ul  = document.getElementById('peers-list');
+      const sel = document.getElementById('send-peer');
+      const chosen = sel.value;
+      ul.innerHTML = '';
+      sel.innerHTML = '';
+      // Aliases come from peers, so build nodes rather than HTML.
+      for (const [key, p] of peers) {
+        const li = document.createElement('li');
+        li.textContent = `${p.alias} (${p.ip}:${p.port})`;
+        ul.appendChild(li);
+        sel.appendChild(new Option(p.alias, key, false, key === chosen));
+      }
+    });
+  }
+  
+  function watchPeers() {
+    const ws = new WebSocket(`${WS_BASE}/peers`);
+    ws.onmessage = ev => {
+      const m = JSON.parse(ev.data);
+      if (m.type === 'snapshot') {
+        peers.clear();
+        for (const p of m.peers) peers.set(`${p.ip}:${p.port}`, p);
+        peersVersion = m.version;
+      } else {
+        for (const c of m.changes) {
+          if (c.version <= peersVersion) continue;   // already in the snapshot
+          if (c.version !== peersVersion + 1) { ws.close(); return; }
+          const key = `${c.peer.ip}:${c.peer.port}`;
+          if (c.op === 'leave') peers.delete(key);
+          else peers.set(key, c.peer);
+          peersVersion = c.version;
+        }
+      }
+      renderPeers();
+    };
+    ws.onclose = () => setTimeout(watchPeers, 1000);
+  }
+  watchPeers();
+  
   async function refreshDiscover() {
-    const res = await fetch('/discover');
-    const list = await res.json();
-    const ul   = document.getElementById('peers-list');
-    ul.innerHTML = list.map(p=>
-      `<li>${p.alias} (${p.ip}:${p.port})</li>`
-    ).join('');
+    const list = await (await fetch('/discover')).json();
+    peers.clear();
+    for (const p of list) peers.set(`${p.ip}:${p.port}`, p);
+    renderPeers();
   }
   document.getElementById('refresh-discover').onclick = refreshDiscover;
-  refreshDiscover();
+  
+  // — RECEIVED —
+  async function refreshReceived() {
+    const pin = document.getElementById('received-pin').value.trim();
+    const ul  = document.getElementById('received-list');
+    ul.innerHTML = '';
+    if (!pin) return;   // the listing and downloads need the session PIN
+    const res = await fetch(`/received?pin=${encodeURIComponent(pin)}`);
+    if (!res.ok) { ul.textContent = res.status === 403 ? 'Invalid PIN' : `Error ${res.status}`; return; }
+    const list = await res.json();
+    // Names come from peers, so build nodes rather than HTML.
+    for (const f of list) {
+      const li = document.createElement('li');
+      const a  = document.createElement('a');
+      a.href = `${location.protocol}//${location.hostname}${encodeURI(f.url)}?pin=${encodeURIComponent(pin)}`;
+      a.download = f.name.split('/').pop();
+      a.textContent = f.name;
+      li.append(a, ` (${f.size} bytes)`);
+      ul.appendChild(li);
+    }
+  }
+  document.getElementById('refresh-received').onclick = refreshReceived;
+  refreshReceived();
+  
+  // — PROGRESS —
+  // Every transfer's counters, pushed a few times a second over a
+  // WebSocket; reconnects if the server goes away.
+  function watchProgress() {
+    const ws = new WebSocket(`${WS_BASE}/progress`);
+    ws.onmessage = ev => {
+      const ul = document.getElementById('transfers');
+      ul.innerHTML = '';
+      for (const t of JSON.parse(ev.data)) {
+        const li = document.createElement('li');
+        const mb = n => (n / 1048576).toFixed(1);
+        let text = `${t.direction === 'send' ? '↑' : '↓'} ${t.name}: ${mb(t.bytes)} MB`;
+        if (t.total) text += ` of ${mb(t.total)} MB`;
+        text += `, ${t.mbps.toFixed(1)} MB/s, ${t.stage}`;
+        if (t.stages.syncing !== undefined && t.stages.done !== undefined) {
+          text += ` (sync ${(t.stages.done - t.stages.syncing).toFixed(2)}s)`;
+        }
+        li.textContent = text;
+        if (t.total) {
+          const bar = document.createElement('progress');
+          bar.max = t.total;
+          bar.value = t.bytes;
+          li.appendChild(bar);
+        }
+        ul.appendChild(li);
+      }
+    };
+    ws.onclose = () => setTimeout(watchProgress, 2000);
+  }
+  watchProgress();
   
   // — SEND & DRAG+DROP —
   const drop = document.getElementById('drop-zone');
@@ -54,31 +158,19 @@ document.querySelectorAll('[data-panel]').forEach(btn => {
     document.getElementById('do-send').disabled = false;
   }
   
-  // populate peer dropdown
-  async function populatePeers() {
-    const res = await fetch('/discover');
-    const list = await res.json();
-    const sel = document.getElementById('send-peer');
-    sel.innerHTML = list.map(p=>
-      `<option value="${p.ip}:${p.port}">${p.alias}</option>`
-    ).join('');
-  }
-  populatePeers();
-  
   document.getElementById('do-send').onclick = async () => {
     if (!pickedFile) return;
     const sel = document.getElementById('send-peer');
     const [ip,port] = sel.value.split(':');
     const log = document.getElementById('send-log');
+    const pin = document.getElementById('send-pin').value;
     log.textContent = 'Uploading…';
   
-    const fd = new FormData();
-    fd.append('file', pickedFile);
-    fd.append('ip', ip);
-    fd.append('port', port);
-  
-    const res = await fetch('/send', { method:'POST', body: fd });
-    if (res.status === 202) log.textContent = 'Send queued!';
-    else log.textContent = `Error ${res.status}`;
+    try {
+      await uploadResumable(pickedFile, { ip, port, pin, name: pickedFile.name },
+        frac => log.textContent = `Uploading… ${Math.round(frac * 100)}%`);
+      log.textContent = 'Sent!';
+    } catch (err) {
+      log.textContent = `Error ${err.message}`;
+    }
   };
-  
\ No newline at end of file
@@ -0,0 +1,534 @@
+// writer.cpp
+// Write-behind output for the receiver.
+
+#include "writer.h"
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <libgen.h>
+
+namespace {
+
+const size_t   DIRECT_ALIGN    = 4096;
+const uint64_t DROP_CACHE_FROM = 64ull << 20;   // leave small files cached
+const uint64_t MAP_WINDOW      = 32ull << 20;   // mapped writeback granularity
+const size_t   COMPARE_BLOCK   = 64 << 10;      // skipIdentical granularity
+
+bool pwriteAll(int fd, const char* p, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, static_cast<off_t>(off));
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w; len -= w; off += w;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const char* p, size_t len) {
+    while (len > 0) {
+        ssize_t w = ::write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w; len -= w;
+    }
+    return true;
+}
+
+// Group commit for fdatasync. Callers that arrive while a sync is in
+// progress queue up; when it finishes one of them becomes the leader for
+// the whole queue, starts writeback on every file at once and then syncs
+// them, so concurrent transfers share device flushes and journal commits
+// instead of each waiting behind the others' fsyncs in turn.
+class SyncGroup {
+public:
+    bool sync(int fd) {
+        std::unique_lock<std::mutex> lk(m_);
+        pending_.push_back(fd);
+        uint64_t mine = gen_;
+        cv_.wait(lk, [&]{ return done_ > mine || !leading_; });
+        if (done_ <= mine) lead(lk);
+        bool ok = results_[fd];
+        results_.erase(fd);
+        return ok;
+    }
+
+private:
+    void lead(std::unique_lock<std::mutex>& lk) {
+        leading_ = true;
+        std::vector<int> batch;
+        batch.swap(pending_);
+        uint64_t group = gen_++;
+        lk.unlock();
+#ifdef SYNC_FILE_RANGE_WRITE
+        for (int fd : batch) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+        std::vector<char> ok(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i) ok[i] = (fdatasync(batch[i]) == 0);
+        lk.lock();
+        for (size_t i = 0; i < batch.size(); ++i) results_[batch[i]] = ok[i];
+        done_ = group + 1;
+        leading_ = false;
+        cv_.notify_all();
+    }
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::vector<int> pending_;       // fds waiting for the next group
+    std::map<int, bool> results_;    // fd → outcome, until its caller collects it
+    uint64_t gen_  = 0;              // group now collecting
+    uint64_t done_ = 0;              // groups below this are synced
+    bool leading_  = false;
+};
+
+SyncGroup& syncGroup() {
+    static SyncGroup group;
+    return group;
+}
+
+// Makes a rename durable by syncing the directory holding `path`.
+void syncParentDir(const std::string& path) {
+    std::vector<char> buf(path.begin(), path.end());
+    buf.push_back('\0');
+    int dfd = ::open(dirname(buf.data()), O_RDONLY);
+    if (dfd < 0) return;
+    fsync(dfd);
+    ::close(dfd);
+}
+
+// Unique name in the target's directory, so the final rename is atomic.
+std::string tempPathFor(const std::string& path) {
+    static std::atomic<unsigned> counter{0};
+    return path + ".part-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+}
+
+} // namespace
+
+bool parseDurability(const std::string& name, Durability& out) {
+    if (name == "none")     { out = Durability::None;     return true; }
+    if (name == "end")      { out = Durability::End;      return true; }
+    if (name == "periodic") { out = Durability::Periodic; return true; }
+    return false;
+}
+
+const char* durabilityName(Durability mode) {
+    switch (mode) {
+    case Durability::None:     return "none";
+    case Durability::End:      return "end";
+    case Durability::Periodic: return "periodic";
+    }
+    return "?";
+}
+
+FileWriter::FileWriter(const WriteOptions& opts) : opts_(opts) {
+    opts_.batchBytes = std::max(DIRECT_ALIGN, opts_.batchBytes / DIRECT_ALIGN * DIRECT_ALIGN);
+}
+
+FileWriter::~FileWriter() {
+    close();
+    for (char* p : spare_) free(p);
+}
+
+bool FileWriter::open(const std::string& path, bool keepExisting) {
+    close();
+    pos_ = 0;
+    synced_ = 0;
+    unsynced_ = 0;
+    syncSeconds_ = 0;
+    skipped_ = 0;
+    failed_ = false;
+    fresh_ = true;
+    cachedWrites_ = false;
+    path_ = path;
+    tmpPath_.clear();
+    if (path == "-") {
+        fd_ = STDOUT_FILENO;
+        ownsFd_ = false;
+        seekable_ = false;   // keep stdout strictly sequential
+    } else {
+        // Existing contents only matter to keep(); everything else is
+        // written to a fresh temporary. Devices, FIFOs and the like are
+        // written directly.
+        struct stat st;
+        bool exists  = ::stat(path.c_str(), &st) == 0;
+        bool regular = !exists || S_ISREG(st.st_mode);
+        bool inPlace = !regular || (keepExisting && exists && st.st_size > 0);
+        if (!inPlace) tmpPath_ = tempPathFor(path);
+        const std::string& name = tmpPath_.empty() ? path : tmpPath_;
+        // Shared write mappings and read-back comparisons need read access.
+        int access = ((opts_.mmap || opts_.skipIdentical) && regular) ? O_RDWR : O_WRONLY;
+        fd_ = ::open(name.c_str(), access | O_CREAT | (inPlace ? 0 : O_EXCL), 0644);
+        if (fd_ < 0) { perror("open receiveFile"); tmpPath_.clear(); return false; }
+        ownsFd_ = true;
+        fresh_ = !inPlace || !regular;
+        if (!tmpPath_.empty() && exists) fchmod(fd_, st.st_mode & 07777);   // keep the old mode
+        seekable_ = fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+#ifdef O_DIRECT
+        if (opts_.direct && seekable_) {
+            dfd_ = ::open(name.c_str(), O_WRONLY | O_DIRECT);
+            if (dfd_ < 0) perror("O_DIRECT writer, using buffered writes");
+        }
+#endif
+    }
+    stop_    = false;
+    closing_ = false;
+    return true;
+}
+
+// Wakes the disk thread for a newly queued batch, starting it if this is
+// the first. Caller holds m_.
+void FileWriter::wakeDisk() {
+    if (!disk_.joinable() && !closing_) disk_ = std::thread(&FileWriter::diskLoop, this);
+    cv_.notify_all();
+}
+
+char* FileWriter::takeBuffer() {
+    std::lock_guard<std::mutex> lk(m_);
+    if (!spare_.empty()) {
+        char* p = spare_.back();
+        spare_.pop_back();
+        return p;
+    }
+    void* p = nullptr;
+    if (posix_memalign(&p, DIRECT_ALIGN, opts_.batchBytes) != 0) return nullptr;
+    return static_cast<char*>(p);
+}
+
+// Queues the batch being filled, waiting while too much is already queued.
+void FileWriter::submit() {
+    if (cur_.len == 0) return;
+    std::unique_lock<std::mutex> lk(m_);
+    cv_.wait(lk, [&]{ return queued_ + cur_.len <= opts_.maxQueued || queued_ == 0; });
+    queued_ += cur_.len;
+    queue_.push_back(cur_);
+    cur_ = Batch{ DATA, pos_, 0, nullptr };
+    wakeDisk();
+}
+
+bool FileWriter::write(const char* data, size_t n) {
+    if (fd_ < 0) return false;
+    while (n > 0) {
+        if (cur_.buf && cur_.offset + cur_.len != pos_) {   // position moved
+            if (cur_.len == 0) cur_.offset = pos_;
+            else submit();
+        }
+        if (!cur_.buf) {
+            cur_ = Batch{ DATA, pos_, 0, takeBuffer() };
+            if (!cur_.buf) { std::cerr << "Out of memory for write batch" << std::endl; return false; }
+        }
+        size_t take = std::min(n, opts_.batchBytes - cur_.len);
+        memcpy(cur_.buf + cur_.len, data, take);
+        cur_.len += take;
+        pos_ += take;
+        data += take;
+        n -= take;
+        if (cur_.len == opts_.batchBytes) submit();
+    }
+    if (opts_.flushEachWrite) submit();
+    std::lock_guard<std::mutex> lk(m_);
+    return !failed_;
+}
+
+bool FileWriter::hole(uint64_t length) {
+    if (fd_ < 0) return false;
+    submit();
+    if (!fresh_ || !seekable_) {
+        std::lock_guard<std::mutex> lk(m_);
+        queue_.push_back(Batch{ HOLE, pos_, static_cast<size_t>(length), nullptr });
+        wakeDisk();
+    }
+    pos_ += length;
+    return true;
+}
+
+bool FileWriter::keep(uint64_t length) {
+    if (fd_ < 0) return false;
+    if (!seekable_) {
+        // Moving pos_ alone would shift everything after it in the stream.
+        std::cerr << "Keep frame for an output that can't seek" << std::endl;
+        return false;
+    }
+    if (fresh_) return false;   // nothing there to keep
+    submit();
+    pos_ += length;
+    return true;
+}
+
+void FileWriter::preallocate(uint64_t size) {
+    if (fd_ < 0 || !seekable_ || !fresh_ || size <= opts_.batchBytes) return;
+    std::lock_guard<std::mutex> lk(m_);
+    queue_.push_back(Batch{ PREALLOCATE, 0, static_cast<size_t>(size), nullptr });
+    wakeDisk();
+}
+
+// fdatasync through the process-wide group, timing the wait.
+bool FileWriter::sync() {
+    if (!seekable_) return true;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = syncGroup().sync(fd_);
+    syncSeconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!ok) perror("fdatasync receiveFile");
+    return ok;
+}
+
+bool FileWriter::map(uint64_t size) {
+    if (!opts_.mmap || fd_ < 0 || !seekable_ || !fresh_ || map_ || pos_ != 0 || size == 0) return false;
+#ifdef __linux__
+    // Allocate synchronously: writing through a mapping into blocks the
+    // filesystem cannot allocate raises SIGBUS instead of an error.
+    if (fallocate(fd_, 0, 0, static_cast<off_t>(size)) != 0) {
+        if (errno != EOPNOTSUPP) perror("fallocate mapped output");
+        return false;
+    }
+#else
+    return false;
+#endif
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) { perror("mmap output"); return false; }
+    madvise(p, size, MADV_SEQUENTIAL);
+    map_ = static_cast<char*>(p);
+    mapSize_ = size;
+    mapQueued_ = 0;
+    return true;
+}
+
+char* FileWriter::mappedAt(size_t n) {
+    if (!map_ || pos_ + n > mapSize_) return nullptr;
+    if (cur_.len > 0) submit();   // keep earlier buffered writes ordered
+    return map_ + pos_;
+}
+
+void FileWriter::advance(size_t n) {
+    pos_ += n;
+    if (pos_ >= mapQueued_ + MAP_WINDOW || opts_.flushEachWrite) submitMapped();
+}
+
+// Queues the filled part of the mapping for writeback, with the same
+// backpressure as buffered batches so dirty pages stay bounded.
+void FileWriter::submitMapped() {
+    uint64_t end = std::min(pos_, mapSize_);
+    if (!map_ || end <= mapQueued_) return;
+    Batch b{ MAPPED, mapQueued_, static_cast<size_t>(end - mapQueued_), nullptr };
+    mapQueued_ = end;
+    std::unique_lock<std::mutex> lk(m_);
+    cv_.wait(lk, [&]{ return queued_ + b.len <= opts_.maxQueued || queued_ == 0; });
+    queued_ += b.len;
+    queue_.push_back(b);
+    wakeDisk();
+}
+
+// Reads back the region a batch covers and writes only the blocks that
+// differ, coalesced into runs. Past the old end of file nothing matches.
+bool FileWriter::writeChanged(const Batch& b) {
+    if (compare_.size() < b.len) compare_.resize(b.len);
+    ssize_t have = pread(fd_, compare_.data(), b.len, static_cast<off_t>(b.offset));
+    if (have < 0) have = 0;
+    size_t runStart = 0, runLen = 0;
+    for (size_t off = 0; off < b.len; off += COMPARE_BLOCK) {
+        size_t n = std::min(COMPARE_BLOCK, b.len - off);
+        bool same = off + n <= size_t(have) && memcmp(b.buf + off, compare_.data() + off, n) == 0;
+        if (same) {
+            skipped_ += n;
+            if (runLen > 0 && !pwriteAll(fd_, b.buf + runStart, runLen, b.offset + runStart)) return false;
+            runLen = 0;
+        } else {
+            if (runLen == 0) runStart = off;
+            runLen += n;
+        }
+    }
+    return runLen == 0 || pwriteAll(fd_, b.buf + runStart, runLen, b.offset + runStart);
+}
+
+void FileWriter::writeBatch(const Batch& b) {
+    bool ok = true;
+    if (b.kind == MAPPED) {
+#ifdef SYNC_FILE_RANGE_WRITE
+        // Start writeback of the window just filled, then wait for the
+        // ones before it and drop them so dirty memory stays bounded.
+        uint64_t end = b.offset + b.len;
+        sync_file_range(fd_, static_cast<off_t>(b.offset), static_cast<off_t>(b.len),
+                        SYNC_FILE_RANGE_WRITE);
+        if (end > DROP_CACHE_FROM && b.offset > synced_) {
+            sync_file_range(fd_, static_cast<off_t>(synced_), static_cast<off_t>(b.offset - synced_),
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+            madvise(map_ + synced_, b.offset - synced_, MADV_DONTNEED);
+            posix_fadvise(fd_, static_cast<off_t>(synced_), static_cast<off_t>(b.offset - synced_),
+                          POSIX_FADV_DONTNEED);
+            synced_ = b.offset;
+        }
+#endif
+#ifdef MADV_POPULATE_WRITE
+        // Fault in the next window in one go rather than a page at a time.
+        if (end < mapSize_) {
+            uint64_t ahead = std::min<uint64_t>(MAP_WINDOW, mapSize_ - end);
+            uint64_t page  = sysconf(_SC_PAGESIZE);
+            uint64_t from  = end / page * page;
+            madvise(map_ + from, end + ahead - from, MADV_POPULATE_WRITE);
+        }
+#endif
+        if (opts_.durability == Durability::Periodic) {
+            unsynced_ += b.len;
+            if (unsynced_ >= opts_.syncEveryBytes) {
+                unsynced_ = 0;
+                if (!sync()) ok = false;
+            }
+        }
+        if (!ok) {
+            std::lock_guard<std::mutex> lk(m_);
+            failed_ = true;
+        }
+        return;
+    }
+    if (b.kind == PREALLOCATE) {
+#ifdef __linux__
+        if (fallocate(fd_, 0, 0, static_cast<off_t>(b.len)) != 0 && errno != EOPNOTSUPP) {
+            perror("fallocate");
+        }
+#endif
+        return;
+    }
+    if (b.kind == HOLE) {
+        if (seekable_) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+            if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          static_cast<off_t>(b.offset), static_cast<off_t>(b.len)) == 0) return;
+#endif
+        }
+        // No punching (or a pipe): write the zeros out.
+        static const std::vector<char> zeros(1 << 16, 0);
+        for (uint64_t done = 0; ok && done < b.len; ) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(zeros.size(), b.len - done));
+            ok = seekable_ ? pwriteAll(fd_, zeros.data(), n, b.offset + done)
+                           : writeAll(fd_, zeros.data(), n);
+            done += n;
+        }
+    } else if (!seekable_) {
+        ok = writeAll(fd_, b.buf, b.len);
+    } else if (opts_.skipIdentical && !fresh_) {
+        ok = writeChanged(b);
+    } else if (dfd_ >= 0 && b.offset % DIRECT_ALIGN == 0 && b.len % DIRECT_ALIGN == 0) {
+        // Write back what went through the page cache before going around
+        // it, so no dirty page can later land over direct-written data.
+        if (cachedWrites_ && fdatasync(fd_) != 0) { perror("fdatasync receiveFile"); ok = false; }
+        cachedWrites_ = false;
+        ok = ok && pwriteAll(dfd_, b.buf, b.len, b.offset);
+    } else {
+        ok = pwriteAll(fd_, b.buf, b.len, b.offset);
+        if (dfd_ >= 0) cachedWrites_ = true;
+#ifdef SYNC_FILE_RANGE_WRITE
+        // Start writeback of this batch now; wait for the previous ones and
+        // drop them from the cache so a huge receive streams through it.
+        uint64_t end = b.offset + b.len;
+        if (ok && end > DROP_CACHE_FROM) {
+            sync_file_range(fd_, static_cast<off_t>(b.offset), static_cast<off_t>(b.len),
+                            SYNC_FILE_RANGE_WRITE);
+            if (b.offset > synced_) {
+                sync_file_range(fd_, static_cast<off_t>(synced_), static_cast<off_t>(b.offset - synced_),
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fd_, static_cast<off_t>(synced_), static_cast<off_t>(b.offset - synced_),
+                              POSIX_FADV_DONTNEED);
+                synced_ = b.offset;
+            }
+        }
+#endif
+    }
+    if (ok && b.kind == DATA && opts_.durability == Durability::Periodic) {
+        unsynced_ += b.len;
+        if (unsynced_ >= opts_.syncEveryBytes) {
+            unsynced_ = 0;
+            if (!sync()) ok = false;
+        }
+    }
+    if (!ok) {
+        perror("write receiveFile");
+        std::lock_guard<std::mutex> lk(m_);
+        failed_ = true;
+    }
+}
+
+void FileWriter::diskLoop() {
+    std::unique_lock<std::mutex> lk(m_);
+    while (true) {
+        cv_.wait(lk, [&]{ return stop_ || !queue_.empty(); });
+        if (queue_.empty()) return;   // stop_ and drained
+        Batch b = queue_.front();
+        queue_.pop_front();
+        lk.unlock();
+        writeBatch(b);
+        lk.lock();
+        if (b.kind == DATA) {
+            queued_ -= b.len;
+            spare_.push_back(b.buf);
+        } else if (b.kind == MAPPED) {
+            queued_ -= b.len;
+        }
+        cv_.notify_all();
+    }
+}
+
+bool FileWriter::close(bool commit) {
+    if (fd_ < 0) return true;
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        closing_ = true;
+    }
+    submit();
+    submitMapped();
+    if (cur_.buf) {   // allocated but never filled
+        spare_.push_back(cur_.buf);
+        cur_ = Batch{ DATA, 0, 0, nullptr };
+    }
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (disk_.joinable()) disk_.join();
+    else                  diskLoop();   // stop_ is set: writes what is queued and returns
+    if (map_) {
+        munmap(map_, mapSize_);
+        map_ = nullptr;
+        mapSize_ = 0;
+    }
+
+    // Only a committed file is cut to what was written: an aborted
+    // in-place write must not shorten the file it was writing over.
+    bool ok = !failed_;
+    struct stat st;
+    if (commit && seekable_ && fstat(fd_, &st) == 0 && uint64_t(st.st_size) != pos_ &&
+        ftruncate(fd_, static_cast<off_t>(pos_)) != 0) {
+        perror("ftruncate receiveFile");
+        ok = false;
+    }
+    bool durable = opts_.durability != Durability::None;
+    if (ok && commit && durable && !sync()) ok = false;
+    if (dfd_ >= 0) ::close(dfd_);
+    if (ownsFd_) ::close(fd_);
+    fd_ = dfd_ = -1;
+
+    if (!tmpPath_.empty()) {
+        if (ok && commit) {
+            if (rename(tmpPath_.c_str(), path_.c_str()) != 0) {
+                perror("rename receiveFile");
+                ok = false;
+            } else if (durable) {
+                syncParentDir(path_);
+            }
+        }
+        if (!ok || !commit) unlink(tmpPath_.c_str());
+        tmpPath_.clear();
+    }
+    return ok;
+}
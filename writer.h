@@ -0,0 +1,151 @@
+// writer.h
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+// When received data is forced to stable storage.
+enum class Durability {
+    None,       // leave it to the kernel's writeback
+    End,        // fsync once the file is complete, before it is renamed into place
+    Periodic,   // fsync every WriteOptions::syncEveryBytes, and at the end
+};
+
+// Parses "none", "end" or "periodic"; false if unknown.
+bool parseDurability(const std::string& name, Durability& out);
+const char* durabilityName(Durability mode);
+
+// Receiver write-path tuning.
+struct WriteOptions {
+    bool   direct         = false;        // O_DIRECT for aligned batches (others buffered,
+                                          // flushed before the next direct one)
+    bool   flushEachWrite = false;        // hand every write to the disk thread at once
+    bool   mmap           = false;        // let map() place data straight in a file mapping
+    bool   skipIdentical  = false;        // in-place updates: don't rewrite unchanged blocks
+    size_t batchBytes     = 4 << 20;      // coalesce writes into I/Os this large
+    size_t maxQueued      = 256 << 20;    // bytes queued before write() waits for the disk
+    Durability durability = Durability::End;
+    uint64_t syncEveryBytes = 64ull << 20;  // Periodic interval
+};
+
+// Write-behind output file. write() copies into large batches that a
+// dedicated disk thread writes with pwrite, so the caller (the network
+// loop) only waits on the disk when maxQueued bytes are already pending.
+// The thread starts with the first batch queued before close(); a file
+// that fits in one batch is written by close() itself, so many small
+// files don't each pay for a thread.
+// Past the first 64 MB written pages are pushed out with sync_file_range
+// and dropped from the page cache so large receives don't evict hot data.
+//
+// New files are written under a temporary name next to the target and
+// renamed over it by close(), so readers never see a partial file. The
+// fsyncs the durability mode asks for are group-committed with those of
+// every other FileWriter in the process.
+class FileWriter {
+public:
+    explicit FileWriter(const WriteOptions& opts = WriteOptions());
+    ~FileWriter();
+
+    // Opens `path` ("-" = stdout). With keepExisting the current contents
+    // stay in place so keep() can leave unchanged ranges untouched; a
+    // non-empty file opened that way is updated in place rather than
+    // through a temporary.
+    bool open(const std::string& path, bool keepExisting);
+    bool isOpen() const { return fd_ >= 0; }
+    // True if the file started out empty, so skipped ranges are holes.
+    bool fresh() const { return fresh_; }
+    uint64_t position() const { return pos_; }
+
+    // Reserves `size` bytes of disk up front for a fresh file (fallocate
+    // where available), done on the disk thread. Files no larger than a
+    // batch are written in one go anyway and are left alone.
+    void preallocate(uint64_t size);
+
+    // With WriteOptions::mmap: allocates `size` bytes for a fresh file
+    // and maps them, so mappedAt() can hand out the destination of each
+    // chunk. Written windows are flushed and dropped behind the writer,
+    // which waits once maxQueued bytes are dirty. False if not mapped.
+    bool map(uint64_t size);
+    // Where the next `n` bytes go in the mapping, or nullptr if they fall
+    // outside it (use write() then). Call advance(n) once they are filled.
+    char* mappedAt(size_t n);
+    void advance(size_t n);
+
+    // Moves where the next write, hole or keep lands; multipath receives
+    // arrive out of order. Ranges skipped over in a fresh file stay holes.
+    void seek(uint64_t offset) { pos_ = offset; }
+
+    bool write(const char* data, size_t n);
+    // Zero range: left sparse in fresh files, punched out otherwise.
+    bool hole(uint64_t length);
+    // Range the file already holds; only the position moves. False on an
+    // output that can't seek, such as stdout, where nothing can be skipped,
+    // and on a fresh file, which holds nothing to keep.
+    bool keep(uint64_t length);
+
+    // Waits for queued I/O, trims the file to position(), syncs it as the
+    // durability mode asks and renames it into place. With commit false
+    // (an aborted receive) the temporary is discarded instead. Returns
+    // false if any write, sync or the rename failed.
+    bool close(bool commit = true);
+
+    // Seconds spent waiting in fsync since open().
+    double syncSeconds() const { return syncSeconds_; }
+    // With skipIdentical: bytes found already on disk and not rewritten.
+    // Complete once close() has returned.
+    uint64_t skippedBytes() const { return skipped_; }
+
+private:
+    enum Kind { DATA, HOLE, PREALLOCATE, MAPPED };
+    struct Batch {
+        Kind     kind;
+        uint64_t offset;
+        size_t   len;
+        char*    buf;
+    };
+
+    void submit();
+    void submitMapped();
+    void wakeDisk();
+    void diskLoop();
+    void writeBatch(const Batch& b);
+    bool sync();
+    bool writeChanged(const Batch& b);
+    char* takeBuffer();
+
+    WriteOptions opts_;
+    int      fd_  = -1;       // buffered descriptor
+    int      dfd_ = -1;       // O_DIRECT descriptor, if requested and supported
+    bool     cachedWrites_ = false;   // with dfd_: fd_ has written since its last flush
+    bool     ownsFd_   = false;
+    bool     seekable_ = true;
+    bool     fresh_    = true;
+    uint64_t pos_      = 0;   // logical position, holes and keeps included
+    std::string path_;         // final name
+    std::string tmpPath_;      // name being written, if not path_
+    uint64_t unsynced_    = 0; // bytes written since the last periodic sync
+    char*    map_     = nullptr; // output mapping, if map() succeeded
+    uint64_t mapSize_ = 0;
+    uint64_t mapQueued_ = 0;   // mapped bytes below this are queued for writeback
+    double   syncSeconds_ = 0;
+    uint64_t skipped_     = 0; // disk thread only
+    std::vector<char> compare_;   // existing contents read back for skipIdentical
+
+    Batch    cur_{ DATA, 0, 0, nullptr };   // batch being filled by write()
+
+    std::mutex              m_;
+    std::condition_variable cv_;
+    std::deque<Batch>       queue_;
+    std::vector<char*>      spare_;        // reusable aligned batch buffers
+    size_t                  queued_  = 0;  // bytes in queue_ and being written
+    bool                    stop_    = false;
+    bool                    closing_ = false;  // close() drains the queue itself if no thread is up
+    bool                    failed_  = false;
+    uint64_t                synced_  = 0;  // written and dropped from cache up to here
+    std::thread             disk_;
+};